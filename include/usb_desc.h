@@ -0,0 +1,33 @@
+// Standard USB descriptor definitions for the vendor class devices.
+//
+// Included before the USB_CUST_* definitions of the project, the descriptors
+// themselves are built from them in usb_intr.h.
+
+#pragma once
+
+#include <stdint.h>
+
+#ifndef DEFAULT_ENDP0_SIZE
+#define DEFAULT_ENDP0_SIZE  8
+#endif
+
+// descriptor lengths
+#define USB_DEV_DESC_LEN    18
+#define USB_CFG_DESC_LEN    9
+#define USB_ITF_DESC_LEN    9
+#define USB_ENDP_DESC_LEN   7
+
+// string descriptor indexes
+#define USB_STR_LANG        0
+#define USB_STR_VENDOR      1
+#define USB_STR_PRODUCT     2
+#define USB_STR_SERIAL      3
+
+// bcdUSB 1.10 and bcdDevice 1.00
+#define USB_DESC_BCD_USB    0x10, 0x01
+#define USB_DESC_BCD_DEV    0x00, 0x01
+
+#define USB_DESC_WORD(w)    ((w) & 0xFF), (((w) >> 8) & 0xFF)
+
+// language ID string: US English
+#define USB_DESC_LANG       0x04, USB_DESCR_TYP_STRING, 0x09, 0x04
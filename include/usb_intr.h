@@ -0,0 +1,357 @@
+// USB device engine for the vendor class devices: the USB interrupt handler,
+// the descriptors and the standard requests.
+//
+// The project defines before including this file:
+//  USB_CUST_VENDOR_ID, USB_CUST_PRODUCT_ID
+//  USB_CUST_CONF_POWER                 - the bus current in mA
+//  USB_CUST_VENDOR_NAME(_LEN)          - ASCII initialisers with the ending 0
+//  USB_CUST_PRODUCT_NAME(_LEN)
+//  USB_CUST_CONTROL_TRANSFER_HANDLER   - SETUP stage of a vendor request, returns
+//                                        the IN length (data in Ep0Buffer) or
+//                                        0xFF to stall the request
+//  USB_CUST_CONTROL_DATA_HANDLER       - an OUT data packet of a vendor request
+//                                        is in Ep0Buffer (USB_RX_LEN bytes)
+//  USB_CUST_SUSPEND_HANDLER            - the bus was suspended
+// and optionally:
+//  USB_CUST_EP_DESC_COUNT              - the endpoints of interface 0 and their
+//  USB_CUST_EP_DESC                      descriptors (7 bytes each)
+//  USB_CUST_EP_INIT_HANDLER            - sets those endpoints up, called by
+//                                        USBDeviceCfg() and on every bus reset
+//  USB_CUST_EP_TRANSFER_HANDLER        - a transfer on those endpoints finished,
+//                                        USB_INT_ST tells which one
+//  USB_CUST_SERIAL_HANDLER             - builds the serial number string
+//                                        descriptor in Ep0Buffer, returns its length
+//  USB_CUST_ISR_ENTER_HANDLER          - the USB interrupt starts and ends, for
+//  USB_CUST_ISR_EXIT_HANDLER             timing it
+//
+// All the handlers run in the USB interrupt.
+
+#pragma once
+
+#ifndef USB_CUST_EP_DESC_COUNT
+#define USB_CUST_EP_DESC_COUNT  0
+#endif
+
+#ifdef USB_CUST_SERIAL_HANDLER
+#define USB_DESC_SERIAL         USB_STR_SERIAL
+#else
+#define USB_DESC_SERIAL         0
+#endif
+
+#define USB_CFG_TOTAL_LEN       (USB_CFG_DESC_LEN + USB_ITF_DESC_LEN + \
+                                 USB_CUST_EP_DESC_COUNT * USB_ENDP_DESC_LEN)
+
+__xdata __at (0x0000) uint8_t Ep0Buffer[DEFAULT_ENDP0_SIZE];
+
+// copy of the SETUP packet, Ep0Buffer is reused by the data stage
+__idata USB_SETUP_REQ usbSetupReq;
+#define UsbSetupBuf (&usbSetupReq)
+uint8_t UsbIntrSetupReq;
+
+static __idata uint8_t usbSetupLen;     // bytes left to send, the new address for SET_ADDRESS
+static __idata uint8_t usbConfig;
+static __code uint8_t* __idata usbDescr; // the descriptor being sent
+static __idata uint8_t usbDescrPos;
+static __idata uint8_t usbDescrAscii;   // usbDescr is an ASCII string: the length in UTF-16
+
+static __code uint8_t usbDevDesc[] = {
+    USB_DEV_DESC_LEN, USB_DESCR_TYP_DEVICE, USB_DESC_BCD_USB,
+    0x00, 0x00, 0x00, DEFAULT_ENDP0_SIZE,
+    USB_DESC_WORD(USB_CUST_VENDOR_ID), USB_DESC_WORD(USB_CUST_PRODUCT_ID), USB_DESC_BCD_DEV,
+    USB_STR_VENDOR, USB_STR_PRODUCT, USB_DESC_SERIAL, 1
+};
+
+static __code uint8_t usbCfgDesc[] = {
+    USB_CFG_DESC_LEN, USB_DESCR_TYP_CONFIG, USB_DESC_WORD(USB_CFG_TOTAL_LEN),
+    1, 1, 0, 0x80, USB_CUST_CONF_POWER / 2,
+    // interface 0, vendor class
+    USB_ITF_DESC_LEN, USB_DESCR_TYP_INTERF, 0, 0, USB_CUST_EP_DESC_COUNT,
+    0xFF, 0x00, 0x00, 0,
+#ifdef USB_CUST_EP_DESC
+    USB_CUST_EP_DESC
+#endif
+};
+
+static __code uint8_t usbLangDesc[] = { USB_DESC_LANG };
+static __code uint8_t usbVendorName[USB_CUST_VENDOR_NAME_LEN] = USB_CUST_VENDOR_NAME;
+static __code uint8_t usbProductName[USB_CUST_PRODUCT_NAME_LEN] = USB_CUST_PRODUCT_NAME;
+
+// the next packet of usbDescr into Ep0Buffer, returns its length
+static uint8_t usbDescrPacket(void)
+{
+    uint8_t len = usbSetupLen < DEFAULT_ENDP0_SIZE ? usbSetupLen : DEFAULT_ENDP0_SIZE;
+    uint8_t i;
+
+    for (i = 0; i < len; i++, usbDescrPos++) {
+        uint8_t p = usbDescrPos;
+        if (!usbDescrAscii) {
+            Ep0Buffer[i] = usbDescr[p];
+        } else if (p < 2) {
+            Ep0Buffer[i] = p ? USB_DESCR_TYP_STRING : usbDescrAscii;
+        } else {
+            Ep0Buffer[i] = (p & 1) ? 0 : usbDescr[(p - 2) >> 1]; // UTF-16LE
+        }
+    }
+    usbSetupLen -= len;
+    return len;
+}
+
+// SET_FEATURE / CLEAR_FEATURE(ENDPOINT_HALT) on the IN or OUT side of an
+// endpoint, returns the new UEPn_CTRL. A clear resets the data toggle and
+// turns a stall into NAK (IN) or ACK (OUT), an armed endpoint stays armed.
+static uint8_t usbHaltCtrl(uint8_t ctrl, uint8_t in, uint8_t halt)
+{
+    uint8_t mask = in ? MASK_UEP_T_RES : MASK_UEP_R_RES;
+    uint8_t stall = in ? UEP_T_RES_STALL : UEP_R_RES_STALL;
+
+    if (halt) {
+        return ctrl & ~mask | stall;
+    }
+    if ((ctrl & mask) == stall) {
+        ctrl = ctrl & ~mask | (in ? UEP_T_RES_NAK : UEP_R_RES_ACK);
+    }
+    return ctrl & ~(in ? bUEP_T_TOG : bUEP_R_TOG);
+}
+
+static uint8_t usbEndpointHalt(uint8_t ep, uint8_t halt)
+{
+    switch (ep & 0x7F) {
+        case 0 : break;
+        case 1 : UEP1_CTRL = usbHaltCtrl(UEP1_CTRL, ep & 0x80, halt); break;
+        case 2 : UEP2_CTRL = usbHaltCtrl(UEP2_CTRL, ep & 0x80, halt); break;
+        case 3 : UEP3_CTRL = usbHaltCtrl(UEP3_CTRL, ep & 0x80, halt); break;
+        default : return 0xFF;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Standard requests of the SETUP stage
+*
+* Returns : the length of the response in Ep0Buffer, 0xFF to stall
+*******************************************************************************/
+static uint8_t usbStandardRequest(void)
+{
+    uint8_t recipient = UsbSetupBuf->bRequestType & USB_REQ_RECIP_MASK;
+    uint8_t len;
+
+    switch (UsbSetupBuf->bRequest) {
+        case USB_GET_DESCRIPTOR : {
+            usbDescrPos = 0;
+            usbDescrAscii = 0;
+            switch (UsbSetupBuf->wValueH) {
+                case USB_DESCR_TYP_DEVICE : {
+                    usbDescr = usbDevDesc;
+                    len = sizeof(usbDevDesc);
+                } break;
+                case USB_DESCR_TYP_CONFIG : {
+                    usbDescr = usbCfgDesc;
+                    len = sizeof(usbCfgDesc);
+                } break;
+                case USB_DESCR_TYP_STRING : {
+                    switch (UsbSetupBuf->wValueL) {
+                        case USB_STR_LANG : {
+                            usbDescr = usbLangDesc;
+                            len = sizeof(usbLangDesc);
+                        } break;
+                        case USB_STR_VENDOR : {
+                            usbDescr = usbVendorName;
+                            len = usbDescrAscii = 2 * USB_CUST_VENDOR_NAME_LEN;
+                        } break;
+                        case USB_STR_PRODUCT : {
+                            usbDescr = usbProductName;
+                            len = usbDescrAscii = 2 * USB_CUST_PRODUCT_NAME_LEN;
+                        } break;
+#ifdef USB_CUST_SERIAL_HANDLER
+                        // built in Ep0Buffer, a single packet
+                        case USB_STR_SERIAL : {
+                            len = USB_CUST_SERIAL_HANDLER;
+                            if (len > usbSetupLen) {
+                                len = usbSetupLen;
+                            }
+                            usbSetupLen = 0;
+                            return len;
+                        } break;
+#endif
+                        default :
+                            return 0xFF;
+                    }
+                } break;
+                default :
+                    return 0xFF;
+            }
+            if (usbSetupLen > len) {
+                usbSetupLen = len;
+            }
+            return usbDescrPacket();
+        } break;
+        // the address is set after the status stage
+        case USB_SET_ADDRESS : {
+            usbSetupLen = UsbSetupBuf->wValueL;
+        } break;
+        case USB_GET_CONFIGURATION : {
+            Ep0Buffer[0] = usbConfig;
+            return usbSetupLen ? 1 : 0;
+        } break;
+        case USB_SET_CONFIGURATION : {
+            usbConfig = UsbSetupBuf->wValueL;
+        } break;
+        case USB_GET_INTERFACE : {
+            Ep0Buffer[0] = 0;
+            return usbSetupLen ? 1 : 0;
+        } break;
+        case USB_SET_INTERFACE : {
+            if (UsbSetupBuf->wValueL) {
+                return 0xFF; // only the alternate setting 0
+            }
+        } break;
+        case USB_GET_STATUS : {
+            Ep0Buffer[0] = 0;
+            Ep0Buffer[1] = 0;
+            return usbSetupLen < 2 ? usbSetupLen : 2;
+        } break;
+        case USB_CLEAR_FEATURE :
+        case USB_SET_FEATURE : {
+            if (recipient == USB_REQ_RECIP_DEVICE && UsbSetupBuf->wValueL == USB_REQ_FEAT_REMOTE_WAKEUP) {
+                break; // not supported, but harmless
+            }
+            if (recipient == USB_REQ_RECIP_ENDP && UsbSetupBuf->wValueL == USB_REQ_FEAT_ENDP_HALT) {
+                return usbEndpointHalt(UsbSetupBuf->wIndexL, UsbSetupBuf->bRequest == USB_SET_FEATURE);
+            }
+            return 0xFF;
+        } break;
+        default :
+            return 0xFF;
+    }
+    return 0;
+}
+
+// SETUP stage on endpoint 0
+static void usbSetup(void)
+{
+    uint16_t len = 0xFF;
+    uint8_t i;
+
+    if (USB_RX_LEN == sizeof(USB_SETUP_REQ)) {
+        for (i = 0; i < sizeof(USB_SETUP_REQ); i++) {
+            ((__idata uint8_t*) UsbSetupBuf)[i] = Ep0Buffer[i];
+        }
+        usbSetupLen = UsbSetupBuf->wLengthH ? 0xFF : UsbSetupBuf->wLengthL;
+        UsbIntrSetupReq = UsbSetupBuf->bRequest;
+        if ((UsbSetupBuf->bRequestType & USB_REQ_TYP_MASK) != USB_REQ_TYP_STANDARD) {
+            len = USB_CUST_CONTROL_TRANSFER_HANDLER;
+            if (len != 0xFF && len > usbSetupLen) {
+                len = usbSetupLen;
+            }
+        } else {
+            len = usbStandardRequest();
+        }
+    }
+
+    if (len == 0xFF) {
+        UEP0_CTRL = bUEP_R_TOG | bUEP_T_TOG | UEP_R_RES_STALL | UEP_T_RES_STALL;
+    } else {
+        // DATA1 for the IN data, or for the status stage of an OUT request
+        UEP0_T_LEN = len;
+        UEP0_CTRL = bUEP_R_TOG | bUEP_T_TOG | UEP_R_RES_ACK | UEP_T_RES_ACK;
+    }
+}
+
+// bus reset and power up: endpoint 0 idle, no address, then the project's endpoints
+static void usbReset(void)
+{
+    UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+    UEP0_T_LEN = 0;
+    USB_DEV_AD = 0x00;
+    usbConfig = 0;
+#ifdef USB_CUST_EP_INIT_HANDLER
+    USB_CUST_EP_INIT_HANDLER;
+#endif
+}
+
+/*******************************************************************************
+* USB interrupt handler. It runs in register bank 0: the handlers it calls are
+* compiled for bank 0 and may be called from main() too, so the registers are
+* saved on entry.
+*******************************************************************************/
+void DeviceInterrupt(void) __interrupt (INT_NO_USB)
+{
+#ifdef USB_CUST_ISR_ENTER_HANDLER
+    USB_CUST_ISR_ENTER_HANDLER;
+#endif
+    if (UIF_TRANSFER) {
+        switch (USB_INT_ST & (MASK_UIS_TOKEN | MASK_UIS_ENDP)) {
+            case UIS_TOKEN_SETUP | 0 : {
+                usbSetup();
+            } break;
+            case UIS_TOKEN_IN | 0 : {
+                if ((UsbSetupBuf->bRequestType & USB_REQ_TYP_MASK) == USB_REQ_TYP_STANDARD) {
+                    if (UsbSetupBuf->bRequest == USB_GET_DESCRIPTOR) {
+                        UEP0_T_LEN = usbDescrPacket();
+                        UEP0_CTRL ^= bUEP_T_TOG;
+                        break;
+                    }
+                    if (UsbSetupBuf->bRequest == USB_SET_ADDRESS) {
+                        USB_DEV_AD = USB_DEV_AD & bUDA_GP_BIT | usbSetupLen;
+                    }
+                }
+                // the last packet or the status stage is done
+                UEP0_T_LEN = 0;
+                UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+            } break;
+            case UIS_TOKEN_OUT | 0 : {
+                // DATA stage of a vendor OUT request, the status stage of
+                // the IN requests otherwise
+                if (!(UsbSetupBuf->bRequestType & USB_REQ_TYP_IN) &&
+                    (UsbSetupBuf->bRequestType & USB_REQ_TYP_MASK) != USB_REQ_TYP_STANDARD) {
+                    if (U_TOG_OK) {
+                        USB_CUST_CONTROL_DATA_HANDLER;
+                        UEP0_CTRL ^= bUEP_R_TOG;
+                    }
+                    break; // the status stage is armed since SETUP
+                }
+                UEP0_T_LEN = 0;
+                UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+            } break;
+#ifdef USB_CUST_EP_TRANSFER_HANDLER
+            default : {
+                USB_CUST_EP_TRANSFER_HANDLER;
+            } break;
+#endif
+        }
+        UIF_TRANSFER = 0;
+    } else if (UIF_BUS_RST) {
+        usbReset();
+        UIF_SUSPEND = 0;
+        UIF_TRANSFER = 0;
+        UIF_BUS_RST = 0;
+    } else if (UIF_SUSPEND) {
+        UIF_SUSPEND = 0;
+        if (USB_MIS_ST & bUMS_SUSPEND) {
+            USB_CUST_SUSPEND_HANDLER;
+        }
+    } else {
+        USB_INT_FG = 0xFF; // unexpected interrupt
+    }
+#ifdef USB_CUST_ISR_EXIT_HANDLER
+    USB_CUST_ISR_EXIT_HANDLER;
+#endif
+}
+
+/*******************************************************************************
+* USB device mode set up: full speed, endpoint 0 at Ep0Buffer and the project's
+* endpoints, then the pull-up is connected and the USB interrupt enabled
+*******************************************************************************/
+void USBDeviceCfg(void)
+{
+    USB_CTRL = 0x00;
+    UDEV_CTRL = bUD_PD_DIS | bUD_PORT_EN;
+    UEP0_DMA = (uint16_t) Ep0Buffer;
+    UEP4_1_MOD &= ~(bUEP4_RX_EN | bUEP4_TX_EN);
+    usbReset();
+
+    USB_INT_FG = 0xFF;
+    USB_INT_EN = bUIE_SUSPEND | bUIE_TRANSFER | bUIE_BUS_RST;
+    USB_CTRL = bUC_DEV_PU_EN | bUC_INT_BUSY | bUC_DMA_EN;
+    IE_USB = 1;
+}
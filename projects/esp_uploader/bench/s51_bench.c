@@ -0,0 +1,302 @@
+// Cycle benchmark of the firmware hot paths under the ucsim s51 simulator
+//
+// The firmware (src/main.c) is built with the main() below instead of its
+// own: it feeds the USB and UART handlers scripted traffic with the
+// interrupts off and times every call with Timer0. The interrupt handlers
+// are called like plain functions, their RETI returns as a RET would.
+//
+// s51 models a standard 8051: Timer0 counts machine cycles of 12 clocks.
+// The CH55x core needs far fewer clocks for the same code, so the numbers
+// catch regressions between builds, they are not times on the chip.
+//
+// The handlers under test write to SBUF too, the report is printed at the
+// end after a "#BENCH" line, see the Makefile.
+
+#define main fwMain
+#include "../src/main.c"
+#undef main
+
+#define BENCH_CALLS 16
+#define BENCH_BYTES 200
+#define BENCH_BLOCK 64 // FLASH_DATA block of the framer test
+#define BENCH_MAX   12
+
+typedef struct {
+    const char* name;
+    uint16_t calls;
+    uint16_t bytes;
+    uint32_t cycles;
+} bench_result_t;
+
+__xdata bench_result_t benchResults[BENCH_MAX];
+__xdata uint8_t benchCount;
+__xdata uint32_t benchCycles;
+__xdata uint16_t benchBytes;
+__xdata uint16_t benchCalls;
+__xdata uint16_t benchStart;
+__xdata uint16_t benchOverhead;
+__xdata uint8_t benchBuf[2];
+
+// time a statement, the cost of the Timer0 read is subtracted
+#define BENCH(S) do { \
+        uint16_t t_; \
+        TIMER0_READ(benchStart); \
+        S; \
+        TIMER0_READ(t_); \
+        benchCycles += (uint16_t)(t_ - benchStart - benchOverhead); \
+        benchCalls++; \
+    } while (0)
+
+static void benchReset(void)
+{
+    benchCycles = 0;
+    benchBytes = 0;
+    benchCalls = 0;
+}
+
+static void benchRecord(const char* name)
+{
+    __xdata bench_result_t* r = &benchResults[benchCount];
+
+    if (benchCount < BENCH_MAX) {
+        r->name = name;
+        r->calls = benchCalls;
+        r->bytes = benchBytes;
+        r->cycles = benchCycles;
+        benchCount++;
+    }
+}
+
+int putchar(int c)
+{
+    SBUF = c;
+    while (!TI);
+    TI = 0;
+    return c;
+}
+
+// queue a byte for the UART, see pushTx()
+static void benchPush(uint8_t c)
+{
+    benchBuf[0] = c;
+    pushTx(benchBuf, 1);
+}
+
+// a vendor request in the setup buffer, as the USB interrupt gets it
+static void benchSetup(uint8_t request, uint16_t length)
+{
+    UsbSetupBuf->bRequest = request;
+    UsbSetupBuf->wValueL = 0;
+    UsbSetupBuf->wValueH = 0;
+    UsbSetupBuf->wIndexL = 0;
+    UsbSetupBuf->wIndexH = 0;
+    UsbSetupBuf->wLengthL = length & 0xFF;
+    UsbSetupBuf->wLengthH = length >> 8;
+    UsbIntrSetupReq = request;
+}
+
+// 'len' received bytes in the UART read ring
+static void benchFillRx(uint8_t len)
+{
+    uint8_t i;
+
+    rxTail = rxHead;
+    for (i = 0; i < len; i++) {
+        rxRing[rxHead & RX_RING_MASK] = i;
+        rxHead++;
+    }
+}
+
+// send the write FIFO through the UART interrupt until it is empty,
+// returns the bytes sent
+static uint16_t benchDrainTx(void)
+{
+    uint32_t sent = uartTxBytes;
+
+    txIdle = 0;
+    while (!txIdle) {
+        TI = 1;
+        BENCH(UART0_ISR());
+    }
+    return uartTxBytes - sent;
+}
+
+static void benchUsb(void)
+{
+    uint8_t i;
+
+    benchReset();
+    for (i = 0; i < BENCH_CALLS; i++) {
+        benchFillRx(DEFAULT_ENDP0_SIZE);
+        benchSetup(COMMAND_READ_UART, DEFAULT_ENDP0_SIZE);
+        BENCH(benchBytes += handleVendorControlTransfer());
+    }
+    rxTail = rxHead;
+    benchRecord("ep0 READ_UART");
+
+    // setup and data stage are one request
+    benchReset();
+    for (i = 0; i < BENCH_CALLS; i++) {
+        txTail = txHead;
+        benchSetup(COMMAND_WRITE_UART, DEFAULT_ENDP0_SIZE);
+        BENCH(handleVendorControlTransfer());
+        USB_RX_LEN = DEFAULT_ENDP0_SIZE;
+        BENCH(handleVendorDataTransfer());
+        benchCalls--;
+        benchBytes += DEFAULT_ENDP0_SIZE;
+    }
+    txTail = txHead;
+    benchRecord("ep0 WRITE_UART");
+
+    benchReset();
+    for (i = 0; i < BENCH_CALLS; i++) {
+        benchSetup(COMMAND_GET_UART_STATUS, DEFAULT_ENDP0_SIZE);
+        BENCH(handleVendorControlTransfer());
+    }
+    benchRecord("ep0 GET_UART_STATUS");
+
+    // bulk OUT packets straight into the write FIFO
+    benchReset();
+    initVendorEndpoints();
+    ep1Busy = 1;
+    for (i = 0; i < BENCH_CALLS; i++) {
+        txTail = txHead;
+        USB_INT_ST = UIS_TOKEN_OUT | 2;
+        U_TOG_OK = 1;
+        USB_RX_LEN = EP2_SIZE;
+        BENCH(handleVendorEndpointTransfer());
+        benchBytes += EP2_SIZE;
+    }
+    txTail = txHead;
+    benchRecord("bulk OUT");
+
+    // bulk IN packets re-armed from the read ring
+    benchReset();
+    bulkMode = 1;
+    for (i = 0; i < BENCH_CALLS; i++) {
+        benchFillRx(EP2_SIZE);
+        USB_INT_ST = UIS_TOKEN_IN | 2;
+        BENCH(handleVendorEndpointTransfer());
+        benchBytes += UEP2_T_LEN;
+    }
+    bulkMode = 0;
+    benchRecord("bulk IN");
+}
+
+static void benchUart(void)
+{
+    uint8_t i;
+
+    // raw bytes from the write FIFO
+    benchReset();
+    for (i = 0; i < BENCH_BYTES; i++) {
+        benchPush(i);
+    }
+    benchBytes = benchDrainTx();
+    benchRecord("uart0 isr: tx byte");
+
+    // raw bytes into the read ring, emptied as the host would
+    benchReset();
+    for (i = 0; i < BENCH_BYTES; i++) {
+        if (RX_COUNT > RX_RING_SIZE / 2) {
+            rxTail = rxHead;
+        }
+        RI = 1;
+        BENCH(UART0_ISR());
+    }
+    rxTail = rxHead;
+    benchBytes = BENCH_BYTES;
+    benchRecord("uart0 isr: rx byte");
+
+    // a SLIP frame with an escape, sent and decoded back by the loopback
+    benchReset();
+    loopback = 1;
+    rxFrames = 1;
+    rxFrameState = RX_FRAME_IDLE;
+    benchPush(SLIP_END);
+    for (i = 0; i < 30; i++) {
+        if (i == 7) {
+            benchPush(SLIP_ESC);
+            benchPush(SLIP_ESC_END);
+        } else {
+            benchPush(i);
+        }
+    }
+    benchPush(SLIP_END);
+    benchBytes = benchDrainTx();
+    loopback = 0;
+    rxFrames = 0;
+    rxTail = rxHead;
+    benchRecord("uart0 isr: slip loopback");
+
+    // a FLASH_DATA packet built by the framer from the block prefix
+    benchReset();
+    frameBlockSize = BENCH_BLOCK;
+    framePad = 0xFF;
+    frameSeq = 0;
+    frameState = FRAME_CHECKSUM;
+    benchPush(0xEF);
+    benchPush(BENCH_BLOCK);
+    benchPush(0);
+    for (i = 0; i < BENCH_BLOCK; i++) {
+        benchPush(i);
+    }
+    benchBytes = benchDrainTx();
+    frameState = FRAME_OFF;
+    benchRecord("uart0 isr: flash frame");
+
+    // UART1 capture
+    benchReset();
+    uart1On = 1;
+    for (i = 0; i < BENCH_BYTES; i++) {
+        if (U1_COUNT > U1_RING_SIZE / 2) {
+            u1Tail = u1Head;
+        }
+        U1RI = 1;
+        BENCH(UART1_ISR());
+    }
+    uart1On = 0;
+    u1Tail = u1Head;
+    benchBytes = BENCH_BYTES;
+    benchRecord("uart1 isr: rx byte");
+}
+
+void main(void)
+{
+    uint8_t i;
+    uint16_t t;
+
+    EA = 0;
+    mInitSTDIO();
+    uartRate = UART0_RATE;
+    txIdle = 1;
+    bootLogChange = BOOT_LOG_NO_CHANGE;
+    bootLogLen = BOOT_LOG_SIZE; // the recorder is not part of the byte path
+    ep1Busy = 1;                // nobody collects the notifications
+
+    TMOD = TMOD & ~(bT0_GATE | bT0_CT | MASK_T0_MOD) | bT0_M0;
+    TR0 = 1;
+    TIMER0_READ(benchStart);
+    TIMER0_READ(t);
+    benchOverhead = t - benchStart;
+
+    benchUsb();
+    benchUart();
+
+    printf("\n#BENCH machine cycles of 12 clocks, FREQ_SYS %lu\n", (uint32_t)FREQ_SYS);
+    printf("%-26s %5s %6s %9s %8s %7s\n", "path", "calls", "bytes", "cycles",
+        "/call", "/byte");
+    for (i = 0; i < benchCount; i++) {
+        __xdata bench_result_t* r = &benchResults[i];
+        uint32_t perByte = r->bytes ? r->cycles * 10 / r->bytes : 0;
+
+        printf("%-26s %5u %6u %9lu %8lu %5lu.%lu\n", r->name, r->calls, r->bytes,
+            r->cycles, r->cycles / r->calls, perByte / 10, perByte % 10);
+    }
+    printf("#END\n");
+
+    // 0xA5 is not an 8051 instruction: s51 stops here
+    __asm
+        .db 0xa5
+    __endasm;
+}
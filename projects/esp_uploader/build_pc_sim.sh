@@ -0,0 +1,15 @@
+#!/bin/sh
+# Builds pc_upl_sim: the uploader linked against a simulated bridge (the
+# firmware from src/ running on a host-side CH55x model) and a simulated ESP.
+# No hardware and no libusb library needed, but its header <libusb-1.0/libusb.h>
+# is (libusb-1.0-0-dev), SIM_CFLAGS=-I<dir> points to it if installed elsewhere.
+#   ./pc_upl_sim -f 0x0 firmware.bin
+
+CFLAGS="-g -O0 -Isrc-pc -Isim -DMD5_ENABLED=1 -DSINGLE_TARGET_SUPPORT ${SIM_CFLAGS}"
+FW_CFLAGS="-Isim/include -I../../include -DSDCC=400 -DFREQ_SYS=16000000 -fgnu89-inline -Wno-parentheses"
+
+gcc -o pc_upl_sim ${CFLAGS} src-pc/esp_loader.c src-pc/esp_targets.c src-pc/md5_hash.c src-pc/serial_comm.c \
+		src-pc/libusb_port.c src-pc/example_common.c src-pc/main_libusb.c \
+		sim/usb_sim.c sim/esp_sim.c sim/boot_sim.c \
+		${FW_CFLAGS} sim/fw_sim.c \
+		-lpthread
@@ -0,0 +1,203 @@
+// Simulated CH55x ROM bootloader (version 2.40) of a CH552
+//
+// Takes the bootloader commands on EP2 the way the ROM does: the detect and
+// configuration requests, the key setup (the image is XORed with a key made
+// from the chip unique ID), the erase of 1KB blocks, the write and verify of
+// the code flash and the final reset that starts the new firmware. The
+// firmware keeps running the code from src/ once restarted, the written
+// image is only checked and kept.
+//
+// Environment: SIM_BRIDGE_OUT=<file> dumps the written code flash at exit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef MINGW
+#include <libusbx-1.0/libusb.h>
+#else
+#include <libusb-1.0/libusb.h>
+#endif
+
+#include "sim.h"
+#include "boot_sim.h"
+
+#define CHIP_ID     0x52
+#define CHIP_FAMILY 0x11
+#define CODE_SIZE   (14 * 1024)
+#define BLOCK_SIZE  1024
+#define CONFIG_LEN  30
+
+#define CMD_DETECT 0xA1
+#define CMD_RESET  0xA2
+#define CMD_KEY    0xA3
+#define CMD_ERASE  0xA4
+#define CMD_WRITE  0xA5
+#define CMD_VERIFY 0xA6
+#define CMD_CONFIG 0xA7
+
+#define STATUS_OK    0x00
+#define STATUS_ERROR 0xFE
+#define STATUS_DIFF  0xF5
+
+// configuration answer from its 4th byte: the version at [19..22] of the
+// packet, the unique ID from [22]
+static const uint8_t config[CONFIG_LEN - 4] = {
+    0x1F, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x02, 0x04, 0x00, 0x5A, 0x3C, 0x11, 0x7E, 0x05, 0x00
+};
+
+static uint8_t code[CODE_SIZE];
+static int erased;      // bytes erased from 0
+static int keySet;
+static uint8_t key[8];
+static uint8_t answer[64];
+static int answerLen;
+
+static int written;     // highest byte written + 1
+static unsigned writes;
+static unsigned rejected;
+static unsigned verifyErrors;
+static unsigned runs;
+
+static void reply(uint8_t cmd, const uint8_t* data, int len)
+{
+    answer[0] = cmd;
+    answer[1] = 0;
+    answer[2] = len & 0xFF;
+    answer[3] = len >> 8;
+    memcpy(answer + 4, data, len);
+    answerLen = 4 + len;
+}
+
+static void replyStatus(uint8_t cmd, uint8_t status)
+{
+    uint8_t d[2] = { status, 0 };
+    reply(cmd, d, sizeof(d));
+}
+
+// write or verify: [addr lo][addr hi][0][0][random][data XORed with the key]
+static uint8_t program(uint8_t cmd, const uint8_t* d, int len)
+{
+    int addr = d[0] | (d[1] << 8);
+    int n = len - 5;
+    int i;
+
+    if (!keySet || n < 0 || addr + n > erased) {
+        rejected++;
+        return STATUS_ERROR;
+    }
+    for (i = 0; i < n; i++) {
+        uint8_t c = d[5 + i] ^ key[(addr + i) & 7];
+        if (cmd == CMD_WRITE) {
+            code[addr + i] = c;
+        } else
+        if (code[addr + i] != c) {
+            verifyErrors++;
+            return STATUS_DIFF;
+        }
+    }
+    if (cmd == CMD_WRITE) {
+        writes++;
+        if (addr + n > written) {
+            written = addr + n;
+        }
+    }
+    return STATUS_OK;
+}
+
+static void command(const uint8_t* pkt, int len)
+{
+    const uint8_t* d = pkt + 3;
+    int n = pkt[1] | (pkt[2] << 8);
+    int i;
+
+    answerLen = 0;
+    if (len < 3 || n != len - 3) {
+        return;
+    }
+    switch (pkt[0]) {
+        case CMD_DETECT : {
+            uint8_t id[2] = { CHIP_ID, CHIP_FAMILY };
+            if (n >= 2 && memcmp(d + 2, "MCU ISP & WCH.CN", 16) == 0) {
+                reply(CMD_DETECT, id, sizeof(id));
+            }
+        } break;
+        case CMD_CONFIG : {
+            reply(CMD_CONFIG, config, sizeof(config));
+        } break;
+        case CMD_KEY : {
+            // the key material sent is all zeros in practice, the result
+            // depends on the unique ID only
+            uint8_t sum = config[18] + config[19] + config[20] + config[21];
+            for (i = 0; i < 8; i++) {
+                key[i] = sum;
+            }
+            key[7] += CHIP_ID;
+            keySet = 1;
+            replyStatus(CMD_KEY, sum);
+        } break;
+        case CMD_ERASE : {
+            erased = n ? d[0] * BLOCK_SIZE : 0;
+            if (erased > CODE_SIZE) {
+                erased = CODE_SIZE;
+            }
+            memset(code, 0xFF, erased);
+            replyStatus(CMD_ERASE, STATUS_OK);
+        } break;
+        case CMD_WRITE :
+        case CMD_VERIFY : {
+            replyStatus(pkt[0], program(pkt[0], d, n));
+        } break;
+        case CMD_RESET : {
+            // 1: start the application, the bootloader leaves the bus
+            if (n && d[0] == 1) {
+                runs++;
+                keySet = 0;
+                simLeaveBootloader();
+            }
+        } break;
+    }
+}
+
+int bootSimTransfer(uint8_t ep, uint8_t* data, int len, int* done)
+{
+    *done = 0;
+    if (ep == 0x02) {
+        if (len > 64) {
+            return LIBUSB_ERROR_OVERFLOW;
+        }
+        command(data, len);
+        *done = len;
+        return 0;
+    }
+    if (ep == 0x82) {
+        if (!answerLen) {
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+        *done = answerLen < len ? answerLen : len;
+        memcpy(data, answer, *done);
+        answerLen = 0;
+        return 0;
+    }
+    return LIBUSB_ERROR_PIPE;
+}
+
+void bootSimReport(void)
+{
+    const char* out = getenv("SIM_BRIDGE_OUT");
+
+    if (!writes && !runs) {
+        return;
+    }
+    fprintf(stderr, "boot: %u packets, %i bytes written, %u rejected, %u verify errors, %u runs\n",
+        writes, written, rejected, verifyErrors, runs);
+    if (out != NULL && written) {
+        FILE* f = fopen(out, "wb");
+        if (f != NULL) {
+            fwrite(code, 1, written, f);
+            fclose(f);
+        }
+    }
+}
@@ -0,0 +1,15 @@
+// Simulated CH55x ROM bootloader: what the bridge turns into after
+// COMMAND_JUMP_TO_BOOTLOADER, until the host starts the new firmware
+#pragma once
+
+#include <stdint.h>
+
+#define BOOT_SIM_VENDOR_ID  0x4348
+#define BOOT_SIM_PRODUCT_ID 0x55e0
+
+// a packet on EP2: OUT takes a command, IN returns its answer,
+// returns 0 or a negative libusb error
+int bootSimTransfer(uint8_t ep, uint8_t* data, int len, int* done);
+
+// prints what was written, called at exit
+void bootSimReport(void);
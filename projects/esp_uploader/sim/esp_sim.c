@@ -0,0 +1,437 @@
+// Simulated ESP chip on the other side of the bridge
+//
+// Implements what the uploader needs from the ESP8266 (default) or ESP32
+// (SIM_ESP=esp32) ROM: the 74880 baud boot message, the SLIP framed serial
+// loader protocol and a flash array. A normally booted chip prints a short
+// application log at 115200 baud on UART0 and a debug log on UART1 (GPIO2).
+//
+// Environment: SIM_ESP=esp8266|esp32, SIM_FLASH_OUT=<file> dumps the flash
+// at exit, SIM_VERBOSE=1 reports the loader commands, SIM_ESP_MAX_BAUD=<rate>
+// garbles the link above the rate (bad wiring), SIM_APP_LINES=<n> makes the
+// application print n more lines on both UARTs back to back.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_sim.h"
+#include "md5_hash.h"
+
+#define FLASH_SIZE      (4 * 1024 * 1024)
+#define OUT_QUEUE_SIZE  (64 * 1024)
+#define FRAME_MAX       (8 * 1024)
+
+#define BOOT_BAUD       74880
+#define APP_BAUD        115200
+
+enum {
+    ESP_OFF,
+    ESP_DOWNLOAD,
+    ESP_APP,
+};
+
+typedef struct {
+    uint8_t c;
+    uint32_t baud;
+    uint64_t due;
+} out_byte_t;
+
+static int isEsp32;
+static int verbose;
+static int state = ESP_OFF;
+static int running;
+static uint32_t uartBaud;       // 0: ROM auto baud, follows the bridge
+static uint32_t newBaud;        // applied once the pending output is sent
+static uint32_t maxBaud;        // the link does not work above (0: no limit)
+
+typedef struct {
+    out_byte_t b[OUT_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t tail;
+} out_queue_t;
+
+static out_queue_t uart0;
+static out_queue_t uart1;
+static int appLines;
+
+static uint8_t frame[FRAME_MAX];
+static uint32_t frameLen;
+static int inFrame;
+static int escape;
+
+static uint8_t* flash;
+static uint32_t flashOffset;
+static uint32_t flashBlockSize;
+static uint32_t flashSeq;
+static uint32_t flashBytes;
+static uint32_t flashLow = 0xFFFFFFFF;
+static uint32_t flashHigh;
+static uint32_t flashErrors;
+static uint32_t syncCount;
+
+static void queueOn(out_queue_t* q, uint8_t c, uint32_t baud, uint64_t due)
+{
+    out_byte_t* o;
+
+    if (q->head - q->tail >= OUT_QUEUE_SIZE) {
+        return;
+    }
+    o = &q->b[q->head % OUT_QUEUE_SIZE];
+    o->c = c;
+    o->baud = baud;
+    o->due = due;
+    q->head++;
+}
+
+static void queueByte(uint8_t c, uint32_t baud, uint64_t due)
+{
+    queueOn(&uart0, c, baud, due);
+}
+
+static void queueTextOn(out_queue_t* q, const char* s, uint32_t baud, uint64_t due)
+{
+    while (*s) {
+        queueOn(q, (uint8_t) *s++, baud, due);
+    }
+}
+
+static void queueText(const char* s, uint32_t baud, uint64_t due)
+{
+    queueTextOn(&uart0, s, baud, due);
+}
+
+static void queueSlip(uint8_t c)
+{
+    if (c == 0xC0) {
+        queueByte(0xDB, uartBaud, 0);
+        queueByte(0xDC, uartBaud, 0);
+    } else
+    if (c == 0xDB) {
+        queueByte(0xDB, uartBaud, 0);
+        queueByte(0xDD, uartBaud, 0);
+    } else {
+        queueByte(c, uartBaud, 0);
+    }
+}
+
+static void respond(uint8_t cmd, uint32_t value, const uint8_t* data, uint16_t len, uint8_t error)
+{
+    uint8_t hdr[8];
+    uint16_t statusLen = isEsp32 ? 4 : 2;
+    uint16_t size = len + statusLen;
+    int i;
+
+    hdr[0] = 1;
+    hdr[1] = cmd;
+    hdr[2] = size & 0xFF;
+    hdr[3] = size >> 8;
+    hdr[4] = value & 0xFF;
+    hdr[5] = (value >> 8) & 0xFF;
+    hdr[6] = (value >> 16) & 0xFF;
+    hdr[7] = value >> 24;
+
+    queueByte(0xC0, uartBaud, 0);
+    for (i = 0; i < 8; i++) {
+        queueSlip(hdr[i]);
+    }
+    for (i = 0; i < len; i++) {
+        queueSlip(data[i]);
+    }
+    queueSlip(error ? 1 : 0);
+    queueSlip(error);
+    for (i = 2; i < statusLen; i++) {
+        queueSlip(0);
+    }
+    queueByte(0xC0, uartBaud, 0);
+}
+
+static uint32_t get32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t readReg(uint32_t addr)
+{
+    if (addr == 0x40001000) {
+        return isEsp32 ? 0x00f01d83 : 0xfff0c101;
+    }
+    // SPI W0 after READ_ID: 4MB flash
+    if (addr == (isEsp32 ? 0x3ff42080 : 0x60000240)) {
+        return 0x1640EF;
+    }
+    return 0;
+}
+
+static void flashData(const uint8_t* d, uint32_t size, uint8_t checksum)
+{
+    uint32_t dataSize = get32(d);
+    uint32_t seq = get32(d + 4);
+    uint8_t sum = 0xEF;
+    uint32_t addr;
+    uint32_t i;
+
+    if (size < 16 || dataSize != size - 16) {
+        flashErrors++;
+        respond(0x03, 0, NULL, 0, 0x05);
+        return;
+    }
+    for (i = 0; i < dataSize; i++) {
+        sum ^= d[16 + i];
+    }
+    if (sum != checksum || seq != flashSeq) {
+        if (verbose) {
+            fprintf(stderr, "esp: FLASH_DATA seq=%u (expected %u) checksum %02x/%02x\n",
+                    seq, flashSeq, sum, checksum);
+        }
+        flashErrors++;
+        respond(0x03, 0, NULL, 0, 0x07);
+        return;
+    }
+    addr = flashOffset + seq * flashBlockSize;
+    if (addr + dataSize <= FLASH_SIZE) {
+        memcpy(flash + addr, d + 16, dataSize);
+        if (addr < flashLow) {
+            flashLow = addr;
+        }
+        if (addr + dataSize > flashHigh) {
+            flashHigh = addr + dataSize;
+        }
+    }
+    flashSeq++;
+    flashBytes += dataSize;
+    respond(0x03, 0, NULL, 0, 0);
+}
+
+static void md5Region(uint32_t addr, uint32_t size)
+{
+    struct MD5Context ctx;
+    uint8_t digest[16];
+    uint8_t hex[32];
+    int i;
+
+    if (addr + size > FLASH_SIZE) {
+        respond(0x13, 0, NULL, 0, 0x06);
+        return;
+    }
+    MD5Init(&ctx);
+    MD5Update(&ctx, flash + addr, size);
+    MD5Final(digest, &ctx);
+    for (i = 0; i < 16; i++) {
+        sprintf((char*)hex + i * 2, "%02x", digest[i]);
+    }
+    respond(0x13, 0, hex, 32, 0);
+}
+
+static void handleFrame(void)
+{
+    uint8_t cmd;
+    uint16_t size;
+    const uint8_t* d = frame + 8;
+
+    if (frameLen < 8 || frame[0] != 0) {
+        return;
+    }
+    cmd = frame[1];
+    size = frame[2] | (frame[3] << 8);
+    if (size != frameLen - 8) {
+        respond(cmd, 0, NULL, 0, 0x05);
+        return;
+    }
+    if (verbose) {
+        fprintf(stderr, "esp: command 0x%02x size %u\n", cmd, size);
+    }
+
+    switch (cmd) {
+        case 0x08 : { // SYNC: the ROM answers several times
+            int i;
+            syncCount++;
+            for (i = 0; i < 8; i++) {
+                respond(cmd, 0x20120707, NULL, 0, 0);
+            }
+        } break;
+        case 0x0a : // READ_REG
+            respond(cmd, readReg(get32(d)), NULL, 0, 0);
+            break;
+        case 0x02 : // FLASH_BEGIN
+            flashBlockSize = get32(d + 8);
+            flashOffset = get32(d + 12);
+            flashSeq = 0;
+            respond(cmd, 0, NULL, 0, 0);
+            break;
+        case 0x03 : // FLASH_DATA
+            flashData(d, size, frame[4]);
+            break;
+        case 0x0f : // CHANGE_BAUDRATE
+            if (!isEsp32) {
+                respond(cmd, 0, NULL, 0, 0x05);
+                break;
+            }
+            respond(cmd, 0, NULL, 0, 0);
+            newBaud = get32(d);
+            break;
+        case 0x13 : // SPI_FLASH_MD5
+            if (!isEsp32) {
+                respond(cmd, 0, NULL, 0, 0x05);
+                break;
+            }
+            md5Region(get32(d), get32(d + 4));
+            break;
+        case 0x04 : // FLASH_END
+        case 0x09 : // WRITE_REG
+        case 0x0b : // SPI_SET_PARAMS
+        case 0x0d : // SPI_ATTACH
+            respond(cmd, 0, NULL, 0, 0);
+            break;
+        default:
+            respond(cmd, 0, NULL, 0, 0x05);
+    }
+}
+
+void espSimInit(void)
+{
+    const char* s = getenv("SIM_ESP");
+    isEsp32 = s != NULL && strcmp(s, "esp32") == 0;
+    verbose = getenv("SIM_VERBOSE") != NULL;
+    s = getenv("SIM_ESP_MAX_BAUD");
+    maxBaud = s != NULL ? strtoul(s, NULL, 0) : 0;
+    s = getenv("SIM_APP_LINES");
+    appLines = s != NULL ? atoi(s) : 0;
+    flash = malloc(FLASH_SIZE);
+    memset(flash, 0xFF, FLASH_SIZE);
+}
+
+void espSimPins(uint8_t enable, uint8_t reset, uint8_t boot, uint64_t now)
+{
+    int run = enable && reset;
+    int i;
+
+    if (run == running) {
+        return;
+    }
+    running = run;
+    uart0.head = uart0.tail;
+    uart1.head = uart1.tail;
+    inFrame = 0;
+    newBaud = 0;
+    if (!run) {
+        state = ESP_OFF;
+        return;
+    }
+
+    // the ROM always starts at 74880 baud
+    queueText("\r\n ets Jan  8 2013,rst cause:2, boot mode:(", BOOT_BAUD, now + 30000);
+    if (!boot) {
+        queueText("1,6)\r\n\r\nwaiting for host\r\n", BOOT_BAUD, 0);
+        state = ESP_DOWNLOAD;
+        uartBaud = 0;
+        return;
+    }
+    queueText("3,6)\r\n\r\n", BOOT_BAUD, 0);
+    queueText("load 0x4010f000, len 3460, room 16 \r\n", BOOT_BAUD, now + 40000);
+    queueText("tail 4\r\nchksum 0xcc\r\n", BOOT_BAUD, now + 45000);
+    queueText("load 0x3fff20b8, len 40, room 4 \r\n", BOOT_BAUD, now + 50000);
+    queueText("tail 4\r\nchksum 0xc9\r\ncsum 0xc9\r\n", BOOT_BAUD, now + 52000);
+    queueText("\r\nREADY\r\n", APP_BAUD, now + 250000);
+    queueTextOn(&uart1, "log: app started\r\n", APP_BAUD, now + 251000);
+    for (i = 0; i < appLines; i++) {
+        char line[40];
+        sprintf(line, "app line %i\r\n", i);
+        queueText(line, APP_BAUD, 0);
+        sprintf(line, "log: debug line %i\r\n", i);
+        queueTextOn(&uart1, line, APP_BAUD, 0);
+    }
+    state = ESP_APP;
+    uartBaud = APP_BAUD;
+}
+
+void espSimRx(uint8_t c, uint32_t baud)
+{
+    if (state != ESP_DOWNLOAD) {
+        return;
+    }
+    if (uartBaud != 0) {
+        uint32_t d = baud > uartBaud ? baud - uartBaud : uartBaud - baud;
+        if (d * 100 > uartBaud * 4 || (maxBaud && uartBaud > maxBaud)) {
+            c ^= 0x5A; // wrong baud rate: garbage
+        }
+    }
+
+    if (c == 0xC0) {
+        if (inFrame && frameLen > 0) {
+            handleFrame();
+            inFrame = 0;
+        } else {
+            inFrame = 1;
+        }
+        frameLen = 0;
+        escape = 0;
+        return;
+    }
+    if (!inFrame) {
+        return;
+    }
+    if (escape) {
+        escape = 0;
+        c = c == 0xDC ? 0xC0 : (c == 0xDD ? 0xDB : c);
+    } else
+    if (c == 0xDB) {
+        escape = 1;
+        return;
+    }
+    if (frameLen < FRAME_MAX) {
+        frame[frameLen++] = c;
+    }
+}
+
+static int takeOut(out_queue_t* q, uint8_t* c, uint32_t* baud, uint64_t now)
+{
+    out_byte_t* o;
+
+    if (q->tail == q->head) {
+        return 0;
+    }
+    o = &q->b[q->tail % OUT_QUEUE_SIZE];
+    if (o->due > now) {
+        return 0;
+    }
+    *c = o->c;
+    *baud = o->baud;
+    if (maxBaud && o->baud > maxBaud) {
+        *c ^= 0x5A;
+    }
+    q->tail++;
+    return 1;
+}
+
+int espSimTx(uint8_t* c, uint32_t* baud, uint64_t now)
+{
+    if (uart0.tail == uart0.head && newBaud) {
+        uartBaud = newBaud;
+        newBaud = 0;
+    }
+    return takeOut(&uart0, c, baud, now);
+}
+
+int espSimTx1(uint8_t* c, uint32_t* baud, uint64_t now)
+{
+    return takeOut(&uart1, c, baud, now);
+}
+
+void espSimReport(void)
+{
+    const char* out = getenv("SIM_FLASH_OUT");
+
+    fprintf(stderr, "esp: %u sync, %u bytes flashed", syncCount, flashBytes);
+    if (flashBytes) {
+        fprintf(stderr, " at 0x%x-0x%x", flashLow, flashHigh);
+    }
+    fprintf(stderr, ", %u errors\n", flashErrors);
+
+    if (out != NULL && flashBytes) {
+        FILE* f = fopen(out, "wb");
+        if (f != NULL) {
+            fwrite(flash + flashLow, 1, flashHigh - flashLow, f);
+            fclose(f);
+        }
+    }
+}
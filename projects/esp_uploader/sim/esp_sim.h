@@ -0,0 +1,21 @@
+// Simulated ESP8266/ESP32: boot log, ROM serial loader and a flash array
+#pragma once
+
+#include <stdint.h>
+
+void espSimInit(void);
+
+// pin levels driven by the bridge
+void espSimPins(uint8_t enable, uint8_t reset, uint8_t boot, uint64_t now);
+
+// byte from the bridge, 'baud' is the rate the bridge sent it at
+void espSimRx(uint8_t c, uint32_t baud);
+
+// next byte for the bridge: returns 1 and the byte + its baud rate once it is due
+int espSimTx(uint8_t* c, uint32_t* baud, uint64_t now);
+
+// the same for the UART1 (GPIO2) log output
+int espSimTx1(uint8_t* c, uint32_t* baud, uint64_t now);
+
+// prints what was flashed, called at exit
+void espSimReport(void);
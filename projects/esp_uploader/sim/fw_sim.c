@@ -0,0 +1,801 @@
+// Hardware model of the simulated bridge
+//
+// The firmware (src/main.c) is compiled for the host against the SFR
+// stand-ins in sim/include and runs on its own thread. A second thread
+// emulates the CH55x peripherals the firmware uses and the wires to the
+// simulated ESP. Interrupts are delivered as a signal to the firmware thread,
+// so an ISR preempts main() at any point and runs only while it is enabled,
+// just like on the chip.
+
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compiler.h"
+
+#define main fwMain
+#include "../src/main.c"
+#undef main
+
+#ifdef MINGW
+#include <libusbx-1.0/libusb.h>
+#else
+#include <libusb-1.0/libusb.h>
+#endif
+
+#include "sim.h"
+#include "esp_sim.h"
+#include "boot_sim.h"
+
+#define SIM_IRQ_SIGNAL SIGUSR1
+
+// a UART byte: start bit, 8 data bits, stop bit
+#define BYTE_TIME_US(BAUD) (10000000 / (BAUD))
+
+enum {
+    USB_REQ_CONTROL,
+    USB_REQ_EP_OUT,
+    USB_REQ_EP_IN,
+    USB_REQ_SERIAL, // the serial number string descriptor
+};
+
+// the USB transaction the host waits for, executed in the firmware interrupt
+typedef struct {
+    volatile sig_atomic_t pending;
+    int kind;
+    uint8_t ep;
+    USB_SETUP_REQ setup;
+    uint8_t* data;
+    int len;
+    int result;
+    sem_t done;
+} sim_usb_req_t;
+
+static volatile uint16_t sbufCell = 0x100;
+static volatile uint16_t sbufTx = 0x200;  // written byte moved out of the cell
+static volatile uint8_t sbufRx;
+
+static pthread_t fwThread;
+static pthread_t hwThread;
+static pthread_mutex_t usbLock = PTHREAD_MUTEX_INITIALIZER;
+static sim_usb_req_t usbReq;
+static int started;
+
+// COMMAND_JUMP_TO_BOOTLOADER parks the firmware thread until the simulated
+// bootloader starts the firmware again
+static volatile int inBootloader;
+static sem_t bootRun;
+static sigjmp_buf fwRestart;
+
+// round trips of the EP0 requests by bRequest and the deepest command queue
+// seen, printed at exit
+typedef struct {
+    unsigned count;
+    unsigned stalls;
+    uint64_t totalUs;
+    uint64_t maxUs;
+} sim_rtt_t;
+
+static sim_rtt_t controlRtt[256];
+static unsigned bulkPackets;
+static unsigned bulkNaks;
+static volatile uint8_t queueMax;
+
+uint64_t simNowUs(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void sleepUs(uint64_t us)
+{
+    struct timespec t;
+    t.tv_sec = us / 1000000;
+    t.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&t, &t) && errno == EINTR);
+}
+
+/*
+ * I2C slave on the firmware's bit-banged bus: a register file device at
+ * I2C_SIM_ADDR, the register pointer is set by the first byte written and
+ * advances with every byte. It is stepped from the firmware's delays, the
+ * firmware waits after every change of the lines.
+ */
+#define I2C_SIM_ADDR 0x48
+#define I2C_SIM_REGS 16
+
+enum {
+    I2C_IDLE,    // waits for a start condition
+    I2C_ADDRESS, // receiving the address byte
+    I2C_WRITE,   // receiving data bytes
+    I2C_READ,    // sending data bytes
+    I2C_IGNORE,  // addressed to another device
+};
+
+static uint8_t i2cRegs[I2C_SIM_REGS];
+static uint8_t i2cPtr;
+static int i2cState = I2C_IDLE;
+static int i2cBits;        // bits of the current byte done
+static int i2cAck;         // the 9th (acknowledge) clock of the byte
+static int i2cPtrSet;      // the register pointer was written in this transfer
+static uint8_t i2cByte;
+static int i2cDrive;       // the slave pulls SDA low
+static uint8_t i2cScl = 1;
+static uint8_t i2cSda = 1;
+
+static void i2cSimStep(void)
+{
+    uint8_t scl = I2C_SCL;
+    uint8_t sda = I2C_SDA;
+
+    if (scl && i2cScl && sda != i2cSda && !i2cDrive) {
+        // start or stop condition
+        i2cState = sda ? I2C_IDLE : I2C_ADDRESS;
+        i2cBits = 0;
+        i2cAck = 0;
+        i2cByte = 0;
+        i2cPtrSet = 0;
+    } else
+    if (scl && !i2cScl && !i2cAck && (i2cState == I2C_ADDRESS || i2cState == I2C_WRITE)) {
+        // a bit from the master
+        i2cByte = (i2cByte << 1) | sda;
+        i2cBits++;
+    } else
+    if (scl && !i2cScl && i2cAck && i2cState == I2C_READ && sda) {
+        i2cState = I2C_IGNORE; // the master does not want more
+        i2cAck = 0;
+    } else
+    if (!scl && i2cScl) {
+        // falling edge: the next bit goes on the bus
+        i2cDrive = 0;
+        if (i2cAck) {
+            i2cAck = 0;
+            i2cBits = 0;
+            if (i2cState == I2C_READ) {
+                i2cByte = i2cRegs[i2cPtr % I2C_SIM_REGS];
+                i2cDrive = !(i2cByte & 0x80);
+                i2cByte <<= 1;
+                i2cBits = 1;
+            }
+        } else
+        if (i2cBits == 8 && i2cState != I2C_READ) {
+            // acknowledge the address or the data byte
+            i2cAck = 1;
+            if (i2cState == I2C_ADDRESS) {
+                if ((i2cByte >> 1) != I2C_SIM_ADDR) {
+                    i2cState = I2C_IGNORE;
+                    i2cAck = 0;
+                } else {
+                    i2cState = (i2cByte & 1) ? I2C_READ : I2C_WRITE;
+                    i2cDrive = 1;
+                }
+            } else
+            if (i2cState == I2C_WRITE) {
+                if (!i2cPtrSet) {
+                    i2cPtr = i2cByte;
+                    i2cPtrSet = 1;
+                } else {
+                    i2cRegs[i2cPtr++ % I2C_SIM_REGS] = i2cByte;
+                }
+                i2cDrive = 1;
+            }
+            i2cByte = 0;
+        } else
+        if (i2cState == I2C_READ) {
+            if (i2cBits == 8) {
+                i2cAck = 1; // the master acknowledges
+                i2cPtr++;
+            } else {
+                i2cDrive = !(i2cByte & 0x80);
+                i2cByte <<= 1;
+                i2cBits++;
+            }
+        }
+    }
+    if (i2cDrive) {
+        I2C_SDA = 0;
+        sda = 0;
+    }
+    i2cScl = scl;
+    i2cSda = sda;
+}
+
+/*
+ * debug.c / bootloader replacements
+ */
+void CfgFsys(void)
+{
+}
+
+void mDelayuS(uint16_t n)
+{
+    i2cSimStep();
+    sleepUs(n);
+}
+
+void mDelaymS(uint16_t n)
+{
+    sleepUs((uint64_t)n * 1000);
+}
+
+// the ROM bootloader takes over the USB: the request that got us here ends
+// as if the device left the bus, the firmware restarts when the bootloader
+// is done. Called from the USB interrupt.
+void bootloader(void)
+{
+    fprintf(stderr, "sim: firmware jumped to the bootloader\n");
+    usbReq.result = LIBUSB_ERROR_NO_DEVICE;
+    usbReq.pending = 0;
+    inBootloader = 1;
+    sem_post(&usbReq.done);
+    while (sem_wait(&bootRun) && errno == EINTR);
+    fprintf(stderr, "sim: firmware restarted\n");
+    inBootloader = 0;
+    siglongjmp(fwRestart, 1);
+}
+
+int simInBootloader(void)
+{
+    return inBootloader;
+}
+
+void simLeaveBootloader(void)
+{
+    sem_post(&bootRun);
+}
+
+// ADC: channel N reads 0x80 + N
+volatile uint8_t* simPoll(volatile uint8_t* bit)
+{
+    if (bit == &simADC_START && simADC_START && (ADC_CFG & bADC_EN)) {
+        ADC_DATA = 0x80 + (ADC_CHAN1 << 1 | ADC_CHAN0);
+        ADC_IF = 1;
+        simADC_START = 0;
+    }
+    sched_yield();
+    return bit;
+}
+
+/*
+ * Chip ID and DataFlash. SIM_CHIP_ID sets the 40 bit ID (hex), the DataFlash
+ * is kept in the file named by SIM_DATAFLASH so that it outlives the run.
+ */
+#define SIM_DATAFLASH_SIZE 256 // address range, the bytes are at the even addresses
+
+uint16_t simChipId[3] = { 0x003B, 0x5E07, 0x1A2C }; // HX, LO, HI
+static uint8_t dataFlash[SIM_DATAFLASH_SIZE];
+static volatile uint8_t romStatus;
+
+static void dataFlashInit(void)
+{
+    const char* id = getenv("SIM_CHIP_ID");
+    const char* path = getenv("SIM_DATAFLASH");
+    FILE* f;
+
+    if (id != NULL) {
+        uint64_t v = strtoull(id, NULL, 16);
+        simChipId[0] = (v >> 32) & 0xFF;
+        simChipId[1] = v & 0xFFFF;
+        simChipId[2] = (v >> 16) & 0xFFFF;
+    }
+    memset(dataFlash, 0xFF, sizeof(dataFlash));
+    if (path != NULL && (f = fopen(path, "rb")) != NULL) {
+        if (fread(dataFlash, 1, sizeof(dataFlash), f) != sizeof(dataFlash)) {
+            fprintf(stderr, "sim: short DataFlash file %s\n", path);
+        }
+        fclose(f);
+    }
+}
+
+static void dataFlashSave(void)
+{
+    const char* path = getenv("SIM_DATAFLASH");
+    FILE* f;
+
+    if (path != NULL && (f = fopen(path, "wb")) != NULL) {
+        fwrite(dataFlash, 1, sizeof(dataFlash), f);
+        fclose(f);
+    }
+}
+
+// carries out the command left in ROM_CTRL: the DataFlash only, a write needs
+// bDATA_WE
+volatile uint8_t* simRomStatus(void)
+{
+    uint16_t addr = ROM_ADDR_H << 8 | ROM_ADDR_L;
+    uint8_t cmd = ROM_CTRL;
+
+    if (cmd) {
+        ROM_CTRL = 0;
+        romStatus = bROM_ADDR_OK;
+        if (addr < DATA_FLASH_ADDR || addr >= DATA_FLASH_ADDR + SIM_DATAFLASH_SIZE || (addr & 1)) {
+            romStatus = bROM_CMD_ERR;
+        } else
+        if (cmd == ROM_CMD_READ) {
+            ROM_DATA_L = dataFlash[addr - DATA_FLASH_ADDR];
+        } else
+        if (cmd == ROM_CMD_WRITE && (GLOBAL_CFG & bDATA_WE)) {
+            dataFlash[addr - DATA_FLASH_ADDR] = ROM_DATA_L;
+            dataFlashSave();
+        } else {
+            romStatus = cmd == ROM_CMD_WRITE ? 0 : bROM_CMD_ERR;
+        }
+    }
+    return &romStatus;
+}
+
+/*
+ * Timer0
+ */
+// 16 bit mode from FREQ_SYS / 12
+static uint16_t timer0Count(void)
+{
+    return simNowUs() * (FREQ_SYS / 1000000) / 12;
+}
+
+uint8_t simTimer0(int high)
+{
+    uint16_t t = timer0Count();
+    return high ? t >> 8 : t & 0xFF;
+}
+
+/*
+ * UART0
+ */
+static uint32_t uart0Baud(void)
+{
+    uint32_t clk;
+
+    if (RCLK || TCLK) {
+        uint16_t reload = RCAP2H << 8 | RCAP2L;
+        clk = (T2MOD & bT2_CLK) ? ((T2MOD & bTMR_CLK) ? FREQ_SYS : FREQ_SYS / 2) : FREQ_SYS / 4;
+        return reload == 0 ? 0 : clk / 16 / (65536 - reload);
+    }
+    clk = (T2MOD & bT1_CLK) ? ((T2MOD & bTMR_CLK) ? FREQ_SYS : FREQ_SYS / 4) : FREQ_SYS / 12;
+    if (PCON & SMOD) {
+        clk *= 2;
+    }
+    return clk / 32 / (256 - TH1);
+}
+
+// rates further apart than this garble the bytes
+static int baudMatches(uint32_t a, uint32_t b)
+{
+    uint32_t d = a > b ? a - b : b - a;
+    return b == 0 || d * 100 <= b * 4;
+}
+
+volatile uint16_t* simSbuf(void)
+{
+    uint16_t v = __sync_lock_test_and_set(&sbufCell, 0x100 | sbufRx);
+    if (v < 0x100) {
+        sbufTx = v; // the previous access was a write
+    }
+    return &sbufCell;
+}
+
+// picks up the byte the firmware has written to SBUF
+static int takeTx(uint8_t* c)
+{
+    uint16_t v = sbufCell;
+    if (v < 0x100 && __sync_bool_compare_and_swap(&sbufCell, v, 0x100 | sbufRx)) {
+        *c = (uint8_t) v;
+        return 1;
+    }
+    v = sbufTx;
+    if (v < 0x100 && __sync_bool_compare_and_swap(&sbufTx, v, 0x200)) {
+        *c = (uint8_t) v;
+        return 1;
+    }
+    return 0;
+}
+
+static void putRx(uint8_t c)
+{
+    sbufRx = c;
+}
+
+/*
+ * UART1: the receiver only, the firmware reads SBUF1 directly
+ */
+static uint32_t uart1Baud(void)
+{
+    uint8_t div = 256 - SBAUD1;
+    return FREQ_SYS / (U1SMOD ? 16 : 32) / (div ? div : 256);
+}
+
+/*
+ * Interrupts
+ */
+static void runUsbRequest(void)
+{
+    sim_usb_req_t* r = &usbReq;
+
+    switch (r->kind) {
+        case USB_REQ_CONTROL : {
+            uint16_t res = simUsbSetup(&r->setup);
+            if (CMD_COUNT > queueMax) {
+                queueMax = CMD_COUNT;
+            }
+            if (res == 0xFF) {
+                r->result = LIBUSB_ERROR_PIPE;
+            } else
+            if (r->setup.bRequestType & 0x80) {
+                r->result = res < r->len ? res : r->len;
+                memcpy(r->data, Ep0Buffer, r->result);
+            } else {
+                int pos = 0;
+                while (pos < r->len) {
+                    int l = r->len - pos > DEFAULT_ENDP0_SIZE ? DEFAULT_ENDP0_SIZE : r->len - pos;
+                    simUsbData(r->data + pos, l);
+                    pos += l;
+                }
+                r->result = r->len;
+            }
+        } break;
+        case USB_REQ_EP_OUT : {
+            uint8_t b = (UEP2_CTRL & bUEP_R_TOG) ? 1 : 0;
+            if ((UEP2_CTRL & MASK_UEP_R_RES) != UEP_R_RES_ACK) {
+                r->result = LIBUSB_ERROR_BUSY; // NAK
+                break;
+            }
+            memcpy(ep2Buf + b * 64, r->data, r->len);
+            USB_RX_LEN = r->len;
+            simUsbEndpoint(UIS_TOKEN_OUT | (r->ep & 0x0F));
+            r->result = r->len;
+        } break;
+        case USB_REQ_EP_IN : {
+            uint8_t b = (UEP2_CTRL & bUEP_T_TOG) ? 1 : 0;
+            if ((r->ep & 0x0F) == 1) {
+                int l = UEP1_T_LEN;
+                if ((UEP1_CTRL & MASK_UEP_T_RES) != UEP_T_RES_ACK) {
+                    r->result = LIBUSB_ERROR_BUSY; // NAK
+                    break;
+                }
+                memcpy(r->data, ep1Buf, l < r->len ? l : r->len);
+                simUsbEndpoint(UIS_TOKEN_IN | 1);
+                r->result = l < r->len ? l : r->len;
+                break;
+            }
+            int l = UEP2_T_LEN;
+            if ((UEP2_CTRL & MASK_UEP_T_RES) != UEP_T_RES_ACK) {
+                r->result = LIBUSB_ERROR_BUSY; // NAK
+                break;
+            }
+            if (l > r->len) {
+                l = r->len;
+            }
+            memcpy(r->data, ep2Buf + 128 + b * 64, l);
+            simUsbEndpoint(UIS_TOKEN_IN | (r->ep & 0x0F));
+            r->result = l;
+        } break;
+        case USB_REQ_SERIAL : {
+            r->result = simUsbSerial((char*) r->data, r->len);
+        } break;
+    }
+}
+
+static void simIrq(int sig)
+{
+    int err = errno;
+    (void) sig;
+
+    if (EA) {
+        if (usbReq.pending && IE_USB) {
+            USB_CUST_ISR_ENTER_HANDLER;
+            runUsbRequest();
+            USB_CUST_ISR_EXIT_HANDLER;
+            usbReq.pending = 0;
+            sem_post(&usbReq.done);
+        }
+        if (ES && (simRI || simTI)) {
+            UART0_ISR();
+        }
+        if (IE_UART1 && U1RI) {
+            UART1_ISR();
+        }
+        if (ET0 && simTF0) {
+            simTF0 = 0;
+            TIMER0_ISR();
+        }
+    }
+    errno = err;
+}
+
+static int irqRequested(void)
+{
+    return usbReq.pending || (ES && (simRI || simTI)) || (IE_UART1 && U1RI) ||
+        (ET0 && simTF0);
+}
+
+/*
+ * Threads
+ */
+static void* fwMainThread(void* arg)
+{
+    (void) arg;
+    sigsetjmp(fwRestart, 1); // back here after a bootloader run
+    fwMain();
+    return NULL;
+}
+
+static void* hwModelThread(void* arg)
+{
+    uint64_t txDone = 0;
+    uint64_t rxNext = 0;
+    uint64_t rx1Next = 0;
+    uint16_t t0Last = 0;
+    uint8_t txByte = 0;
+    int txBusy = 0;
+    (void) arg;
+
+    for (;;) {
+        uint64_t now = simNowUs();
+        uint32_t baud = uart0Baud();
+        uint32_t espBaud;
+        uint8_t c;
+
+        espSimPins(ESP_ENABLE, ESP_RESET, ESP_BOOT, now);
+
+        // Timer0 overflow
+        {
+            uint16_t t0 = timer0Count();
+            if (TR0 && t0 < t0Last) {
+                simTF0 = 1;
+            }
+            t0Last = t0;
+        }
+
+        // UART0 transmitter
+        if (!txBusy && takeTx(&txByte)) {
+            txBusy = 1;
+            txDone = now + BYTE_TIME_US(baud);
+        }
+        if (txBusy && now >= txDone) {
+            txBusy = 0;
+            espSimRx(txByte, baud);
+            simTI = 1;
+        }
+
+        // UART0 receiver: the ESP output is held back while the previous byte
+        // waits for the firmware. On the chip the ISR picks it up within
+        // microseconds, here the firmware thread may be waiting for a CPU.
+        if (now >= rxNext && !(REN && simRI) && espSimTx(&c, &espBaud, now)) {
+            rxNext = now + BYTE_TIME_US(baud);
+            if (!baudMatches(baud, espBaud)) {
+                c ^= 0x5A;
+            }
+            // with the receiver disabled the byte is lost
+            if (REN) {
+                putRx(c);
+                simRI = 1;
+            }
+        }
+
+        // UART1 receiver, the same way
+        if (now >= rx1Next && !(U1REN && U1RI) && espSimTx1(&c, &espBaud, now)) {
+            uint32_t baud1 = uart1Baud();
+            rx1Next = now + BYTE_TIME_US(baud1);
+            if (!baudMatches(baud1, espBaud)) {
+                c ^= 0x5A;
+            }
+            if (U1REN) {
+                SBUF1 = c;
+                U1RI = 1;
+            }
+        }
+
+        if (irqRequested()) {
+            pthread_kill(fwThread, SIM_IRQ_SIGNAL);
+        }
+        sleepUs(5);
+    }
+    return NULL;
+}
+
+static void simReport(void)
+{
+    int i;
+
+    fprintf(stderr, "bridge: request     count stalls  avg us  max us\n");
+    for (i = 0; i < 256; i++) {
+        sim_rtt_t* r = &controlRtt[i];
+        if (r->count) {
+            fprintf(stderr, "bridge:   0x%02x   %9u %6u %7llu %7llu\n", i, r->count,
+                r->stalls, (unsigned long long)(r->totalUs / r->count),
+                (unsigned long long)r->maxUs);
+        }
+    }
+    fprintf(stderr, "bridge: %u bulk/interrupt packets, %u NAKs, command queue depth max %u\n",
+        bulkPackets, bulkNaks, queueMax);
+}
+
+void simStart(void)
+{
+    struct sigaction sa;
+    int i;
+
+    if (started) {
+        return;
+    }
+    started = 1;
+
+    for (i = 0; i < I2C_SIM_REGS; i++) {
+        i2cRegs[i] = 0xA0 + i;
+    }
+    espSimInit();
+    dataFlashInit();
+    atexit(espSimReport);
+    atexit(simReport);
+    atexit(bootSimReport);
+    sem_init(&usbReq.done, 0, 0);
+    sem_init(&bootRun, 0, 0);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = simIrq;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIM_IRQ_SIGNAL, &sa, NULL);
+
+    // precise sleeps, the UART timing is built on them (inherited by the threads)
+    prctl(PR_SET_TIMERSLACK, 1);
+
+    pthread_create(&fwThread, NULL, fwMainThread, NULL);
+    pthread_create(&hwThread, NULL, hwModelThread, NULL);
+    {
+        // the firmware busy-waits, the model must preempt it (needs privileges)
+        struct sched_param param;
+        param.sched_priority = 1;
+        if (!getenv("SIM_NOFIFO")) pthread_setschedparam(hwThread, SCHED_FIFO, &param);
+    }
+
+    // the bridge was plugged in a while ago: let the firmware finish its start up
+    sleepUs(500000);
+}
+
+/*
+ * Host side
+ */
+// SIM_EP0_ONLY=1 hides the extra endpoints, as with an older firmware
+const uint8_t* simEndpointDesc(int* len)
+{
+    *len = getenv("SIM_EP0_ONLY") ? 0 : simEpDescLen;
+    return simEpDesc;
+}
+
+// hands one transaction to the firmware interrupt and waits for it
+static int usbTransaction(unsigned int timeout)
+{
+    struct timespec t;
+    int ret;
+
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_sec += timeout / 1000;
+    t.tv_nsec += (timeout % 1000) * 1000000L;
+    if (t.tv_nsec >= 1000000000L) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000L;
+    }
+
+    usbReq.pending = 1;
+    pthread_kill(fwThread, SIM_IRQ_SIGNAL);
+    while ((ret = sem_timedwait(&usbReq.done, &t)) && errno == EINTR);
+    if (ret == 0) {
+        return usbReq.result;
+    }
+    // withdraw the request unless the firmware has just picked it up
+    if (__sync_bool_compare_and_swap(&usbReq.pending, 1, 0)) {
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+    sem_wait(&usbReq.done);
+    return usbReq.result;
+}
+
+const char* simString(int index)
+{
+    static char serial[SERIAL_DIGITS + 1];
+
+    switch (index) {
+        case 1: return simVendorName;
+        case 2: return simProductName;
+        case 3: {
+            // a GET_DESCRIPTOR the firmware answers in its interrupt
+            pthread_mutex_lock(&usbLock);
+            usbReq.kind = USB_REQ_SERIAL;
+            usbReq.data = (uint8_t*) serial;
+            usbReq.len = sizeof(serial);
+            usbTransaction(1000);
+            pthread_mutex_unlock(&usbLock);
+            return serial;
+        }
+    }
+    return NULL;
+}
+
+int simControl(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index,
+        uint8_t* data, uint16_t len, unsigned int timeout)
+{
+    sim_rtt_t* rtt;
+    uint64_t start;
+    int ret;
+
+    pthread_mutex_lock(&usbLock);
+    usbReq.kind = USB_REQ_CONTROL;
+    usbReq.setup.bRequestType = requestType;
+    usbReq.setup.bRequest = request;
+    usbReq.setup.wValueL = value & 0xFF;
+    usbReq.setup.wValueH = value >> 8;
+    usbReq.setup.wIndexL = index & 0xFF;
+    usbReq.setup.wIndexH = index >> 8;
+    usbReq.setup.wLengthL = len & 0xFF;
+    usbReq.setup.wLengthH = len >> 8;
+    usbReq.data = data;
+    usbReq.len = len;
+    start = simNowUs();
+    ret = usbTransaction(timeout ? timeout : 1000);
+    start = simNowUs() - start;
+    rtt = &controlRtt[request];
+    rtt->count++;
+    rtt->stalls += ret == LIBUSB_ERROR_PIPE;
+    rtt->totalUs += start;
+    if (start > rtt->maxUs) {
+        rtt->maxUs = start;
+    }
+    pthread_mutex_unlock(&usbLock);
+    return ret;
+}
+
+int simEndpoint(uint8_t ep, uint8_t* data, int len, int* done, unsigned int timeout)
+{
+    uint64_t end = simNowUs() + (uint64_t)(timeout ? timeout : 3600000) * 1000;
+    int in = ep & 0x80;
+
+    *done = 0;
+    for (;;) {
+        int l = len - *done > 64 ? 64 : len - *done;
+        int ret;
+
+        if (!in && l == 0) {
+            return 0;
+        }
+        pthread_mutex_lock(&usbLock);
+        usbReq.kind = in ? USB_REQ_EP_IN : USB_REQ_EP_OUT;
+        usbReq.ep = ep;
+        usbReq.data = data + *done;
+        usbReq.len = l;
+        ret = usbTransaction(100);
+        if (ret >= 0) {
+            bulkPackets++;
+        } else
+        if (ret == LIBUSB_ERROR_BUSY) {
+            bulkNaks++;
+        }
+        pthread_mutex_unlock(&usbLock);
+
+        if (ret >= 0) {
+            *done += ret;
+            // IN transfer ends with a short packet or when the buffer is full
+            if (in && (ret < 64 || *done == len)) {
+                return 0;
+            }
+            continue;
+        }
+        if (ret != LIBUSB_ERROR_BUSY && ret != LIBUSB_ERROR_TIMEOUT) {
+            return ret;
+        }
+        if (simNowUs() >= end) {
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+        sleepUs(50);
+    }
+}
@@ -0,0 +1,4 @@
+// jump into the CH55x ROM bootloader, provided by the hardware model
+#pragma once
+
+void bootloader(void);
@@ -0,0 +1,204 @@
+// CH554 special function registers of the simulated bridge
+//
+// Every SFR and SFR bit is a plain variable. The hardware model in
+// fw_sim.c watches them the same way the CH55x peripherals do.
+#pragma once
+
+#include <stdint.h>
+
+#define SFR(n, a)       volatile uint8_t n
+#define SFR16(n, a)     volatile uint16_t n
+#define SBIT(n, a, b)   volatile uint8_t n
+
+// UART0 data register: like on the chip, writes go to the transmitter and
+// reads come from the receiver. Every access gets a cell loaded with the
+// received byte tagged with 0x100, a byte written by the firmware (< 0x100)
+// is picked up by the model.
+volatile uint16_t* simSbuf(void);
+#define SBUF (*simSbuf())
+
+SFR(PCON, 0x87);
+SFR(TMOD, 0x89);
+SFR(TL1, 0x8B);
+SFR(TH1, 0x8D);
+SFR(P1, 0x90);
+SFR(P1_MOD_OC, 0x92);
+SFR(P1_DIR_PU, 0x93);
+SFR(P3_MOD_OC, 0x96);
+SFR(P3_DIR_PU, 0x97);
+SFR(ADC_CFG, 0x9A);
+SFR(ADC_DATA, 0x9F);
+SFR(SAFE_MOD, 0xA1);
+SFR(XBUS_AUX, 0xA2);
+SFR(P3, 0xB0);
+SFR(GLOBAL_CFG, 0xB1);
+SFR(SBUF1, 0xC1);
+SFR(SBAUD1, 0xC2);
+SFR(PIN_FUNC, 0xC6);
+SFR(GPIO_IE, 0xC7);
+SFR(T2MOD, 0xC9);
+SFR(RCAP2L, 0xCA);
+SFR(RCAP2H, 0xCB);
+SFR(TL2, 0xCC);
+SFR(TH2, 0xCD);
+SFR(UEP1_CTRL, 0xD2);
+SFR(UEP1_T_LEN, 0xD3);
+SFR(UEP2_CTRL, 0xD4);
+SFR(UEP2_T_LEN, 0xD5);
+SFR(USB_INT_ST, 0xD9);
+SFR(USB_RX_LEN, 0xDB);
+SFR(UEP0_CTRL, 0xDC);
+SFR(UEP0_T_LEN, 0xDD);
+SFR(USB_INT_EN, 0xE1);
+SFR(USB_CTRL, 0xE2);
+SFR16(UEP2_DMA, 0xE4);
+SFR(IP_EX, 0xE9);
+SFR(UEP4_1_MOD, 0xEA);
+SFR(UEP2_3_MOD, 0xEB);
+SFR16(UEP0_DMA, 0xEC);
+SFR16(UEP1_DMA, 0xEE);
+SFR(ROM_ADDR_L, 0x84);
+SFR(ROM_ADDR_H, 0x85);
+SFR(ROM_CTRL, 0x86);
+SFR(ROM_DATA_L, 0x8E);
+SFR(ROM_DATA_H, 0x8F);
+// DataFlash: the command written to ROM_CTRL is carried out when the firmware
+// reads the status, see fw_sim.c
+volatile uint8_t* simRomStatus(void);
+#define ROM_STATUS (*simRomStatus())
+SFR(WDOG_COUNT, 0xFF);
+
+// ADC_CTRL
+SBIT(ADC_IF, 0x80, 5);
+SBIT(simADC_START, 0x80, 4);
+SBIT(ADC_CHAN1, 0x80, 1);
+SBIT(ADC_CHAN0, 0x80, 0);
+// TCON
+SBIT(TR1, 0x88, 6);
+SBIT(simTF0, 0x88, 5);
+SBIT(TR0, 0x88, 4);
+// SCON
+SBIT(SM0, 0x98, 7);
+SBIT(SM1, 0x98, 6);
+SBIT(SM2, 0x98, 5);
+SBIT(REN, 0x98, 4);
+SBIT(simTI, 0x98, 1);
+SBIT(simRI, 0x98, 0);
+// the firmware busy-waits on these: let the hardware model run meanwhile
+volatile uint8_t* simPoll(volatile uint8_t* bit);
+#define TI (*simPoll(&simTI))
+#define RI (*simPoll(&simRI))
+#define TF0 (*simPoll(&simTF0))
+#define ADC_START (*simPoll(&simADC_START))
+// Timer0 counts from the wall clock
+uint8_t simTimer0(int high);
+#define TL0 simTimer0(0)
+#define TH0 simTimer0(1)
+// IE
+SBIT(EA, 0xA8, 7);
+SBIT(ET2, 0xA8, 5);
+SBIT(ES, 0xA8, 4);
+SBIT(ET1, 0xA8, 3);
+SBIT(ET0, 0xA8, 1);
+// IP
+SBIT(PS, 0xB8, 4);
+SBIT(PT0, 0xB8, 1);
+// SCON1
+SBIT(U1SM0, 0xC0, 7);
+SBIT(U1SMOD, 0xC0, 5);
+SBIT(U1REN, 0xC0, 4);
+SBIT(U1TI, 0xC0, 1);
+SBIT(U1RI, 0xC0, 0);
+// T2CON
+SBIT(TF2, 0xC8, 7);
+SBIT(RCLK, 0xC8, 5);
+SBIT(TCLK, 0xC8, 4);
+SBIT(TR2, 0xC8, 2);
+SBIT(C_T2, 0xC8, 1);
+SBIT(CP_RL2, 0xC8, 0);
+// USB_INT_FG
+SBIT(U_TOG_OK, 0xD8, 6);
+SBIT(UIF_TRANSFER, 0xD8, 1);
+// IE_EX
+SBIT(IE_GPIO, 0xE8, 6);
+SBIT(IE_UART1, 0xE8, 4);
+SBIT(IE_ADC, 0xE8, 3);
+SBIT(IE_USB, 0xE8, 2);
+
+#define SMOD            0x80
+#define bIP_USB         0x04
+#define bIE_RXD0_LO     0x40
+#define bTMR_CLK        0x80
+#define bT2_CLK         0x40
+#define bT1_CLK         0x20
+#define bT0_CLK         0x10
+#define bT1_GATE        0x80
+#define bT1_CT          0x40
+#define MASK_T1_MOD     0x30
+#define bT1_M1          0x20
+#define bT1_M0          0x10
+#define bT0_GATE        0x08
+#define bT0_CT          0x04
+#define MASK_T0_MOD     0x03
+#define bT0_M1          0x02
+#define bT0_M0          0x01
+#define bUART1_PIN_X    0x20
+#define bUART0_PIN_X    0x10
+#define bADC_EN         0x08
+#define bADC_CLK        0x01
+#define bCODE_WE        0x02
+#define bDATA_WE        0x04
+#define bWDOG_EN        0x01
+#define ROM_CMD_WRITE   0x9A
+#define ROM_CMD_READ    0x8E
+#define bROM_ADDR_OK    0x40
+#define bROM_CMD_ERR    0x02
+#define DATA_FLASH_ADDR 0xC000
+// the chip ID words in code memory, the firmware reads them through a pointer
+extern uint16_t simChipId[3];
+#define ROM_CHIP_ID_HX  ((uintptr_t)&simChipId[0])
+#define ROM_CHIP_ID_LO  ((uintptr_t)&simChipId[1])
+#define ROM_CHIP_ID_HI  ((uintptr_t)&simChipId[2])
+#define bDPTR_AU        0x40
+#define bDPTR_SEL       0x01
+
+#define bUEP1_RX_EN     0x80
+#define bUEP1_TX_EN     0x40
+#define bUEP1_BUF_MOD   0x10
+#define bUEP2_RX_EN     0x08
+#define bUEP2_TX_EN     0x04
+#define bUEP2_BUF_MOD   0x01
+#define bUEP_R_TOG      0x80
+#define bUEP_T_TOG      0x40
+#define bUEP_AUTO_TOG   0x10
+#define MASK_UEP_R_RES  0x0C
+#define UEP_R_RES_ACK   0x00
+#define UEP_R_RES_TOUT  0x04
+#define UEP_R_RES_NAK   0x08
+#define UEP_R_RES_STALL 0x0C
+#define MASK_UEP_T_RES  0x03
+#define UEP_T_RES_ACK   0x00
+#define UEP_T_RES_TOUT  0x01
+#define UEP_T_RES_NAK   0x02
+#define UEP_T_RES_STALL 0x03
+#define MASK_UIS_TOKEN  0x30
+#define MASK_UIS_ENDP   0x0F
+#define UIS_TOKEN_OUT   0x00
+#define UIS_TOKEN_SOF   0x10
+#define UIS_TOKEN_IN    0x20
+#define UIS_TOKEN_SETUP 0x30
+
+#define INT_NO_INT0     0
+#define INT_NO_TMR0     1
+#define INT_NO_INT1     2
+#define INT_NO_TMR1     3
+#define INT_NO_UART0    4
+#define INT_NO_TMR2     5
+#define INT_NO_SPI0     6
+#define INT_NO_TKEY     7
+#define INT_NO_USB      8
+#define INT_NO_ADC      9
+#define INT_NO_UART1    10
+#define INT_NO_PWMX     11
+#define INT_NO_GPIO     12
+#define INT_NO_WDOG     13
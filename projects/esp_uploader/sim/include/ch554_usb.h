@@ -0,0 +1,17 @@
+// USB definitions of the simulated bridge
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+    uint8_t bRequestType;
+    uint8_t bRequest;
+    uint8_t wValueL;
+    uint8_t wValueH;
+    uint8_t wIndexL;
+    uint8_t wIndexH;
+    uint8_t wLengthL;
+    uint8_t wLengthH;
+} USB_SETUP_REQ;
+
+#define USB_DESCR_TYP_STRING 0x03
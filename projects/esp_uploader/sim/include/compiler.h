@@ -0,0 +1,16 @@
+// sdcc keywords of the firmware mapped for the host compiler
+#pragma once
+
+#include <stdint.h>
+
+#define __xdata
+#define __idata
+#define __data
+#define __pdata
+#define __code const
+#define __at(x)
+#define __interrupt(x)
+#define __using(x)
+#define __naked
+#define __critical
+#define __bit uint8_t
@@ -0,0 +1,3 @@
+// the simulated bridge builds its descriptors from the USB_CUST_* definitions,
+// see usb_intr.h
+#pragma once
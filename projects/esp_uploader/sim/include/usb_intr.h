@@ -0,0 +1,81 @@
+// USB device engine of the simulated bridge
+//
+// Stands in for the USB interrupt handler of the SDK: the hardware model
+// (fw_sim.c) calls the sim* functions below from the firmware's interrupt
+// context and they route the request to the USB_CUST_* handlers.
+#pragma once
+
+#include <string.h>
+
+__xdata uint8_t Ep0Buffer[DEFAULT_ENDP0_SIZE];
+USB_SETUP_REQ simSetupBuf;
+#define UsbSetupBuf (&simSetupBuf)
+uint8_t UsbIntrSetupReq;
+
+const char simVendorName[] = USB_CUST_VENDOR_NAME;
+const char simProductName[] = USB_CUST_PRODUCT_NAME;
+
+#ifdef USB_CUST_EP_DESC
+const uint8_t simEpDesc[] = { USB_CUST_EP_DESC };
+const int simEpDescLen = sizeof(simEpDesc);
+#else
+const uint8_t simEpDesc[1];
+const int simEpDescLen = 0;
+#endif
+
+static void simUsbReset(void)
+{
+    UEP1_CTRL = UEP_T_RES_NAK;
+    UEP2_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+#ifdef USB_CUST_EP_INIT_HANDLER
+    USB_CUST_EP_INIT_HANDLER;
+#endif
+}
+
+void USBDeviceCfg(void)
+{
+    simUsbReset();
+    IE_USB = 1;
+}
+
+// SETUP stage of a vendor request, returns the IN data length or 0xFF (stall)
+static uint16_t simUsbSetup(const USB_SETUP_REQ* req)
+{
+    simSetupBuf = *req;
+    UsbIntrSetupReq = req->bRequest;
+    return USB_CUST_CONTROL_TRANSFER_HANDLER;
+}
+
+// one OUT packet of the DATA stage of a vendor request
+static void simUsbData(const uint8_t* data, uint8_t len)
+{
+    memcpy(Ep0Buffer, data, len);
+    USB_RX_LEN = len;
+    USB_CUST_CONTROL_DATA_HANDLER;
+}
+
+// a transfer on the other endpoints finished, 'token' as in USB_INT_ST
+static void simUsbEndpoint(uint8_t token)
+{
+    USB_INT_ST = token;
+    U_TOG_OK = 1;
+#ifdef USB_CUST_EP_TRANSFER_HANDLER
+    USB_CUST_EP_TRANSFER_HANDLER;
+#endif
+}
+
+// the serial number string descriptor in ASCII, returns its length (0: the
+// firmware has none)
+static int simUsbSerial(char* s, int max)
+{
+    int n = 0;
+#ifdef USB_CUST_SERIAL_HANDLER
+    uint8_t len = USB_CUST_SERIAL_HANDLER;
+    uint8_t i;
+    for (i = 2; i + 1 < len && n + 1 < max; i += 2) {
+        s[n++] = Ep0Buffer[i];
+    }
+#endif
+    s[n] = 0;
+    return n;
+}
@@ -0,0 +1,32 @@
+// Simulated bridge: CH55x running the firmware from src/main.c, wired to a
+// simulated ESP chip. The fake libusb (usb_sim.c) talks to it through these
+// calls, which return libusb style results.
+#pragma once
+
+#include <stdint.h>
+
+#define SIM_VENDOR_ID   0x16c0
+#define SIM_PRODUCT_ID  0x05dc
+
+// starts the firmware and the hardware model, safe to call more than once
+void simStart(void);
+
+// USB strings and the endpoint descriptors declared by the firmware
+const char* simString(int index);
+const uint8_t* simEndpointDesc(int* len);
+
+// EP0 vendor request, returns the transferred length or a negative libusb error
+int simControl(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index,
+        uint8_t* data, uint16_t len, unsigned int timeout);
+
+// transfer on the other endpoints, returns 0 or a negative libusb error,
+// 'done' is the number of bytes moved even when the transfer failed
+int simEndpoint(uint8_t ep, uint8_t* data, int len, int* done, unsigned int timeout);
+
+uint64_t simNowUs(void);
+
+// the bridge runs its ROM bootloader (boot_sim.c) instead of the firmware,
+// after COMMAND_JUMP_TO_BOOTLOADER
+int simInBootloader(void);
+// the bootloader starts the firmware again
+void simLeaveBootloader(void);
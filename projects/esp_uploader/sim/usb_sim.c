@@ -0,0 +1,521 @@
+// Fake libusb: a single device on bus 1, the simulated bridge from fw_sim.c
+//
+// Implements the subset of the libusb-1.0 API the uploader uses so that
+// pc_upl can be linked against the simulation instead of -lusb-1.0. After
+// COMMAND_JUMP_TO_BOOTLOADER the device is the CH55x bootloader (boot_sim.c)
+// until the new firmware is started. The asynchronous transfers are run one
+// at a time, in submission order, by a thread standing in for the host
+// controller; their callbacks run in the thread handling the events.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef MINGW
+#include <libusbx-1.0/libusb.h>
+#else
+#include <libusb-1.0/libusb.h>
+#endif
+
+#include "sim.h"
+#include "boot_sim.h"
+
+struct libusb_context {
+    int dummy;
+};
+
+struct libusb_device {
+    int dummy;
+};
+
+struct libusb_device_handle {
+    libusb_device* dev;
+};
+
+static libusb_context simContext;
+static libusb_device simDevice;
+static libusb_device_handle simHandle = { &simDevice };
+
+// submitted and completed asynchronous transfers
+#define ASYNC_MAX 64
+
+typedef struct {
+    struct libusb_transfer* t[ASYNC_MAX];
+    int head;
+    int count;
+} transfer_queue_t;
+
+static transfer_queue_t asyncQueue;
+static transfer_queue_t doneQueue;
+static pthread_mutex_t asyncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t asyncSubmitted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t asyncDone = PTHREAD_COND_INITIALIZER;
+static pthread_t hostControllerThread;
+static int hostControllerOn;
+
+// the endpoints of the CH55x bootloader
+static const uint8_t bootEpDesc[] = {
+    0x07, 0x05, 0x82, 0x02, 0x40, 0x00, 0x00,
+    0x07, 0x05, 0x02, 0x02, 0x40, 0x00, 0x00,
+};
+
+int libusb_init(libusb_context** ctx)
+{
+    simStart();
+    if (ctx != NULL) {
+        *ctx = &simContext;
+    }
+    return 0;
+}
+
+void libusb_exit(libusb_context* ctx)
+{
+    (void) ctx;
+}
+
+void libusb_set_debug(libusb_context* ctx, int level)
+{
+    (void) ctx;
+    (void) level;
+}
+
+ssize_t libusb_get_device_list(libusb_context* ctx, libusb_device*** list)
+{
+    (void) ctx;
+    *list = calloc(2, sizeof(libusb_device*));
+    (*list)[0] = &simDevice;
+    return 1;
+}
+
+void libusb_free_device_list(libusb_device** list, int unref_devices)
+{
+    (void) unref_devices;
+    free(list);
+}
+
+int libusb_get_device_descriptor(libusb_device* dev, struct libusb_device_descriptor* desc)
+{
+    (void) dev;
+    memset(desc, 0, sizeof(*desc));
+    desc->bLength = 18;
+    desc->bDescriptorType = LIBUSB_DT_DEVICE;
+    desc->bcdUSB = 0x0110;
+    desc->bDeviceClass = 0xFF;
+    desc->bMaxPacketSize0 = 32;
+    desc->idVendor = SIM_VENDOR_ID;
+    desc->idProduct = SIM_PRODUCT_ID;
+    desc->bcdDevice = 0x0100;
+    desc->iManufacturer = 1;
+    desc->iProduct = 2;
+    desc->iSerialNumber = 3;
+    if (simInBootloader()) {
+        desc->idVendor = BOOT_SIM_VENDOR_ID;
+        desc->idProduct = BOOT_SIM_PRODUCT_ID;
+        desc->bcdDevice = 0x0240;
+        desc->iManufacturer = 0;
+        desc->iProduct = 0;
+        desc->iSerialNumber = 0;
+    }
+    desc->bNumConfigurations = 1;
+    return 0;
+}
+
+int libusb_get_active_config_descriptor(libusb_device* dev, struct libusb_config_descriptor** config)
+{
+    struct libusb_config_descriptor* c;
+    struct libusb_interface* itf;
+    struct libusb_interface_descriptor* alt;
+    struct libusb_endpoint_descriptor* ep;
+    const uint8_t* d;
+    int len;
+    int n;
+    int i;
+
+    (void) dev;
+    if (simInBootloader()) {
+        d = bootEpDesc;
+        len = sizeof(bootEpDesc);
+    } else {
+        d = simEndpointDesc(&len);
+    }
+    n = len / 7;
+
+    c = calloc(1, sizeof(*c));
+    itf = calloc(1, sizeof(*itf));
+    alt = calloc(1, sizeof(*alt));
+    ep = calloc(n + 1, sizeof(*ep));
+
+    for (i = 0; i < n; i++, d += 7) {
+        ep[i].bLength = d[0];
+        ep[i].bDescriptorType = d[1];
+        ep[i].bEndpointAddress = d[2];
+        ep[i].bmAttributes = d[3];
+        ep[i].wMaxPacketSize = d[4] | (d[5] << 8);
+        ep[i].bInterval = d[6];
+    }
+    alt->bLength = 9;
+    alt->bDescriptorType = LIBUSB_DT_INTERFACE;
+    alt->bNumEndpoints = n;
+    alt->bInterfaceClass = 0xFF;
+    alt->endpoint = ep;
+    itf->altsetting = alt;
+    itf->num_altsetting = 1;
+    c->bLength = 9;
+    c->bDescriptorType = LIBUSB_DT_CONFIG;
+    c->bNumInterfaces = 1;
+    c->bConfigurationValue = 1;
+    c->interface = itf;
+    *config = c;
+    return 0;
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor* config)
+{
+    if (config == NULL) {
+        return;
+    }
+    free((void*) config->interface->altsetting->endpoint);
+    free((void*) config->interface->altsetting);
+    free((void*) config->interface);
+    free(config);
+}
+
+libusb_device* libusb_get_device(libusb_device_handle* dev_handle)
+{
+    return dev_handle->dev;
+}
+
+uint8_t libusb_get_bus_number(libusb_device* dev)
+{
+    (void) dev;
+    return 1;
+}
+
+uint8_t libusb_get_device_address(libusb_device* dev)
+{
+    (void) dev;
+    return 2;
+}
+
+int libusb_open(libusb_device* dev, libusb_device_handle** dev_handle)
+{
+    (void) dev;
+    *dev_handle = &simHandle;
+    return 0;
+}
+
+void libusb_close(libusb_device_handle* dev_handle)
+{
+    (void) dev_handle;
+}
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle* dev_handle, uint8_t desc_index,
+        unsigned char* data, int length)
+{
+    const char* s = simString(desc_index);
+    (void) dev_handle;
+    if (s == NULL || length < 1) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    strncpy((char*) data, s, length - 1);
+    data[length - 1] = 0;
+    return strlen((char*) data);
+}
+
+int libusb_get_descriptor(libusb_device_handle* dev_handle, uint8_t desc_type, uint8_t desc_index,
+        unsigned char* data, int length)
+{
+    (void) dev_handle;
+    (void) desc_type;
+    (void) desc_index;
+    (void) data;
+    (void) length;
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_kernel_driver_active(libusb_device_handle* dev_handle, int interface_number)
+{
+    (void) dev_handle;
+    (void) interface_number;
+    return 0;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle* dev_handle, int interface_number)
+{
+    (void) dev_handle;
+    (void) interface_number;
+    return 0;
+}
+
+int libusb_set_configuration(libusb_device_handle* dev_handle, int configuration)
+{
+    (void) dev_handle;
+    (void) configuration;
+    return 0;
+}
+
+int libusb_claim_interface(libusb_device_handle* dev_handle, int interface_number)
+{
+    (void) dev_handle;
+    (void) interface_number;
+    return 0;
+}
+
+int libusb_release_interface(libusb_device_handle* dev_handle, int interface_number)
+{
+    (void) dev_handle;
+    (void) interface_number;
+    return 0;
+}
+
+int libusb_set_interface_alt_setting(libusb_device_handle* dev_handle, int interface_number,
+        int alternate_setting)
+{
+    (void) dev_handle;
+    (void) interface_number;
+    (void) alternate_setting;
+    return 0;
+}
+
+int libusb_clear_halt(libusb_device_handle* dev_handle, unsigned char endpoint)
+{
+    (void) dev_handle;
+    (void) endpoint;
+    return 0;
+}
+
+int libusb_control_transfer(libusb_device_handle* dev_handle, uint8_t request_type, uint8_t bRequest,
+        uint16_t wValue, uint16_t wIndex, unsigned char* data, uint16_t wLength, unsigned int timeout)
+{
+    (void) dev_handle;
+    if (simInBootloader()) {
+        return LIBUSB_ERROR_PIPE;
+    }
+    return simControl(request_type, bRequest, wValue, wIndex, data, wLength, timeout);
+}
+
+int libusb_bulk_transfer(libusb_device_handle* dev_handle, unsigned char endpoint,
+        unsigned char* data, int length, int* actual_length, unsigned int timeout)
+{
+    int done = 0;
+    int ret;
+    (void) dev_handle;
+    if (simInBootloader()) {
+        ret = bootSimTransfer(endpoint, data, length, &done);
+    } else {
+        ret = simEndpoint(endpoint, data, length, &done, timeout);
+    }
+    if (actual_length != NULL) {
+        *actual_length = done;
+    }
+    return ret;
+}
+
+int libusb_interrupt_transfer(libusb_device_handle* dev_handle, unsigned char endpoint,
+        unsigned char* data, int length, int* actual_length, unsigned int timeout)
+{
+    return libusb_bulk_transfer(dev_handle, endpoint, data, length, actual_length, timeout);
+}
+
+/*
+ * Asynchronous transfers
+ */
+static void pushTransfer(transfer_queue_t* q, struct libusb_transfer* t)
+{
+    q->t[(q->head + q->count) % ASYNC_MAX] = t;
+    q->count++;
+}
+
+static struct libusb_transfer* popTransfer(transfer_queue_t* q)
+{
+    struct libusb_transfer* t = q->t[q->head];
+
+    q->head = (q->head + 1) % ASYNC_MAX;
+    q->count--;
+    return t;
+}
+
+// runs a transfer with the synchronous calls, sets its status
+static void runTransfer(struct libusb_transfer* t)
+{
+    int ret;
+
+    t->actual_length = 0;
+    if (t->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+        uint8_t* s = t->buffer;
+
+        ret = libusb_control_transfer(t->dev_handle, s[0], s[1], s[2] | (s[3] << 8), s[4] | (s[5] << 8),
+                s + LIBUSB_CONTROL_SETUP_SIZE, s[6] | (s[7] << 8), t->timeout);
+        if (ret > 0) {
+            t->actual_length = ret;
+        }
+    } else {
+        ret = libusb_bulk_transfer(t->dev_handle, t->endpoint, t->buffer, t->length,
+                &t->actual_length, t->timeout);
+    }
+    switch (ret < 0 ? ret : 0) {
+        case 0: t->status = LIBUSB_TRANSFER_COMPLETED; break;
+        case LIBUSB_ERROR_TIMEOUT: t->status = LIBUSB_TRANSFER_TIMED_OUT; break;
+        case LIBUSB_ERROR_PIPE: t->status = LIBUSB_TRANSFER_STALL; break;
+        case LIBUSB_ERROR_NO_DEVICE: t->status = LIBUSB_TRANSFER_NO_DEVICE; break;
+        default: t->status = LIBUSB_TRANSFER_ERROR; break;
+    }
+}
+
+static void* hostControllerMain(void* arg)
+{
+    (void) arg;
+    for (;;) {
+        struct libusb_transfer* t;
+
+        pthread_mutex_lock(&asyncLock);
+        while (asyncQueue.count == 0) {
+            pthread_cond_wait(&asyncSubmitted, &asyncLock);
+        }
+        t = popTransfer(&asyncQueue);
+        pthread_mutex_unlock(&asyncLock);
+
+        runTransfer(t);
+
+        pthread_mutex_lock(&asyncLock);
+        pushTransfer(&doneQueue, t);
+        pthread_cond_broadcast(&asyncDone);
+        pthread_mutex_unlock(&asyncLock);
+    }
+    return NULL;
+}
+
+struct libusb_transfer* libusb_alloc_transfer(int iso_packets)
+{
+    return calloc(1, sizeof(struct libusb_transfer) +
+            iso_packets * sizeof(struct libusb_iso_packet_descriptor));
+}
+
+void libusb_free_transfer(struct libusb_transfer* transfer)
+{
+    if (transfer != NULL && (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER)) {
+        free(transfer->buffer);
+    }
+    free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer* transfer)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&asyncLock);
+    if (!hostControllerOn) {
+        hostControllerOn = pthread_create(&hostControllerThread, NULL, hostControllerMain, NULL) == 0;
+    }
+    if (!hostControllerOn || asyncQueue.count + doneQueue.count >= ASYNC_MAX) {
+        ret = LIBUSB_ERROR_NO_MEM;
+    } else {
+        pushTransfer(&asyncQueue, transfer);
+        pthread_cond_signal(&asyncSubmitted);
+    }
+    pthread_mutex_unlock(&asyncLock);
+    return ret;
+}
+
+// a transfer not started yet completes as cancelled, a running one just completes
+int libusb_cancel_transfer(struct libusb_transfer* transfer)
+{
+    int ret = LIBUSB_ERROR_NOT_FOUND;
+    int i;
+
+    pthread_mutex_lock(&asyncLock);
+    for (i = 0; i < asyncQueue.count; i++) {
+        if (asyncQueue.t[(asyncQueue.head + i) % ASYNC_MAX] == transfer) {
+            break;
+        }
+    }
+    if (i < asyncQueue.count) {
+        for (; i + 1 < asyncQueue.count; i++) {
+            asyncQueue.t[(asyncQueue.head + i) % ASYNC_MAX] = asyncQueue.t[(asyncQueue.head + i + 1) % ASYNC_MAX];
+        }
+        asyncQueue.count--;
+        transfer->status = LIBUSB_TRANSFER_CANCELLED;
+        transfer->actual_length = 0;
+        pushTransfer(&doneQueue, transfer);
+        pthread_cond_broadcast(&asyncDone);
+        ret = 0;
+    } else
+    if (hostControllerOn) {
+        ret = 0; // it may be running
+    }
+    pthread_mutex_unlock(&asyncLock);
+    return ret;
+}
+
+// waits up to 'tv' (NULL: a minute) for completed transfers and calls back
+int libusb_handle_events_timeout_completed(libusb_context* ctx, struct timeval* tv, int* completed)
+{
+    struct libusb_transfer* done[ASYNC_MAX];
+    struct timespec end;
+    int count = 0;
+    int i;
+
+    (void) ctx;
+    clock_gettime(CLOCK_REALTIME, &end);
+    end.tv_sec += tv != NULL ? tv->tv_sec : 60;
+    end.tv_nsec += tv != NULL ? tv->tv_usec * 1000L : 0;
+    if (end.tv_nsec >= 1000000000L) {
+        end.tv_sec++;
+        end.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&asyncLock);
+    while (doneQueue.count == 0 && (completed == NULL || !*completed)) {
+        if (pthread_cond_timedwait(&asyncDone, &asyncLock, &end) == ETIMEDOUT) {
+            break;
+        }
+    }
+    while (doneQueue.count) {
+        done[count++] = popTransfer(&doneQueue);
+    }
+    pthread_mutex_unlock(&asyncLock);
+
+    for (i = 0; i < count; i++) {
+        int freeIt = done[i]->flags & LIBUSB_TRANSFER_FREE_TRANSFER;
+
+        done[i]->callback(done[i]);
+        if (freeIt) {
+            libusb_free_transfer(done[i]);
+        }
+    }
+    return 0;
+}
+
+int libusb_handle_events_timeout(libusb_context* ctx, struct timeval* tv)
+{
+    return libusb_handle_events_timeout_completed(ctx, tv, NULL);
+}
+
+int libusb_handle_events_completed(libusb_context* ctx, int* completed)
+{
+    return libusb_handle_events_timeout_completed(ctx, NULL, completed);
+}
+
+int libusb_handle_events(libusb_context* ctx)
+{
+    return libusb_handle_events_timeout_completed(ctx, NULL, NULL);
+}
+
+const char* libusb_error_name(int errcode)
+{
+    switch (errcode) {
+        case LIBUSB_SUCCESS: return "LIBUSB_SUCCESS";
+        case LIBUSB_ERROR_IO: return "LIBUSB_ERROR_IO";
+        case LIBUSB_ERROR_INVALID_PARAM: return "LIBUSB_ERROR_INVALID_PARAM";
+        case LIBUSB_ERROR_PIPE: return "LIBUSB_ERROR_PIPE";
+        case LIBUSB_ERROR_TIMEOUT: return "LIBUSB_ERROR_TIMEOUT";
+        case LIBUSB_ERROR_BUSY: return "LIBUSB_ERROR_BUSY";
+        case LIBUSB_ERROR_NOT_SUPPORTED: return "LIBUSB_ERROR_NOT_SUPPORTED";
+        case LIBUSB_ERROR_NO_DEVICE: return "LIBUSB_ERROR_NO_DEVICE";
+        case LIBUSB_ERROR_OVERFLOW: return "LIBUSB_ERROR_OVERFLOW";
+    }
+    return "LIBUSB_ERROR_OTHER";
+}
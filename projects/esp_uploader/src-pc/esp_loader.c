@@ -105,20 +105,26 @@ esp_loader_error_t esp_loader_connect(esp_loader_connect_args_t *connect_args)
     esp_loader_error_t err;
     int32_t trials = connect_args->trials;
 
-    loader_port_enter_bootloader();
-
-    do {
-        loader_port_start_timer(connect_args->sync_timeout);
-        err = loader_sync_cmd();
-        if (err == ESP_LOADER_ERROR_TIMEOUT) {
-            if (--trials == 0) {
-                return ESP_LOADER_ERROR_TIMEOUT;
+    // the serial peripheral may run the whole handshake on its own
+    err = loader_port_sync(connect_args->sync_timeout, trials);
+    if (err == ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
+        loader_port_enter_bootloader();
+
+        do {
+            loader_port_start_timer(connect_args->sync_timeout);
+            err = loader_sync_cmd();
+            if (err == ESP_LOADER_ERROR_TIMEOUT) {
+                if (--trials == 0) {
+                    return ESP_LOADER_ERROR_TIMEOUT;
+                }
+                loader_port_delay_ms(100);
+            } else if (err != ESP_LOADER_SUCCESS) {
+                return err;
             }
-            loader_port_delay_ms(100);
-        } else if (err != ESP_LOADER_SUCCESS) {
-            return err;
-        }
-    } while (err != ESP_LOADER_SUCCESS);
+        } while (err != ESP_LOADER_SUCCESS);
+    } else if (err != ESP_LOADER_SUCCESS) {
+        return err;
+    }
 
     RETURN_ON_ERROR( loader_detect_chip(&s_target, &s_reg) );
 
@@ -96,10 +96,33 @@ static char* get_chip_name(target_chip_t type) {
 	}
 }
 
+#define CHIP_DETECT_MAGIC_REG_ADDR 0x40001000
+
+// switch the target and the serial peripheral to a higher baud rate and check
+// the target still answers
+static esp_loader_error_t change_baudrate(uint32_t baudrate)
+{
+    uint32_t magic;
+    esp_loader_error_t err;
+
+    err = esp_loader_change_baudrate(baudrate);
+    if (err != ESP_LOADER_SUCCESS) {
+        return err;
+    }
+    err = loader_port_change_baudrate(baudrate);
+    if (err != ESP_LOADER_SUCCESS) {
+        return err;
+    }
+    return esp_loader_read_register(CHIP_DETECT_MAGIC_REG_ADDR, &magic);
+}
+
 esp_loader_error_t connect_to_target(uint32_t higrer_baudrate)
 {
+    // tried from the requested rate down when the link does not work
+    static const uint32_t fallback_baudrates[] = { 921600, 460800, 230400, 0 };
     target_chip_t type;
     esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    uint32_t connect_baudrate = loader_port_get_baudrate();
 
     esp_loader_error_t err = esp_loader_connect(&connect_config);
     if (err != ESP_LOADER_SUCCESS) {
@@ -110,27 +133,42 @@ esp_loader_error_t connect_to_target(uint32_t higrer_baudrate)
     printf("Connected to %s\n", get_chip_name(type));
 
     if (higrer_baudrate && type != ESP8266_CHIP) {
-        err = esp_loader_change_baudrate(higrer_baudrate);
-        if (err == ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
-            printf("ESP8266 does not support change baudrate command.\n");
-            return err;
-        } else if (err != ESP_LOADER_SUCCESS) {
-            printf("Unable to change baud rate on target.\n");
-            return err;
-        } else {
-            err = loader_port_change_baudrate(higrer_baudrate);
-            if (err != ESP_LOADER_SUCCESS) {
-                printf("Unable to change baud rate.\n");
-                return err;
+        uint32_t requested = higrer_baudrate;
+        int i = 0;
+
+        while (requested > connect_baudrate) {
+            // the target takes any rate: use the one the serial peripheral
+            // gets closest to
+            uint32_t baudrate = loader_port_nearest_baudrate(requested);
+            if (baudrate > connect_baudrate) {
+                err = change_baudrate(baudrate);
+                if (err == ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
+                    printf("ESP8266 does not support change baudrate command.\n");
+                    return err;
+                }
+                if (err == ESP_LOADER_SUCCESS) {
+                    printf("Baudrate changed\n");
+                    return ESP_LOADER_SUCCESS;
+                }
+                // start over at the connect rate
+                printf("No response at %u baud, falling back\n", baudrate);
+                loader_port_change_baudrate(connect_baudrate);
+                err = esp_loader_connect(&connect_config);
+                if (err != ESP_LOADER_SUCCESS) {
+                    printf("Cannot connect to target. Error: %u\n", err);
+                    return err;
+                }
             }
-            printf("Baudrate changed\n");
+            while (fallback_baudrates[i] >= requested) {
+                i++;
+            }
+            requested = fallback_baudrates[i];
         }
     }
 
     return ESP_LOADER_SUCCESS;
 }
 
-
 esp_loader_error_t flash_binary(const uint8_t *bin, size_t size, size_t address)
 {
     esp_loader_error_t err;
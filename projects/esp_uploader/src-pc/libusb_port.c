@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -98,15 +99,254 @@ static void serial_debug_print(const uint8_t *data, uint16_t size, bool write) {
 #define COMMAND_WRITE_UART 0x02
 #define COMMAND_SET_GPIO   0x03
 #define COMMAND_SET_BAUDR  0x04
+#define COMMAND_SET_BULK   0x05
+#define COMMAND_GET_UART_STATUS 0x06
+#define COMMAND_GET_BAUDR  0x07
+#define COMMAND_FLASH_FRAME 0x08
+#define COMMAND_SET_RX_FRAMES 0x09
+#define COMMAND_SET_GPIO_SEQ 0x0A
+#define COMMAND_GET_GPIO_SEQ 0x0B
+#define COMMAND_SYNC       0x0C
+#define COMMAND_GET_SYNC   0x0D
+#define COMMAND_GET_QUEUE  0x0E
+#define COMMAND_GET_STATS  0x0F
+#define COMMAND_BOOT_PROFILE     0x10
+#define COMMAND_GET_BOOT_PROFILE 0x11
+#define COMMAND_GET_BOOT_LOG     0x12
+#define COMMAND_SET_LOOPBACK     0x13
+#define COMMAND_SET_UART1        0x14
+#define COMMAND_RUN_SCRIPT       0x15
+#define COMMAND_GET_SCRIPT       0x16
+#define COMMAND_GET_CONFIG       0x17
+#define COMMAND_SET_CONFIG       0x18
+#define COMMAND_SET_TRIGGER      0x19
+#define COMMAND_GET_TRIGGER      0x1A
+#define COMMAND_JUMP_TO_BOOTLOADER 0xB0
+
+//GET_BOOT_PROFILE: end the profiling
+#define BOOT_PROFILE_STOP 1
+//GET_BOOT_PROFILE: the most line times one request returns
+#define BOOT_TIMES_READ 7
+//boot log lines longer than this are cut in the report
+#define BOOT_LINE_MAX 100
+
+//GET_BOOT_LOG: what to read, the offset of a rate change when there was none
+#define BOOT_LOG_HEADER 0
+#define BOOT_LOG_DATA   1
+#define BOOT_LOG_NO_CHANGE 0xFF
+
+//pattern trigger: patterns matched by the bridge, its state reported by
+//GET_TRIGGER, the hit sent as an EP1 notification flag
+#define TRIGGER_MAX 2
+#define TRIGGER_LEN 16
+#define TRIGGER_IDLE  0
+#define TRIGGER_ARMED 1
+#define TRIGGER_HIT   2
+#define NOTIFY_TRIGGER 0x02
+
+//link benchmark: bytes streamed per rate, the chunk kept in flight (the
+//bridge buffers 128 bytes in its read ring and 64 in the bulk IN endpoint),
+//round trips timed per rate
+//UART1 capture: the read data come as [channel | length][bytes] frames
+#define MUX_CHANNEL1 0x80
+#define MUX_LEN_MASK 0x7F
+#define MONITOR_LINE_MAX 100
+
+//peripheral script ops, see COMMAND_RUN_SCRIPT in the firmware
+#define SCRIPT_SET       0x01
+#define SCRIPT_GET       0x02
+#define SCRIPT_ADC       0x03
+#define SCRIPT_I2C_WRITE 0x04
+#define SCRIPT_I2C_READ  0x05
+#define SCRIPT_I2C_REG   0x06
+#define SCRIPT_DELAY     0x07
+#define SCRIPT_MAX       32
+#define SCRIPT_BUSY   1
+#define SCRIPT_DONE   2
+#define I2C_NAK 1
+
+#define BENCH_BYTES  8192
+#define BENCH_CHUNK  64
+#define BENCH_PINGS  100
+#define BENCH_TRIES  3   //sends of a chunk received wrong
+
+//CH55x ROM bootloader (version 2.30 and later): [cmd][len lo][len hi][data]
+//packets on EP2, each answered by [cmd][0][len lo][len hi][status]...
+#define ISP_VENDOR_ID  0x4348
+#define ISP_PRODUCT_ID 0x55e0
+#define ISP_EP_OUT 0x02
+#define ISP_EP_IN  0x82
+#define ISP_DETECT 0xA1
+#define ISP_RESET  0xA2
+#define ISP_KEY    0xA3
+#define ISP_ERASE  0xA4
+#define ISP_WRITE  0xA5
+#define ISP_VERIFY 0xA6
+#define ISP_CONFIG 0xA7
+#define ISP_KEY_LEN    0x30
+#define ISP_CHUNK      56   //image bytes per write / verify packet
+#define ISP_BLOCK      1024 //erase unit
+#define ISP_MIN_BLOCKS 8
+#define ISP_CONFIG_LEN 30
+#define ISP_MAX_SIZE   (14 * 1024) //CH552, CH554
+#define ISP_ENUM_TIMEOUT 5000 //ms for the bridge to show up in either mode
+
+//GET_STATS: clear the counters after reading them
+#define STATS_CLEAR 1
+//the bridge times its interrupts with Timer0: FREQ_SYS (16MHz) / 12
+#define BRIDGE_TICK_NS 750
+
+//SYNC handshake state reported by the bridge
+#define SYNC_BUSY   1
+#define SYNC_DONE   2
+
+//GPIO sequence: [pins][delay lo][delay hi] steps, pins as in COMMAND_SET_GPIO
+#define GPIO_SEQ_STEP 3
+#define GPIO_SEQ_MAX  (MAX_PACKET_LEN / GPIO_SEQ_STEP)
+#define GPIO_BOOT   0x01
+#define GPIO_RESET  0x02
+#define GPIO_ENABLE 0x04
+
+//reset timing (us): EN/RST held low long enough to discharge the RC on the
+//module, the strapping pins sampled at the release, then the ROM starts
+#define RESET_LOW_US     10000
+#define RESET_RELEASE_US 2000
+#define BOOT_START_US    5000
+
+//bridge config kept in the DataFlash of the bridge (newer firmware only):
+//[0] CONFIG_MAGIC, [1..4] baud rate to flash at, [5..6] reset low, [7..8]
+//reset release and [9..10] boot start time in us (all LSB first), [11..30]
+//label, NUL padded, [31] checksum: all the bytes add up to 0
+#define CONFIG_LEN       32
+#define CONFIG_MAGIC     0xB1
+#define CONFIG_LABEL_LEN 20
+
+//SLIP receive mode: frame record flags
+#define RX_FRAME_ESCAPE    0x01
+#define RX_FRAME_TRUNCATED 0x02
+
+//SET_BAUDR: the bridge only evaluates the rate, see setBridgeBaud()
+#define BAUD_PROBE 0x80000000
+//the most the rate may be off when the other side can not follow it (0.1%)
+#define BAUD_MAX_ERROR 40
+
+//the bridge pads the FLASH_DATA blocks with this byte
+#define FRAME_PADDING 0xFF
+
+//bulk endpoints of the UART data path (newer firmware only)
+#define EP_BULK_OUT 0x02
+#define EP_BULK_IN  0x82
+#define MAX_BULK_PACKET_LEN 64
+
+//write pipeline: the write buffer goes out in chunks (bulk: up to
+//WRITE_CHUNK_BULK bytes, EP0: MAX_PACKET_LEN) with up to 'depth' transfers
+//queued at once, see flushUartPipe()
+#define WRITE_QUEUE_DEFAULT 4
+#define WRITE_QUEUE_MAX     16
+#define WRITE_CHUNK_BULK    (4 * MAX_BULK_PACKET_LEN)
+
+//read ring: the reader thread drains the bridge into it as the data come,
+//readUart() takes them out, see usbReaderThread()
+#define READ_RING_SIZE (64 * 1024) //a power of two
+#define READ_RING_MASK (READ_RING_SIZE - 1)
+#define READER_WAIT_MS 20 //the reader checks for a stop request this often
+
+//interrupt endpoint: UART data ready notification (newer firmware only)
+#define EP_NOTIFY_IN 0x81
+#define MAX_NOTIFY_LEN 8
+
+//UART status flags reported by the bridge
+#define UART_RX_OVERFLOW 0x01
+#define UART_TX_OVERFLOW 0x02
+#define UART_TX_BUSY     0x04
+
+//per unit settings stored on the bridge, see readBridgeConfig()
+typedef struct {
+    uint32_t baudrate; //rate to flash at, 0: not set
+    int resetLowUs;    //reset timing, see bootSequence()
+    int resetReleaseUs;
+    int bootStartUs;
+    char label[CONFIG_LABEL_LEN + 1];
+} bridge_config_t;
+
+//UART state of the bridge, see readUartStatus()
+typedef struct {
+    int rxCount;     //bytes waiting in the read ring
+    int rxOverflows; //received bytes dropped because the read ring was full
+    int txFree;      //free space in the write FIFO, -1 if not reported
+    int flags;       //UART_* flags, -1 if not reported
+    int rx1Overflows; //UART1 bytes dropped, -1 if not reported
+} uart_status_t;
+
+//chunks of the write buffer in flight, the completion callbacks (run by the
+//event thread) queue the next ones. All fields are guarded by 'lock'.
+typedef struct {
+    struct libusb_transfer* xfer[WRITE_QUEUE_MAX];
+    uint8_t setup[WRITE_QUEUE_MAX][LIBUSB_CONTROL_SETUP_SIZE + MAX_PACKET_LEN]; //EP0 transfers
+    int busy[WRITE_QUEUE_MAX];
+    int depth;       //transfers used
+    uint8_t* data;   //the buffer being written
+    int size;
+    int pos;         //next byte to queue
+    int done;        //bytes taken by the bridge
+    int inFlight;
+    int maxInFlight;
+    int status;      //LIBUSB_TRANSFER_COMPLETED or the status of the first failed transfer
+    unsigned int timeout; //ms, of every transfer
+    pthread_mutex_t lock;
+    pthread_cond_t cond; //a transfer completed
+} write_pipe_t;
+
+//one producer (the reader thread) and one consumer (readUart()): each index
+//is written by its owner only, 'readLock' and 'readCond' just wake up the
+//consumer
+typedef struct {
+    uint8_t data[READ_RING_SIZE];
+    uint32_t head;  //written by the reader thread
+    uint32_t tail;  //written by the consumer
+    uint32_t maxFill;
+    int error;      //the reader stopped on this libusb error, 0: none
+    int stop;       //the reader is asked to stop
+    int running;
+    pthread_t thread;
+} read_ring_t;
 
 loader_usb_config_t *cfg;
 static int64_t s_time_end;
 static char verbose = 0; 
 
 static uint8_t outBuf[MAX_PACKET_LEN]; //output (command) buffer
-static uint8_t resBuf[MAX_PACKET_LEN]; //input (response) buffer
+static uint8_t resBuf[MAX_BULK_PACKET_LEN]; //input (response) buffer
 int resBufPos = 0;
 int resBufMax = 0;
+static int useBulk = 0; //UART data are transferred via the bulk endpoints
+//wait on the interrupt endpoint for UART data, cleared by a failed wait
+//(also in the reader thread): accessed atomically once the bridge is open
+static int useNotify = 0;
+static int useReader = 0; //a thread drains the bridge into the read ring
+static int rxOverflowsStart = 0; //bridge overflow counter when the port was opened
+static int useCredits = 0; //write as much as the bridge's write FIFO can take
+static int txCredits = 0; //bytes that can be written without asking the bridge
+static int useBaudReport = 0; //the bridge takes any baud rate and reports the achieved one
+static uint32_t uartBaud = 115200; //current baud rate of the bridge
+static int useFraming = 1; //the bridge can build the FLASH_DATA packets
+static int framing = 0; //the bridge is building the FLASH_DATA packets
+static uint32_t frameSeq; //sequence number of the next block the bridge expects
+static uint32_t frameBlockSize;
+static int useGpioSeq = 1; //the bridge runs timed GPIO sequences
+static int useRxFrames = 1; //the bridge can collect the SLIP frames
+static int useSync = 1; //the bridge can run the SYNC handshake
+static int rxFrames = 0; //the bridge sends [length][flags][payload] records
+static write_pipe_t writePipe;
+static read_ring_t readRing;
+static pthread_mutex_t readLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readCond = PTHREAD_COND_INITIALIZER;
+static pthread_t eventThread;
+static int eventStop = 0;
+//reset timing (us), the bridge config may tune it
+static int resetLowUs = RESET_LOW_US;
+static int resetReleaseUs = RESET_RELEASE_US;
+static int bootStartUs = BOOT_START_US;
 
 uint8_t writeBuf[4* 1024];
 int writeBufPos;
@@ -144,16 +384,256 @@ static int recvControlTransfer(libusb_device_handle *h, uint8_t command, uint16_
     int ret;
     memset(resBuf, 0, sizeof(resBuf));
 
-    ret = libusb_control_transfer(h, TYPE_IN_ITF, command, param1, param2, resBuf, sizeof(resBuf), 80);
+    ret = libusb_control_transfer(h, TYPE_IN_ITF, command, param1, param2, resBuf, MAX_PACKET_LEN, 80);
     if (verbose) {
         info("control transfer (0x%02x) incoming:  result=%i\n", command, ret);
-        dumpBuffer(resBuf, sizeof(resBuf));
+        dumpBuffer(resBuf, MAX_PACKET_LEN);
     }
     return ret;
 }
 
-//try to find the programmer usb device
-static libusb_device_handle* getDeviceHandle(libusb_context* c) {
+//bridge counters, see COMMAND_GET_STATS in the firmware
+typedef struct {
+    uint32_t txBytes;   //UART bytes sent
+    uint32_t rxBytes;   //UART bytes received
+    int rxOverflows;    //received bytes dropped
+    int frameErrors;    //SLIP frames with a bad escape
+    uint32_t requests;  //vendor control requests served
+    int uartIsrMax;     //longest UART interrupt (ticks)
+    int usbIsrMax;      //longest USB interrupt (ticks)
+    int txMaxDepth;     //most bytes held in the write FIFO
+} bridge_stats_t;
+
+//read (and clear) the bridge counters, does not touch resBuf
+static int readBridgeStats(libusb_device_handle *h, bridge_stats_t* stats, int clear) {
+    uint8_t buf[MAX_PACKET_LEN];
+    int ret;
+
+    ret = libusb_control_transfer(h, TYPE_IN_ITF, COMMAND_GET_STATS, clear ? STATS_CLEAR : 0, 0, buf, sizeof(buf), 80);
+    if (ret < 21) {
+        return -1; //older firmware
+    }
+    stats->txBytes = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+    stats->rxBytes = buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((uint32_t)buf[7] << 24);
+    stats->rxOverflows = buf[8] | (buf[9] << 8);
+    stats->frameErrors = buf[10] | (buf[11] << 8);
+    stats->requests = buf[12] | (buf[13] << 8) | (buf[14] << 16) | ((uint32_t)buf[15] << 24);
+    stats->uartIsrMax = buf[16] | (buf[17] << 8);
+    stats->usbIsrMax = buf[18] | (buf[19] << 8);
+    stats->txMaxDepth = buf[20];
+    return 0;
+}
+
+//query the UART state, does not touch the reception buffer (resBuf)
+static int readUartStatus(libusb_device_handle *h, uart_status_t* status) {
+    uint8_t buf[MAX_PACKET_LEN];
+    int ret;
+
+    ret = libusb_control_transfer(h, TYPE_IN_ITF, COMMAND_GET_UART_STATUS, 0, 0, buf, sizeof(buf), 80);
+    if (verbose) {
+        info("uart status result=%i\n", ret);
+    }
+    if (ret < 3) {
+        return -1; //older firmware
+    }
+    status->rxCount = buf[0];
+    status->rxOverflows = buf[1] | (buf[2] << 8);
+    if (ret < 6) {
+        status->txFree = -1;
+        status->flags = -1;
+    } else {
+        status->txFree = buf[3] | (buf[4] << 8);
+        status->flags = buf[5];
+    }
+    status->rx1Overflows = ret < 9 ? -1 : buf[7] | (buf[8] << 8);
+    return 0;
+}
+
+//ask the bridge for a baud rate: switch to it or, with 'probe' set, just
+//evaluate it. Returns 0 and the achieved rate with its error (0.1%) or -1.
+static int setBridgeBaud(libusb_device_handle *h, uint32_t baud, int probe, uint32_t* rate, int* error) {
+    uint8_t buf[MAX_PACKET_LEN];
+    uint32_t req = baud | (probe ? BAUD_PROBE : 0);
+    int ret;
+    int i;
+
+    ret = libusb_control_transfer(h, TYPE_OUT_ITF, COMMAND_SET_BAUDR, req & 0xFFFF, req >> 16, NULL, 0, 80);
+    if (ret != 0) {
+        info("baud rate set failed. result=%i\n", ret);
+        return -1;
+    }
+    //the bridge computes the divisor in its main loop
+    for (i = 0; i < 50; i++) {
+        ret = libusb_control_transfer(h, TYPE_IN_ITF, COMMAND_GET_BAUDR, 0, 0, buf, sizeof(buf), 80);
+        if (ret < 6) {
+            info("baud rate report failed. result=%i\n", ret);
+            return -1;
+        }
+        *rate = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+        *error = (int16_t)(buf[4] | (buf[5] << 8));
+        if (*rate != 0) {
+            return 0;
+        }
+        usleep(1000);
+    }
+    info("baud rate not confirmed\n");
+    return -1;
+}
+
+//the built-in settings, as with no config stored on the bridge
+static void defaultBridgeConfig(bridge_config_t* bc) {
+    memset(bc, 0, sizeof(*bc));
+    bc->resetLowUs = RESET_LOW_US;
+    bc->resetReleaseUs = RESET_RELEASE_US;
+    bc->bootStartUs = BOOT_START_US;
+}
+
+//read the bridge config, does not touch resBuf. Returns 0, 1 if none was
+//stored (the defaults are returned) or -1 if the firmware can not keep one.
+static int readBridgeConfig(libusb_device_handle *h, bridge_config_t* bc) {
+    uint8_t buf[MAX_PACKET_LEN];
+    uint8_t sum = 0;
+    int ret;
+    int i;
+
+    defaultBridgeConfig(bc);
+    ret = libusb_control_transfer(h, TYPE_IN_ITF, COMMAND_GET_CONFIG, 0, 0, buf, sizeof(buf), 80);
+    if (ret < CONFIG_LEN) {
+        return -1; //older firmware or a config being written
+    }
+    for (i = 0; i < CONFIG_LEN; i++) {
+        sum += buf[i];
+    }
+    if (buf[0] != CONFIG_MAGIC || sum != 0) {
+        return 1; //blank DataFlash
+    }
+    bc->baudrate = buf[1] | (buf[2] << 8) | (buf[3] << 16) | ((uint32_t)buf[4] << 24);
+    bc->resetLowUs = buf[5] | (buf[6] << 8);
+    bc->resetReleaseUs = buf[7] | (buf[8] << 8);
+    bc->bootStartUs = buf[9] | (buf[10] << 8);
+    memcpy(bc->label, buf + 11, CONFIG_LABEL_LEN);
+    return 0;
+}
+
+//store the config on the bridge and read it back, returns 0 or -1
+static int writeBridgeConfig(libusb_device_handle *h, const bridge_config_t* bc) {
+    bridge_config_t check;
+    uint8_t sum = 0;
+    int ret;
+    int i;
+
+    memset(outBuf, 0, CONFIG_LEN);
+    outBuf[0] = CONFIG_MAGIC;
+    outBuf[1] = bc->baudrate & 0xFF;
+    outBuf[2] = (bc->baudrate >> 8) & 0xFF;
+    outBuf[3] = (bc->baudrate >> 16) & 0xFF;
+    outBuf[4] = bc->baudrate >> 24;
+    outBuf[5] = bc->resetLowUs & 0xFF;
+    outBuf[6] = bc->resetLowUs >> 8;
+    outBuf[7] = bc->resetReleaseUs & 0xFF;
+    outBuf[8] = bc->resetReleaseUs >> 8;
+    outBuf[9] = bc->bootStartUs & 0xFF;
+    outBuf[10] = bc->bootStartUs >> 8;
+    strncpy((char*) outBuf + 11, bc->label, CONFIG_LABEL_LEN);
+    for (i = 0; i < CONFIG_LEN - 1; i++) {
+        sum += outBuf[i];
+    }
+    outBuf[CONFIG_LEN - 1] = -sum;
+
+    ret = sendControlTransfer(h, COMMAND_SET_CONFIG, 0, 0, CONFIG_LEN);
+    if (ret != CONFIG_LEN) {
+        info("config write failed. result=%i\n", ret);
+        return -1;
+    }
+    //the bridge writes its DataFlash in the main loop and refuses the reads
+    //meanwhile
+    for (i = 0; i < 500; i++) {
+        ret = readBridgeConfig(h, &check);
+        if (ret >= 0) {
+            break;
+        }
+        usleep(1000);
+    }
+    if (ret != 0 || check.baudrate != bc->baudrate || check.resetLowUs != bc->resetLowUs ||
+        check.resetReleaseUs != bc->resetReleaseUs || check.bootStartUs != bc->bootStartUs ||
+        strcmp(check.label, bc->label)) {
+        info("config not stored. result=%i\n", ret);
+        return -1;
+    }
+    return 0;
+}
+
+//the USB serial number of the bridge (its chip ID), "" if it has none
+static void readSerial(libusb_device_handle* h, const struct libusb_device_descriptor* des, char* serial, int size) {
+    serial[0] = 0;
+    if (des->iSerialNumber) {
+        libusb_get_string_descriptor_ascii(h, des->iSerialNumber, (unsigned char*) serial, size);
+        serial[size - 1] = 0;
+    }
+}
+
+//whether the bridge is 'unit': its serial number or the label of its config
+static int isUnit(libusb_device_handle* h, const struct libusb_device_descriptor* des, const char* unit) {
+    char serial[32];
+    bridge_config_t bc;
+
+    readSerial(h, des, serial, sizeof(serial));
+    if (!strcmp(unit, serial)) {
+        return 1;
+    }
+    return readBridgeConfig(h, &bc) == 0 && bc.label[0] && !strcmp(unit, bc.label);
+}
+
+static int64_t timeNowUs(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+//check whether the firmware exposes the endpoint on the first interface
+static int hasEndpoint(libusb_device_handle* h, uint8_t address, uint8_t type) {
+    struct libusb_config_descriptor* conf;
+    const struct libusb_interface_descriptor* itf;
+    int found = 0;
+    int i;
+
+    if (libusb_get_active_config_descriptor(libusb_get_device(h), &conf)) {
+        return 0;
+    }
+    itf = &conf->interface[0].altsetting[0];
+    for (i = 0; i < itf->bNumEndpoints; i++) {
+        const struct libusb_endpoint_descriptor* ep = &itf->endpoint[i];
+        if (ep->bEndpointAddress == address &&
+            (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == type) {
+            found = 1;
+        }
+    }
+    libusb_free_config_descriptor(conf);
+    return found;
+}
+
+//block until the firmware reports UART data or the timeout (ms) expires,
+//returns the time spent waiting in micro-seconds
+static int waitForRxData(libusb_device_handle* h, int timeout) {
+    uint8_t buf[MAX_NOTIFY_LEN];
+    int64_t start = timeNowUs();
+    int got = 0;
+    int ret;
+
+    ret = libusb_interrupt_transfer(h, EP_NOTIFY_IN, buf, sizeof(buf), &got, timeout > 0 ? timeout : 1);
+    if (ret < 0 && ret != LIBUSB_ERROR_TIMEOUT) {
+        info("wait for uart data failed. result=%i\n", ret);
+        __atomic_store_n(&useNotify, 0, __ATOMIC_RELAXED); //back to polling
+    }
+    if (verbose && got > 0) {
+        info("uart data ready: %i bytes, flags=0x%02x\n", buf[0], got > 1 ? buf[1] : 0);
+    }
+    return (int) (timeNowUs() - start);
+}
+
+//try to find the programmer usb device, the first one or 'unit' (serial
+//number or config label)
+static libusb_device_handle* getDeviceHandle(libusb_context* c, const char* unit) {
     int max;
     int ret;
     int device_index = -1;
@@ -192,6 +672,16 @@ static libusb_device_handle* getDeviceHandle(libusb_context* c) {
             libusb_get_string_descriptor_ascii(handle, des.iProduct, productName, sizeof(productName));
             productName[sizeof(productName) - 1] = 0;
 
+            //ensure the vendor name and product name matches
+            if (
+                device_index == -1 &&
+                strcmp(VENDOR_NAME, vendorName) == 0 &&
+                strcmp(PRODUCT_NAME, productName) == 0 &&
+                (unit == NULL || isUnit(handle, &des, unit))
+            ) {
+                device_index = i;
+            }
+
             libusb_close(handle);
 
             if (verbose) {
@@ -202,20 +692,14 @@ static libusb_device_handle* getDeviceHandle(libusb_context* c) {
                         vendorName, productName
                 );
             }
-            
-            //ensure the vendor name and product name matches
-            if (
-                device_index == -1 &&
-                strcmp(VENDOR_NAME, vendorName) == 0 &&
-                strcmp(PRODUCT_NAME, productName) == 0
-            ) {
-                device_index = i;
-            }
         }
     }
 
     if (device_index < 0) {
         libusb_free_device_list(dev_list, 1);
+        if (unit != NULL) {
+            fatal("bridge '%s' not found\n", unit);
+        }
         fatal("no device found\n");
     }
 
@@ -265,7 +749,7 @@ static int usbOpen (loader_usb_config_t *config)
 #endif
     
        //get the handle of the connected USB device
-    cfg->h = getDeviceHandle(cfg->c);
+    cfg->h = getDeviceHandle(cfg->c, cfg->unit);
 
     //try to detach existing kernel driver if kernel is already handling 
     //the device
@@ -304,6 +788,21 @@ static int usbOpen (loader_usb_config_t *config)
         fatal("alt setting failed\n");
     }
 
+    //use the bulk endpoints if the firmware has them, otherwise stay with EP0
+    useBulk = 0;
+    if (!cfg->controlOnly &&
+        hasEndpoint(cfg->h, EP_BULK_OUT, LIBUSB_TRANSFER_TYPE_BULK) &&
+        hasEndpoint(cfg->h, EP_BULK_IN, LIBUSB_TRANSFER_TYPE_BULK)) {
+        useBulk = sendControlTransfer(cfg->h, COMMAND_SET_BULK, 1, 0, 0) == 0;
+    }
+    //EP0 reads wait for the data ready notification instead of polling
+    useNotify = !useBulk && hasEndpoint(cfg->h, EP_NOTIFY_IN, LIBUSB_TRANSFER_TYPE_INTERRUPT);
+    //the bridge holds off the host while it has nothing to send
+    useReader = useBulk || useNotify;
+    if (verbose) {
+        info("uart data path: %s%s\n", useBulk ? "bulk" : "control",
+                useNotify ? " + notification" : "");
+    }
     
     usleep (10000) ;  // 10mS
 
@@ -314,13 +813,47 @@ static int usbOpen (loader_usb_config_t *config)
 esp_loader_error_t loader_port_usb_init(loader_usb_config_t *config)
 {
 	int i;
+	uart_status_t status;
+	bridge_config_t bridgeConfig;
     int ret = usbOpen(config);
     if (ret < 0) {
         printf("Usb device could not be opened!\n");
         return ESP_LOADER_ERROR_FAIL;
     }
 
+	//the settings tuned for this unit
+	config->preferredBaud = 0;
+	if (readBridgeConfig(cfg->h, &bridgeConfig) == 0) {
+		config->preferredBaud = bridgeConfig.baudrate;
+		resetLowUs = bridgeConfig.resetLowUs;
+		resetReleaseUs = bridgeConfig.resetReleaseUs;
+		bootStartUs = bridgeConfig.bootStartUs;
+		if (verbose) {
+			info("bridge config '%s': baud %u, reset %i/%i/%i us\n", bridgeConfig.label,
+				bridgeConfig.baudrate, resetLowUs, resetReleaseUs, bootStartUs);
+		}
+	}
+
 	//loader_port_change_baudrate(74880);
+	useCredits = 0;
+	if (readUartStatus(cfg->h, &status) == 0) {
+		rxOverflowsStart = status.rxOverflows;
+		if (status.txFree >= 0) {
+			useCredits = 1;
+			txCredits = status.txFree;
+		}
+	}
+	if (verbose) {
+		info("write credits: %s\n", useCredits ? "yes" : "no");
+	}
+
+	//newer firmware: any rate, start from the configured one as the bridge
+	//keeps the rate of the previous session
+	ret = recvControlTransfer(cfg->h, COMMAND_GET_BAUDR, 0, 0);
+	useBaudReport = ret >= 6;
+	if (useBaudReport && config->baudrate) {
+		loader_port_change_baudrate(config->baudrate);
+	}
 	writeBufPos = 0;
 	readDelay = 0;
 
@@ -331,6 +864,10 @@ esp_loader_error_t loader_port_usb_init(loader_usb_config_t *config)
 	for (i = 1; i < 33; i++) {
 		writeStat[i] = 0;
 	}
+	if (config->stats) {
+		bridge_stats_t stats;
+		readBridgeStats(cfg->h, &stats, 1);
+	}
 
 
 
@@ -375,6 +912,33 @@ static int waitForFinish(libusb_device_handle* h, int initialDelay, int step, in
     return 0; //time expired
 }
 
+//wait until the bridge's write FIFO can take 'size' bytes
+//returns the remaining timeout (us), 0 on time out, -1 on error
+static int waitForCredits(libusb_device_handle* h, int size, int timeout)
+{
+    uart_status_t status;
+
+    while (txCredits < size) {
+        if (readUartStatus(h, &status) < 0) {
+            return -1;
+        }
+        if (status.flags & UART_TX_OVERFLOW) {
+            info("bridge write buffer overflow\n");
+        }
+        txCredits = status.txFree;
+        if (txCredits >= size) {
+            break;
+        }
+        timeout -= 500;
+        if (timeout <= 0) {
+            return 0;
+        }
+        //256 bytes take at least 2.2ms to leave at 115200 bauds
+        usleep(500);
+    }
+    return timeout;
+}
+
 static int writeUart(const uint8_t* data, int size, int timeout)
 {
     int result = size;
@@ -395,6 +959,207 @@ static int writeUart(const uint8_t* data, int size, int timeout)
 
 }
 
+//runs the completion callbacks of the write pipeline
+static void* usbEventThread(void* arg)
+{
+    (void) arg;
+    while (!eventStop) {
+        struct timeval tv = { 0, 100000 };
+        libusb_handle_events_timeout_completed(cfg->c, &tv, &eventStop);
+    }
+    return NULL;
+}
+
+//allocate the write transfers and start the event thread
+static void startWritePipe(int depth)
+{
+    write_pipe_t* p = &writePipe;
+    int i;
+
+    if (depth <= 0) {
+        depth = WRITE_QUEUE_DEFAULT;
+    }
+    p->depth = MIN(depth, WRITE_QUEUE_MAX);
+    for (i = 0; i < p->depth; i++) {
+        p->xfer[i] = libusb_alloc_transfer(0);
+        if (p->xfer[i] == NULL) {
+            fatal("can not allocate the usb transfers\n");
+        }
+        p->busy[i] = 0;
+    }
+    p->inFlight = 0;
+    p->maxInFlight = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&eventThread, NULL, usbEventThread, NULL) != 0) {
+        fatal("can not start the usb event thread\n");
+    }
+}
+
+static void LIBUSB_CALL writeDone(struct libusb_transfer* t);
+
+//queue the next chunk on transfer 'i', called with the lock held. Returns 0
+//if there is nothing to queue, no credits for it or the submit failed.
+static int queueChunk(write_pipe_t* p, int i)
+{
+    struct libusb_transfer* t = p->xfer[i];
+    int blk = p->size - p->pos;
+
+    if (blk <= 0 || p->status != LIBUSB_TRANSFER_COMPLETED) {
+        return 0;
+    }
+    if (useBulk) {
+        //the firmware holds off the host (NAK) while its buffers are full
+        blk = MIN(blk, WRITE_CHUNK_BULK);
+        libusb_fill_bulk_transfer(t, cfg->h, EP_BULK_OUT, p->data + p->pos, blk, writeDone, p, p->timeout);
+    } else {
+        //the bridge's write FIFO has to take the whole chunk
+        blk = MIN(blk, MAX_PACKET_LEN);
+        if (txCredits < blk) {
+            return 0;
+        }
+        libusb_fill_control_setup(p->setup[i], TYPE_OUT_ITF, COMMAND_WRITE_UART, 0, 0, blk);
+        memcpy(p->setup[i] + LIBUSB_CONTROL_SETUP_SIZE, p->data + p->pos, blk);
+        libusb_fill_control_transfer(t, cfg->h, p->setup[i], writeDone, p, p->timeout);
+        txCredits -= blk;
+    }
+    if (libusb_submit_transfer(t) < 0) {
+        info("write submit failed\n");
+        if (!useBulk) {
+            txCredits += blk;
+        }
+        p->status = LIBUSB_TRANSFER_ERROR;
+        return 0;
+    }
+    p->pos += blk;
+    p->busy[i] = 1;
+    p->inFlight++;
+    p->maxInFlight = MAX(p->maxInFlight, p->inFlight);
+    return 1;
+}
+
+//a chunk is through: count it and queue the next one on the same transfer
+static void LIBUSB_CALL writeDone(struct libusb_transfer* t)
+{
+    write_pipe_t* p = t->user_data;
+    int done = t->actual_length;
+    int i;
+
+    pthread_mutex_lock(&p->lock);
+    for (i = 0; p->xfer[i] != t; i++);
+    p->busy[i] = 0;
+    p->inFlight--;
+    if (verbose) {
+        info("Write chunk status=%i (%i / %i)\n", t->status, done,
+            useBulk ? t->length : t->length - LIBUSB_CONTROL_SETUP_SIZE);
+    }
+    if (done > 0) {
+        p->done += done;
+        writeStatCnt++;
+        writeStatTotal += done;
+        writeStatMin = MIN(writeStatMin, done);
+        writeStatMax = MAX(writeStatMax, done);
+        if (done <= MAX_PACKET_LEN) {
+            writeStat[done]++;
+        }
+    }
+    if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+        if (p->status == LIBUSB_TRANSFER_COMPLETED) {
+            p->status = t->status;
+        }
+    } else
+    if (!useBulk && done != t->length - LIBUSB_CONTROL_SETUP_SIZE) {
+        info("incorrect bytes written\n");
+    }
+    queueChunk(p, i);
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+//wait on 'cond' until 'end' (us, see timeNowUs()), returns 0 on time out
+static int waitUntil(pthread_cond_t* cond, pthread_mutex_t* lock, int64_t end)
+{
+    struct timespec t;
+    int64_t left = end - timeNowUs();
+
+    if (left <= 0) {
+        return 0;
+    }
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_sec += left / 1000000;
+    t.tv_nsec += (left % 1000000) * 1000;
+    if (t.tv_nsec >= 1000000000L) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000L;
+    }
+    return pthread_cond_timedwait(cond, lock, &t) != ETIMEDOUT;
+}
+
+//write 'data' through the pipeline: the queue is filled, then the
+//completions keep it full. On EP0 only as much is queued as the bridge's
+//write FIFO can take, when the credits run out the writer waits for them.
+//Returns 'size', 0 on time out or -1 on error
+static int flushUartPipe(uint8_t* data, int size, int timeout)
+{
+    write_pipe_t* p = &writePipe;
+    int64_t end = timeNowUs() + (int64_t) timeout * 1000;
+    int cancelled = 0;
+    int result = size;
+    int i;
+
+    if (!p->depth) {
+        startWritePipe(cfg->writeQueue);
+    }
+    pthread_mutex_lock(&p->lock);
+    p->data = data;
+    p->size = size;
+    p->pos = 0;
+    p->done = 0;
+    p->status = LIBUSB_TRANSFER_COMPLETED;
+    p->timeout = timeout;
+    while (p->done < p->size && p->status == LIBUSB_TRANSFER_COMPLETED) {
+        for (i = 0; i < p->depth; i++) {
+            if (!p->busy[i] && !queueChunk(p, i)) {
+                break;
+            }
+        }
+        while (p->inFlight > 0) {
+            if (!waitUntil(&p->cond, &p->lock, cancelled ? end + 1000000 : end) && !cancelled) {
+                //time out: take back what is still queued
+                for (i = 0; i < p->depth; i++) {
+                    if (p->busy[i]) {
+                        libusb_cancel_transfer(p->xfer[i]);
+                    }
+                }
+                p->status = LIBUSB_TRANSFER_TIMED_OUT;
+                cancelled = 1;
+            }
+        }
+        if (p->done < p->size && p->status == LIBUSB_TRANSFER_COMPLETED) {
+            //nothing in flight and more to write: the bridge is out of credits
+            int remaining = (int)(end - timeNowUs());
+            int ret;
+
+            pthread_mutex_unlock(&p->lock);
+            ret = waitForCredits(cfg->h, MIN(p->size - p->pos, MAX_PACKET_LEN), remaining);
+            pthread_mutex_lock(&p->lock);
+            if (ret <= 0) {
+                p->status = ret < 0 ? LIBUSB_TRANSFER_ERROR : LIBUSB_TRANSFER_TIMED_OUT;
+            }
+        }
+    }
+    if (p->status == LIBUSB_TRANSFER_TIMED_OUT) {
+        printf("\nwrite: time out 0\n");
+        result = 0;
+    } else
+    if (p->status != LIBUSB_TRANSFER_COMPLETED) {
+        info("write failed. status=%i\n", p->status);
+        result = -1;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return result;
+}
+
 static int flushUart(int timeout)
 {
     int result;
@@ -412,15 +1177,26 @@ static int flushUart(int timeout)
     writeBufPos = 0;
 	result = size;
 	
+	if (useBulk) {
+		return flushUartPipe(writeBuf, size, timeout / 1000);
+	}
+
 	readDelay = 1; //after flushing comes a read
 
+	//newer firmware: as much in flight as the write FIFO can take
+	if (useCredits) {
+		return flushUartPipe(writeBuf, size, timeout / 1000);
+	}
+
+	//older firmware: a chunk at a time, each one written out before the next
+
 	//printf("* Write flush: size=%i \n", size);
     while (size > 0 && timeout > 0) {
     	    	
         //dumpBuffer(outBuf, size);
         blk = size > MAX_PACKET_LEN ? MAX_PACKET_LEN: size;
         memcpy(outBuf, writeBuf + pos, blk);
-        
+
         int ret = sendControlTransfer(h, COMMAND_WRITE_UART, 0, 0 , blk);
         if (verbose) {
         	info("Write chunk result=%i (%s) %i \n", ret, ret == blk ? "OK" : "Failed", pos);
@@ -448,7 +1224,6 @@ static int flushUart(int timeout)
 		}
 		timeout -= 100;
 
-		
 		//check previous write operation has finished
     	ret = waitForFinish(h, 2000, 1000, 0, timeout);
         if (ret < 0) {
@@ -471,6 +1246,130 @@ static int flushUart(int timeout)
     return result;    
 }
 
+//drains the bridge into the read ring until asked to stop: bulk IN packets
+//or EP0 reads woken up by the data ready notification. When the ring is
+//full the bridge holds the data.
+static void* usbReaderThread(void* arg)
+{
+    read_ring_t* r = &readRing;
+    uint8_t buf[MAX_BULK_PACKET_LEN];
+
+    (void) arg;
+    while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+        uint32_t head = r->head;
+        uint32_t fill = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        int got = 0;
+        int ret;
+        int i;
+
+        if (READ_RING_SIZE - fill < sizeof(buf)) {
+            usleep(1000);
+            continue;
+        }
+        if (useBulk) {
+            ret = libusb_bulk_transfer(cfg->h, EP_BULK_IN, buf, sizeof(buf), &got, READER_WAIT_MS);
+        } else {
+            ret = libusb_control_transfer(cfg->h, TYPE_IN_ITF, COMMAND_READ_UART, 0, 0, buf, MAX_PACKET_LEN, 80);
+            if (ret == 0) {
+                if (__atomic_load_n(&useNotify, __ATOMIC_RELAXED)) {
+                    waitForRxData(cfg->h, READER_WAIT_MS);
+                } else {
+                    usleep(1000);
+                }
+            }
+            got = ret > 0 ? ret : 0;
+        }
+        if (ret < 0 && ret != LIBUSB_ERROR_TIMEOUT) {
+            info("read uart failed. result=%i\n", ret);
+            r->error = ret;
+            break;
+        }
+        if (got == 0) {
+            continue;
+        }
+        for (i = 0; i < got; i++) {
+            r->data[(head + i) & READ_RING_MASK] = buf[i];
+        }
+        __atomic_store_n(&r->head, head + got, __ATOMIC_RELEASE);
+        r->maxFill = MAX(r->maxFill, fill + got);
+
+        pthread_mutex_lock(&readLock);
+        pthread_cond_signal(&readCond);
+        pthread_mutex_unlock(&readLock);
+    }
+    pthread_mutex_lock(&readLock);
+    pthread_cond_signal(&readCond);
+    pthread_mutex_unlock(&readLock);
+    return NULL;
+}
+
+static void startReader(void)
+{
+    read_ring_t* r = &readRing;
+
+    if (r->running) {
+        return;
+    }
+    r->stop = 0;
+    r->error = 0;
+    if (pthread_create(&r->thread, NULL, usbReaderThread, NULL) != 0) {
+        fatal("can not start the usb reader thread\n");
+    }
+    r->running = 1;
+}
+
+//stop the reader before reading the bridge otherwise, the data in the ring
+//are kept
+static void stopReader(void)
+{
+    read_ring_t* r = &readRing;
+
+    if (!r->running) {
+        return;
+    }
+    __atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(r->thread, NULL);
+    r->running = 0;
+}
+
+//take 'size' bytes from the read ring, waiting for them up to 'duration' ms
+static int readUartRing(uint8_t *data, int size, int duration) {
+    read_ring_t* r = &readRing;
+    int64_t end = timeNowUs() + (int64_t) duration * 1000;
+    int dataPos = 0;
+
+    startReader();
+    for (;;) {
+        uint32_t tail = r->tail;
+        uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        int n = MIN((int)(head - tail), size - dataPos);
+        int i;
+
+        for (i = 0; i < n; i++) {
+            data[dataPos + i] = r->data[(tail + i) & READ_RING_MASK];
+        }
+        __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+        dataPos += n;
+        if (dataPos == size) {
+            return 0;
+        }
+        if (r->error) {
+            return 2; //the reader has stopped
+        }
+
+        //the reader signals with the lock held after moving the head
+        pthread_mutex_lock(&readLock);
+        while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == head && !r->error) {
+            if (!waitUntil(&readCond, &readLock, end)) {
+                pthread_mutex_unlock(&readLock);
+                printf("\nread: time out 0\n");
+                return 2; //timeout
+            }
+        }
+        pthread_mutex_unlock(&readLock);
+    }
+}
+
 //duration in milli-seconds
 static int readUart(uint8_t *data, int size, int duration) {
 	int total = 0;
@@ -480,6 +1379,11 @@ static int readUart(uint8_t *data, int size, int duration) {
 	libusb_device_handle* h = cfg->h;
 	int dataPos = 0;
 	
+	//newer firmware: the reader thread keeps draining the bridge
+	if (useReader) {
+		return readUartRing(data, size, duration);
+	}
+
 	duration *=  1000;
 
 	if (readDelay) {
@@ -509,7 +1413,6 @@ static int readUart(uint8_t *data, int size, int duration) {
         	return 0; //timeout
         }
         if (ret > 0) {
-        	int i;
         	resBufPos = 0;
         	resBufMax = ret;
         	
@@ -553,54 +1456,285 @@ static int readUart(uint8_t *data, int size, int duration) {
 }
 
 
-esp_loader_error_t loader_port_serial_write(const uint8_t *data, uint16_t size, uint32_t timeout)
-{
-    serial_debug_print(data, size, true);
+//take the UART bytes already received, up to 'size', without waiting.
+//Returns their count or -1 if the bridge can not be read.
+static int readUartAvail(uint8_t *data, int size) {
+    int n = 0;
+    int i;
 
-    int written = writeUart(data, size, timeout);
+    if (useReader) {
+        read_ring_t* r = &readRing;
+        uint32_t tail = r->tail;
 
-    if (written < 0) {
-        return ESP_LOADER_ERROR_FAIL;
-    } else if (written < size) {
-        return ESP_LOADER_ERROR_TIMEOUT;
-    } else {
-        return ESP_LOADER_SUCCESS;
+        startReader();
+        n = MIN((int)(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail), size);
+        for (i = 0; i < n; i++) {
+            data[i] = r->data[(tail + i) & READ_RING_MASK];
+        }
+        __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+        return (n == 0 && r->error) ? -1 : n;
+    }
+
+    if (resBufPos == resBufMax) {
+        int ret = recvControlTransfer(cfg->h, COMMAND_READ_UART, 0, 0);
+        if (ret < 0) {
+            info("read uart failed. result=%i\n", ret);
+            return -1;
+        }
+        resBufPos = 0;
+        resBufMax = ret;
     }
+    while (resBufPos < resBufMax && n < size) {
+        data[n++] = resBuf[resBufPos++];
+    }
+    return n;
 }
 
-esp_loader_error_t loader_port_write_flush(void)
+//set the receive mode of the bridge (raw bytes or whole SLIP frames) and
+//drop the data received so far: on the bridge, in an armed bulk IN packet
+//and here. Returns the result of COMMAND_SET_RX_FRAMES.
+static int resetRx(int frames)
 {
-    //serial_debug_print(data, size, true);
-
-    int written = flushUart(5000);
+    uint8_t buf[MAX_BULK_PACKET_LEN];
+    int got;
+    int ret;
 
-    if (written < 0) {
-        return ESP_LOADER_ERROR_FAIL;
-    } else if (written == 0) {
-        return ESP_LOADER_ERROR_TIMEOUT;
-    } else {
-        return ESP_LOADER_SUCCESS;
+    stopReader();
+    ret = sendControlTransfer(cfg->h, COMMAND_SET_RX_FRAMES, frames, 0, 0);
+    if (ret != 0) {
+        return ret;
+    }
+    while (useBulk && libusb_bulk_transfer(cfg->h, EP_BULK_IN, buf, sizeof(buf), &got, 5) == 0 && got > 0) {
     }
+    resBufPos = 0;
+    resBufMax = 0;
+    readRing.tail = readRing.head;
+    return 0;
 }
 
-esp_loader_error_t loader_port_serial_read(uint8_t *data, uint16_t size, uint32_t timeout)
+//switch the bridge between raw bytes and whole SLIP frames, the data already
+//received are dropped
+static void setRxFrames(int on)
 {
-    RETURN_ON_ERROR( readUart(data, size, timeout) );
+    int ret;
 
-    serial_debug_print(data, size, false);
+    if (on == rxFrames || (on && !useRxFrames)) {
+        return;
+    }
+    ret = resetRx(on);
+    if (ret != 0) {
+        //older firmware
+        if (verbose) {
+            info("bridge does not collect SLIP frames. result=%i\n", ret);
+        }
+        useRxFrames = 0;
+        return;
+    }
+    rxFrames = on;
+}
+
+esp_loader_error_t loader_port_read_frame(uint8_t *data, uint32_t *size, uint32_t timeout)
+{
+    uint8_t hdr[2];
+    uint8_t skip[256];
+    uint32_t len;
 
+    if (!rxFrames) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+    //the whole record normally comes in one USB read
+    RETURN_ON_ERROR( readUart(hdr, sizeof(hdr), timeout) );
+    len = hdr[0] < *size ? hdr[0] : *size;
+    RETURN_ON_ERROR( readUart(data, len, timeout) );
+    if (hdr[0] > len) {
+        RETURN_ON_ERROR( readUart(skip, hdr[0] - len, timeout) );
+    }
+    serial_debug_print(data, len, false);
+    *size = hdr[0];
+    if (hdr[1]) {
+        info("damaged frame: %s\n", (hdr[1] & RX_FRAME_TRUNCATED) ? "too long" : "bad escape");
+        return ESP_LOADER_ERROR_INVALID_RESPONSE;
+    }
     return ESP_LOADER_SUCCESS;
 }
 
+//hand the UART write path back from the FLASH_DATA framer
+static void stopFraming(void)
+{
+    int ret;
+
+    if (!framing) {
+        return;
+    }
+    framing = 0;
+    ret = sendControlTransfer(cfg->h, COMMAND_FLASH_FRAME, 0, 0, 0);
+    if (ret != 0) {
+        info("framing stop failed. result=%i\n", ret);
+    }
+}
+
+//the bridge frames the block: only a 3 byte prefix and the image bytes up to
+//the padding are sent over USB instead of the escaped packet
+esp_loader_error_t loader_port_flash_data(const uint8_t *data, uint32_t size, uint32_t sequence, uint8_t checksum)
+{
+    uint8_t prefix[3];
+    uint32_t len = size;
+    int ret;
+
+    if (!useFraming || size > 0xFFFF) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+    if (!framing || sequence != frameSeq || size != frameBlockSize) {
+        //begin descriptor: first sequence number, block size, padding
+        outBuf[0] = sequence & 0xFF;
+        outBuf[1] = (sequence >> 8) & 0xFF;
+        outBuf[2] = (sequence >> 16) & 0xFF;
+        outBuf[3] = sequence >> 24;
+        outBuf[4] = size & 0xFF;
+        outBuf[5] = size >> 8;
+        outBuf[6] = FRAME_PADDING;
+        ret = sendControlTransfer(cfg->h, COMMAND_FLASH_FRAME, 0, 0, 7);
+        if (ret != 7) {
+            //older firmware
+            info("bridge does not frame the flash data. result=%i\n", ret);
+            useFraming = 0;
+            return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+        }
+        framing = 1;
+        frameSeq = sequence;
+        frameBlockSize = size;
+    }
+
+    while (len > 0 && data[len - 1] == FRAME_PADDING) {
+        len--;
+    }
+    prefix[0] = checksum;
+    prefix[1] = len & 0xFF;
+    prefix[2] = len >> 8;
+    serial_debug_print(prefix, sizeof(prefix), true);
+    serial_debug_print(data, len, true);
+    writeUart(prefix, sizeof(prefix), 0);
+    writeUart(data, len, 0);
+    frameSeq++;
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t loader_port_serial_write(const uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    stopFraming();
+    serial_debug_print(data, size, true);
+
+    int written = writeUart(data, size, timeout);
+
+    if (written < 0) {
+        return ESP_LOADER_ERROR_FAIL;
+    } else if (written < size) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    } else {
+        return ESP_LOADER_SUCCESS;
+    }
+}
+
+esp_loader_error_t loader_port_write_flush(void)
+{
+    //serial_debug_print(data, size, true);
+
+    int written = flushUart(5000);
+
+    if (written < 0) {
+        return ESP_LOADER_ERROR_FAIL;
+    } else if (written == 0) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    } else {
+        return ESP_LOADER_SUCCESS;
+    }
+}
+
+esp_loader_error_t loader_port_serial_read(uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    RETURN_ON_ERROR( readUart(data, size, timeout) );
+
+    serial_debug_print(data, size, false);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+//append a step, delays longer than a step can hold are split
+static int addGpioStep(uint8_t* seq, int len, uint8_t pins, uint32_t delayUs)
+{
+    do {
+        uint16_t d = delayUs > 0xFFFF ? 0xFFFF : delayUs;
+        if (len + GPIO_SEQ_STEP > GPIO_SEQ_MAX * GPIO_SEQ_STEP) {
+            break;
+        }
+        seq[len++] = pins;
+        seq[len++] = d & 0xFF;
+        seq[len++] = d >> 8;
+        delayUs -= d;
+    } while (delayUs);
+    return len;
+}
+
+//let the bridge set the pins with its own timing, returns -1 if it can not
+static int runGpioSequence(libusb_device_handle* h, const uint8_t* seq, int len)
+{
+    int ret;
+    int i;
+
+    if (!useGpioSeq) {
+        return -1;
+    }
+    memcpy(outBuf, seq, len);
+    ret = sendControlTransfer(h, COMMAND_SET_GPIO_SEQ, 0, 0, len);
+    if (ret != len) {
+        //older firmware
+        useGpioSeq = 0;
+        return -1;
+    }
+    //wait until the last step is done
+    for (i = 0; i < 2000; i++) {
+        ret = recvControlTransfer(h, COMMAND_GET_GPIO_SEQ, 0, 0);
+        if (ret == 1 && resBuf[0] == 0) {
+            return 0;
+        }
+        usleep(500);
+    }
+    info("GPIO sequence did not finish\n");
+    return 0;
+}
+
+//steps resetting the target into the ROM loader, returns the length
+static int bootSequence(uint8_t* seq)
+{
+    int len;
+
+    //boot pin low while the chip comes out of reset
+    len = addGpioStep(seq, 0, 0, resetLowUs);
+    len = addGpioStep(seq, len, GPIO_RESET, resetReleaseUs);
+    return addGpioStep(seq, len, GPIO_RESET | GPIO_ENABLE, bootStartUs);
+}
 
 // Set GPIO0 LOW, then assert reset pin for 50 milliseconds.
 void loader_port_enter_bootloader(void)
 {   
     libusb_device_handle* h = cfg->h;
+    uint8_t seq[GPIO_SEQ_MAX * GPIO_SEQ_STEP];
+    int len;
 
     int ret;
 
+    stopFraming();
+    //the boot messages are filtered out on the bridge
+    setRxFrames(1);
+
     printf("enter bootloader\n");
+
+    len = bootSequence(seq);
+    if (runGpioSequence(h, seq, len) == 0) {
+        return;
+    }
+
     //      bits: 0         1         2
     // 1 => Boot: 0, Reset: 0, Enable:0 
     ret = sendControlTransfer(h, COMMAND_SET_GPIO, 0, 0, 0);
@@ -619,7 +1753,56 @@ void loader_port_enter_bootloader(void)
     loader_port_delay_ms(4);
 }
 
+esp_loader_error_t loader_port_sync(uint32_t timeout, uint32_t trials)
+{
+    libusb_device_handle* h = cfg->h;
+    int len;
+    int ret;
+    int64_t end;
+
+    if (!useSync) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+    if (trials > 0xFF) {
+        trials = 0xFF;
+    }
+    if (timeout > 0xFFFF) {
+        timeout = 0xFFFF;
+    }
+
+    stopFraming();
+    //the boot messages are filtered out on the bridge
+    setRxFrames(1);
+
+    printf("enter bootloader\n");
+
+    //the bridge resets the target and sends the SYNC requests on its own
+    len = bootSequence(outBuf);
+    ret = sendControlTransfer(h, COMMAND_SYNC, trials, timeout, len);
+    if (ret != len) {
+        //older firmware
+        useSync = 0;
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    //the reset, all the tries and some slack
+    end = timeNowUs() + resetLowUs + resetReleaseUs + bootStartUs +
+        (int64_t)(trials * timeout + 500) * 1000;
+    do {
+        usleep(1000);
+        ret = recvControlTransfer(h, COMMAND_GET_SYNC, 0, 0);
+    } while (ret == 4 && resBuf[0] == SYNC_BUSY && timeNowUs() < end);
+
+    if (ret != 4 || resBuf[0] != SYNC_DONE) {
+        info("no SYNC reply (tries: %i)\n", ret == 4 ? resBuf[1] : 0);
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+    printf("synced after %i tries, %i ms\n", resBuf[1], resBuf[2] | (resBuf[3] << 8));
+    return ESP_LOADER_SUCCESS;
+}
+
 static void printStats(void) {
+	bridge_stats_t stats;
 	int i;
 	if (writeStatCnt == 0) {
 		writeStatCnt = 1;
@@ -630,15 +1813,53 @@ static void printStats(void) {
 	for (i = 1; i < 33; i++) {
 		printf(" * %i : %i\n", i, writeStat[i]);
 	}
+	if (writePipe.depth) {
+		printf("Write queue: depth=%i max in flight=%i\n", writePipe.depth, writePipe.maxInFlight);
+	}
+	if (useReader) {
+		printf("Read ring: max fill=%u bytes\n", readRing.maxFill);
+	}
 
+	if (readBridgeStats(cfg->h, &stats, 0) == 0) {
+		printf("Bridge stats: uart tx=%u rx=%u dropped=%i bad frames=%i requests=%u\n",
+			stats.txBytes, stats.rxBytes, (stats.rxOverflows - rxOverflowsStart) & 0xFFFF,
+			stats.frameErrors, stats.requests
+		);
+		printf(" uart isr max=%ius usb isr max=%ius tx fifo max=%i\n",
+			stats.uartIsrMax * BRIDGE_TICK_NS / 1000, stats.usbIsrMax * BRIDGE_TICK_NS / 1000,
+			stats.txMaxDepth
+		);
+	}
 }
 
 void loader_port_reset_target(void)
 {
     libusb_device_handle* h = cfg->h;
+    uart_status_t status;
+    uint8_t seq[GPIO_SEQ_MAX * GPIO_SEQ_STEP];
+    int len;
     int ret;
-    
+
+    stopFraming();
+    setRxFrames(0);
+    if (cfg->stats) {
+        printStats();
+    }
+    if (readUartStatus(h, &status) == 0) {
+        int dropped = (status.rxOverflows - rxOverflowsStart) & 0xFFFF;
+        if (dropped) {
+            printf("warning: the bridge dropped %i received bytes\n", dropped);
+        }
+    }
+
     printf("reset target\n");
+
+    len = addGpioStep(seq, 0, 0, resetLowUs);
+    len = addGpioStep(seq, len, GPIO_BOOT | GPIO_RESET, resetReleaseUs);
+    len = addGpioStep(seq, len, GPIO_BOOT | GPIO_RESET | GPIO_ENABLE, 0);
+    if (runGpioSequence(h, seq, len) == 0) {
+        return;
+    }
     
     //      bits: 0        1         2
     // 0 => Boot:0, Reset: 0, Enable:0 
@@ -654,11 +1875,1153 @@ void loader_port_reset_target(void)
     if (ret != 0) {
         info("GPIO set failed. result=%i\n", ret); 
     }
-    
-    //printStats();
 }
 
 
+//fetch the line times the bridge holds (up to BOOT_TIMES_READ) into 'times'
+//in ms, returns their count or -1 on a failure
+static int readBootTimes(libusb_device_handle* h, double* times, int* lost)
+{
+    uint8_t buf[MAX_PACKET_LEN];
+    int ret;
+    int i;
+
+    ret = libusb_control_transfer(h, TYPE_IN_ITF, COMMAND_GET_BOOT_PROFILE, 0, 0, buf, sizeof(buf), 80);
+    if (ret < 2) {
+        info("boot profile read failed. result=%i\n", ret);
+        return -1;
+    }
+    *lost |= buf[1];
+    for (i = 0; i < buf[0] && i < BOOT_TIMES_READ && 2 + i * 4 + 4 <= ret; i++) {
+        uint8_t* p = buf + 2 + i * 4;
+        uint32_t ticks = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        times[i] = ticks * (BRIDGE_TICK_NS / 1000000.0);
+    }
+    return i;
+}
+
+int loader_port_boot_profile(const char* marker, uint32_t baudrate, uint32_t timeout)
+{
+    libusb_device_handle* h = cfg->h;
+    uint8_t buf[MAX_PACKET_LEN];
+    char line[BOOT_LINE_MAX + 1];
+    double times[BOOT_TIMES_READ];
+    int timeCount = 0;
+    int timeNext = 0;
+    int lineLen = 0;
+    double last = 0;
+    double found = -1;
+    int lost = 0;
+    int64_t end;
+    int len;
+    int ret;
+
+    stopFraming();
+    setRxFrames(0);
+    loader_port_change_baudrate(baudrate);
+
+    //normal boot: the boot pin stays high, the time runs from the release
+    len = addGpioStep(outBuf, 0, GPIO_BOOT, resetLowUs);
+    len = addGpioStep(outBuf, len, GPIO_BOOT | GPIO_RESET | GPIO_ENABLE, 0);
+    ret = sendControlTransfer(h, COMMAND_BOOT_PROFILE, 0, 0, len);
+    if (ret != len) {
+        printf("boot profile: not supported by the bridge firmware\n");
+        return -1;
+    }
+
+    //the log is drained from the release on: the bridge holds only a few
+    //ms of it. Each line end is timed by the bridge before the byte is
+    //passed on, so its time is there by the time the line is complete.
+    printf("    time [ms]     delta | line\n");
+    end = timeNowUs() + (int64_t) timeout * 1000;
+    while (found < 0 && timeNowUs() < end) {
+        int n = readUartAvail(buf, sizeof(buf));
+        int i;
+
+        if (n < 0) {
+            break;
+        }
+        if (n == 0) {
+            usleep(1000);
+            continue;
+        }
+        for (i = 0; i < n && found < 0; i++) {
+            uint8_t c = buf[i];
+
+            if (c == '\r') {
+                continue;
+            }
+            if (c != '\n') {
+                if (lineLen < BOOT_LINE_MAX) {
+                    line[lineLen++] = (c >= ' ' && c < 0x7F) ? c : '.';
+                }
+                continue;
+            }
+            line[lineLen] = 0;
+            lineLen = 0;
+            if (timeNext == timeCount) {
+                timeCount = readBootTimes(h, times, &lost);
+                timeNext = 0;
+                if (timeCount < 0) {
+                    timeCount = 0;
+                    end = 0;
+                    break;
+                }
+            }
+            if (timeNext == timeCount) {
+                printf("%12s %9s | %s\n", "?", "", line); //its time was dropped
+                continue;
+            }
+            printf("%12.3f %+9.3f | %s\n", times[timeNext], times[timeNext] - last, line);
+            last = times[timeNext];
+            if (marker != NULL && strstr(line, marker) != NULL) {
+                found = last;
+            }
+            timeNext++;
+        }
+    }
+    libusb_control_transfer(h, TYPE_IN_ITF, COMMAND_GET_BOOT_PROFILE, BOOT_PROFILE_STOP, 0, buf, sizeof(buf), 80);
+
+    if (lost) {
+        printf("warning: the bridge dropped line times, the log was read too slowly\n");
+    }
+    if (marker != NULL) {
+        if (found < 0) {
+            printf("marker '%s' not found in %u ms\n", marker, timeout);
+            return 1;
+        }
+        printf("marker '%s' at %.3f ms\n", marker, found);
+    }
+    return 0;
+}
+
+//print the boot log bytes, the unprintable ones as hex
+static void printBootLog(const uint8_t* data, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        uint8_t c = data[i];
+        if (c == '\n' || c == '\r' || (c >= ' ' && c < 0x7F)) {
+            putchar(c);
+        } else {
+            printf("\\x%02x", c);
+        }
+    }
+}
+
+int loader_port_boot_log(void)
+{
+    libusb_device_handle* h = cfg->h;
+    uint8_t hdr[MAX_PACKET_LEN];
+    uint8_t data[256];
+    uint32_t rate[2];
+    int len = 0;
+    int change;
+    int ret;
+
+    ret = libusb_control_transfer(h, TYPE_IN_ITF, COMMAND_GET_BOOT_LOG, BOOT_LOG_HEADER, 0, hdr, sizeof(hdr), 80);
+    if (ret < 11) {
+        printf("boot log: not supported by the bridge firmware\n");
+        return -1;
+    }
+    change = hdr[1];
+    rate[0] = hdr[3] | (hdr[4] << 8) | (hdr[5] << 16) | ((uint32_t)hdr[6] << 24);
+    rate[1] = hdr[7] | (hdr[8] << 8) | (hdr[9] << 16) | ((uint32_t)hdr[10] << 24);
+    while (len < hdr[0]) {
+        ret = libusb_control_transfer(h, TYPE_IN_ITF, COMMAND_GET_BOOT_LOG, BOOT_LOG_DATA, len, data + len, MAX_PACKET_LEN, 80);
+        if (ret <= 0) {
+            info("boot log read failed. result=%i\n", ret);
+            break;
+        }
+        len += ret;
+    }
+
+    printf("boot log: %i bytes after ESP reset #%i, at %u baud\n", len, hdr[2], rate[0]);
+    if (change == BOOT_LOG_NO_CHANGE || change > len) {
+        change = len;
+    }
+    printBootLog(data, change);
+    if (change < len) {
+        printf("\n--- %u baud ---\n", rate[1]);
+        printBootLog(data + change, len - change);
+    }
+    printf("\n");
+    return 0;
+}
+
+//wait for a pattern trigger notification (or just 'timeout' ms without the
+//interrupt endpoint), then read the trigger state into 'buf'
+static int readTrigger(libusb_device_handle* h, int notify, uint8_t* buf, int timeout)
+{
+    if (notify) {
+        uint8_t n[MAX_NOTIFY_LEN];
+        int got = 0;
+        int ret = libusb_interrupt_transfer(h, EP_NOTIFY_IN, n, sizeof(n), &got, timeout);
+        //UART data ready notifications come too, the state is read anyway
+        if (ret < 0 && ret != LIBUSB_ERROR_TIMEOUT) {
+            info("wait for trigger failed. result=%i\n", ret);
+            usleep(timeout * 1000);
+        }
+    } else {
+        usleep(timeout * 1000);
+    }
+    return libusb_control_transfer(h, TYPE_IN_ITF, COMMAND_GET_TRIGGER, 0, 0, buf, 10, 80);
+}
+
+int loader_port_wait_trigger(const char* patterns, uint32_t baudrate, uint32_t timeout)
+{
+    libusb_device_handle* h = cfg->h;
+    uint8_t buf[MAX_PACKET_LEN];
+    const char* text[TRIGGER_MAX];
+    int lens[TRIGGER_MAX] = {0};
+    const char* p = patterns;
+    int notify = hasEndpoint(h, EP_NOTIFY_IN, LIBUSB_TRANSFER_TYPE_INTERRUPT);
+    int count = 0;
+    int64_t end;
+    int len;
+    int ret;
+
+    //the patterns go in fixed slots, their lengths in wValue
+    memset(outBuf, 0, TRIGGER_MAX * TRIGGER_LEN);
+    while (*p) {
+        const char* e = strchr(p, ';');
+        int n = e ? (int)(e - p) : (int) strlen(p);
+
+        if (count == TRIGGER_MAX || n == 0 || n > TRIGGER_LEN) {
+            printf("trigger: up to %i patterns of 1 to %i bytes, separated by ';'\n", TRIGGER_MAX, TRIGGER_LEN);
+            return -1;
+        }
+        memcpy(outBuf + count * TRIGGER_LEN, p, n);
+        text[count] = p;
+        lens[count++] = n;
+        p += e ? n + 1 : n;
+    }
+    if (!count) {
+        printf("trigger: no pattern\n");
+        return -1;
+    }
+
+    stopFraming();
+    setRxFrames(0);
+    stopReader(); //the notifications are read here
+    loader_port_change_baudrate(baudrate);
+
+    //armed before the reset, the bridge queues both in order
+    ret = sendControlTransfer(h, COMMAND_SET_TRIGGER, lens[0] | (lens[1] << 8), 0, TRIGGER_MAX * TRIGGER_LEN);
+    if (ret != TRIGGER_MAX * TRIGGER_LEN) {
+        printf("trigger: not supported by the bridge firmware\n");
+        return -1;
+    }
+    //normal boot
+    len = addGpioStep(outBuf, 0, GPIO_BOOT, resetLowUs);
+    len = addGpioStep(outBuf, len, GPIO_BOOT | GPIO_RESET | GPIO_ENABLE, 0);
+    runGpioSequence(h, outBuf, len);
+
+    //the bridge matches every byte itself, nothing is read until the hit
+    end = timeNowUs() + (int64_t) timeout * 1000;
+    do {
+        ret = readTrigger(h, notify, buf, 100);
+        if (ret == LIBUSB_ERROR_TIMEOUT) {
+            continue; //the next read may get through
+        }
+        if (ret < 10) {
+            info("trigger read failed. result=%i\n", ret);
+            break;
+        }
+        if (buf[0] == TRIGGER_HIT && buf[1] < count) {
+            uint32_t ticks = buf[2] | (buf[3] << 8) | (buf[4] << 16) | ((uint32_t)buf[5] << 24);
+            uint32_t offset = buf[6] | (buf[7] << 8) | (buf[8] << 16) | ((uint32_t)buf[9] << 24);
+
+            printf("pattern '%.*s' at %.3f ms, byte %u\n", lens[buf[1]], text[buf[1]],
+                ticks * (BRIDGE_TICK_NS / 1000000.0), offset);
+            return 0;
+        }
+    } while (timeNowUs() < end);
+
+    sendControlTransfer(h, COMMAND_SET_TRIGGER, 0, 0, 0);
+    printf("no pattern found in %u ms\n", timeout);
+    return 1;
+}
+
+//a line of the UART monitor, see loader_port_monitor()
+typedef struct {
+    char text[MONITOR_LINE_MAX + 1];
+    int len;
+} monitor_line_t;
+
+static void printMonitorLine(monitor_line_t* line, int channel)
+{
+    line->text[line->len] = 0;
+    printf("%i| %s\n", channel, line->text);
+    line->len = 0;
+}
+
+//add a received byte to the channel's line, print the line at its end
+static void monitorByte(monitor_line_t* line, int channel, uint8_t c)
+{
+    if (c == '\r') {
+        return;
+    }
+    if (c == '\n' || line->len == MONITOR_LINE_MAX) {
+        printMonitorLine(line, channel);
+        if (c == '\n') {
+            return;
+        }
+    }
+    line->text[line->len++] = (c >= ' ' && c < 0x7F) ? c : '.';
+}
+
+//one USB read of whatever the bridge has, returns the length or -1
+static int readUartPacket(uint8_t* buf, int timeout)
+{
+    libusb_device_handle* h = cfg->h;
+    int got = 0;
+    int ret;
+
+    if (useBulk) {
+        ret = libusb_bulk_transfer(h, EP_BULK_IN, buf, MAX_BULK_PACKET_LEN, &got, timeout);
+        return (ret < 0 && ret != LIBUSB_ERROR_TIMEOUT) ? -1 : got;
+    }
+    ret = libusb_control_transfer(h, TYPE_IN_ITF, COMMAND_READ_UART, 0, 0, buf, MAX_PACKET_LEN, 80);
+    if (ret == 0) {
+        if (__atomic_load_n(&useNotify, __ATOMIC_RELAXED)) {
+            waitForRxData(h, timeout);
+        } else {
+            usleep(1000);
+        }
+    }
+    return ret;
+}
+
+int loader_port_monitor(uint32_t baudrate1, uint32_t timeout)
+{
+    libusb_device_handle* h = cfg->h;
+    monitor_line_t lines[2];
+    uint8_t buf[MAX_BULK_PACKET_LEN];
+    uart_status_t status;
+    int64_t end = timeNowUs() + (int64_t) timeout * 1000;
+    int dropped = 0;
+    int len;
+    int ret;
+    int i;
+
+    stopFraming();
+    setRxFrames(0);
+    stopReader();
+    ret = sendControlTransfer(h, COMMAND_SET_UART1, baudrate1 & 0xFFFF, baudrate1 >> 16, 0);
+    if (ret != 0) {
+        printf("monitor: UART1 capture not supported by the bridge firmware\n");
+        return -1;
+    }
+    if (readUartStatus(h, &status) == 0 && status.rx1Overflows >= 0) {
+        dropped = status.rx1Overflows;
+    }
+    resBufPos = 0;
+    resBufMax = 0;
+    lines[0].len = 0;
+    lines[1].len = 0;
+
+    //normal boot
+    len = addGpioStep(outBuf, 0, GPIO_BOOT, resetLowUs);
+    len = addGpioStep(outBuf, len, GPIO_BOOT | GPIO_RESET | GPIO_ENABLE, 0);
+    runGpioSequence(h, outBuf, len);
+
+    printf("monitor: UART0 at %u baud, UART1 at %u baud\n", uartBaud, baudrate1);
+    while (timeout == 0 || timeNowUs() < end) {
+        ret = readUartPacket(buf, 100);
+        if (ret < 0) {
+            info("monitor read failed\n");
+            break;
+        }
+        //whole frames in every packet
+        i = 0;
+        while (i < ret) {
+            int channel = (buf[i] & MUX_CHANNEL1) ? 1 : 0;
+            int l = buf[i] & MUX_LEN_MASK;
+            for (i++; l > 0 && i < ret; l--, i++) {
+                monitorByte(&lines[channel], channel, buf[i]);
+            }
+        }
+        fflush(stdout);
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (lines[i].len) {
+            printMonitorLine(&lines[i], i);
+        }
+    }
+    sendControlTransfer(h, COMMAND_SET_UART1, 0, 0, 0);
+    if (readUartStatus(h, &status) == 0 && status.rx1Overflows >= 0) {
+        dropped = (status.rx1Overflows - dropped) & 0xFFFF;
+        if (dropped) {
+            printf("warning: the bridge dropped %i UART1 bytes\n", dropped);
+        }
+    }
+    return 0;
+}
+
+//peripheral script op names by their code, with the operand count (-1: any)
+static const struct {
+    const char* name;
+    int operands;
+} scriptOpNames[] = {
+    { NULL, 0 },
+    { "set", 2 },
+    { "get", 1 },
+    { "adc", 1 },
+    { "i2c-write", -1 },
+    { "i2c-read", 2 },
+    { "i2c-reg", 3 },
+    { "delay", 1 },
+};
+
+//result bytes of the op starting at 'op'
+static int scriptResultLen(const uint8_t* op)
+{
+    switch (op[0]) {
+        case SCRIPT_GET :
+        case SCRIPT_ADC :
+        case SCRIPT_I2C_WRITE :
+            return 1;
+        case SCRIPT_I2C_READ :
+            return 1 + op[2];
+        case SCRIPT_I2C_REG :
+            return 1 + op[3];
+    }
+    return 0;
+}
+
+//translate one "name operand..." op, returns the new script length or -1
+static int parseScriptOp(char* text, uint8_t* script, int len)
+{
+    char* name = strtok(text, " \t");
+    char* arg;
+    int start = len;
+    int count = 0;
+    int code;
+
+    if (name == NULL) {
+        return len; //empty op
+    }
+    for (code = SCRIPT_SET; code <= SCRIPT_DELAY; code++) {
+        if (!strcmp(name, scriptOpNames[code].name)) {
+            break;
+        }
+    }
+    if (code > SCRIPT_DELAY || len >= SCRIPT_MAX) {
+        printf("script: bad op '%s'\n", name);
+        return -1;
+    }
+    script[len++] = code;
+    if (code == SCRIPT_I2C_WRITE) {
+        len++; //byte count, filled in below
+    }
+    while ((arg = strtok(NULL, " \t")) != NULL) {
+        uint32_t v = strtoul(arg, NULL, 0);
+        if (code == SCRIPT_DELAY) {
+            if (len + 2 > SCRIPT_MAX) {
+                break;
+            }
+            script[len++] = v & 0xFF;
+            script[len++] = (v >> 8) & 0xFF;
+        } else {
+            if (len + 1 > SCRIPT_MAX) {
+                break;
+            }
+            script[len++] = v;
+        }
+        count++;
+    }
+    if (code == SCRIPT_I2C_WRITE) {
+        //[address][n][bytes]
+        script[start + 1] = script[start + 2];
+        script[start + 2] = count - 1;
+        if (count < 1) {
+            count = -1;
+        }
+    } else
+    if (count != scriptOpNames[code].operands) {
+        count = -1;
+    }
+    if (count < 0 || arg != NULL) {
+        printf("script: bad operands of '%s' or the script is too long\n", name);
+        return -1;
+    }
+    return len;
+}
+
+int loader_port_script(const char* text)
+{
+    libusb_device_handle* h = cfg->h;
+    uint8_t script[SCRIPT_MAX];
+    uint8_t res[MAX_PACKET_LEN];
+    char* copy = strdup(text);
+    char* ops[SCRIPT_MAX];
+    char* next;
+    int count = 0;
+    int len = 0;
+    int ret;
+    int pos;
+    int i;
+
+    //split into ops first: strtok is used per op
+    for (next = strtok(copy, ";"); next != NULL && count < SCRIPT_MAX; next = strtok(NULL, ";")) {
+        ops[count++] = next;
+    }
+    for (i = 0; i < count && len >= 0; i++) {
+        len = parseScriptOp(ops[i], script, len);
+    }
+    free(copy);
+    if (len <= 0) {
+        return -1;
+    }
+
+    memcpy(outBuf, script, len);
+    ret = sendControlTransfer(h, COMMAND_RUN_SCRIPT, 0, 0, len);
+    if (ret != len) {
+        printf("script: not supported by the bridge firmware\n");
+        return -1;
+    }
+    for (i = 0; i < 1000; i++) {
+        ret = recvControlTransfer(h, COMMAND_GET_SCRIPT, 0, 0);
+        if (ret < 2 || resBuf[0] != SCRIPT_BUSY) {
+            break;
+        }
+        usleep(1000);
+    }
+    if (ret < 2 || resBuf[0] == SCRIPT_BUSY) {
+        info("script: no result. result=%i\n", ret);
+        return -1;
+    }
+    memcpy(res, resBuf, ret);
+
+    //the results in the order of the ops
+    pos = 2;
+    for (i = 0, count = 0; i < len && count < res[1]; count++) {
+        const uint8_t* op = script + i;
+        int n = scriptResultLen(op);
+        int j;
+
+        printf("%-10s", scriptOpNames[op[0]].name);
+        if (op[0] == SCRIPT_GET || op[0] == SCRIPT_ADC) {
+            printf(" %u: %u\n", op[1], res[pos]);
+        } else
+        if (op[0] == SCRIPT_SET) {
+            printf(" %u: %u\n", op[1], op[2]);
+        } else
+        if (op[0] == SCRIPT_DELAY) {
+            printf(" %u us\n", op[1] | (op[2] << 8));
+        } else {
+            printf(" 0x%02x: %s", op[1], res[pos] == I2C_NAK ? "nak" : "ack");
+            for (j = 1; j < n; j++) {
+                printf(" %02x", res[pos + j]);
+            }
+            printf("\n");
+        }
+        pos += n;
+        switch (op[0]) {
+            case SCRIPT_I2C_WRITE : i += 3 + op[2]; break;
+            case SCRIPT_I2C_REG : i += 4; break;
+            case SCRIPT_GET :
+            case SCRIPT_ADC : i += 2; break;
+            default: i += 3;
+        }
+    }
+    if (res[0] != SCRIPT_DONE) {
+        printf("script: failed at op %i\n", res[1] + 1);
+        return 1;
+    }
+    return 0;
+}
+
+static const uint32_t benchRates[] = { 74880, 115200, 230400, 460800, 921600, 1000000 };
+
+static int compareTimes(const void* a, const void* b)
+{
+    int64_t d = *(const int64_t*) a - *(const int64_t*) b;
+    return d < 0 ? -1 : (d > 0 ? 1 : 0);
+}
+
+//count the bytes of 'got' that differ from 'sent'
+static int countErrors(const uint8_t* sent, const uint8_t* got, int size)
+{
+    int errors = 0;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        if (sent[i] != got[i]) {
+            errors++;
+        }
+    }
+    return errors;
+}
+
+static void benchWrite(const uint8_t* data, int size)
+{
+    loader_port_serial_write(data, size, 1000);
+    loader_port_write_flush();
+}
+
+//stream BENCH_BYTES through the loop with one chunk written ahead,
+//returns the bytes received wrong or not at all, 'us' the time taken
+static int benchStream(uint32_t rate, int64_t* us)
+{
+    static uint8_t sent[BENCH_BYTES];
+    uint8_t got[BENCH_CHUNK];
+    int errors = 0;
+    int written = 0;
+    int tries = 0;
+    int64_t start;
+    int pos;
+    int i;
+
+    for (i = 0; i < BENCH_BYTES; i++) {
+        sent[i] = rand();
+    }
+    start = timeNowUs();
+    for (pos = 0; pos < BENCH_BYTES; pos += BENCH_CHUNK) {
+        int e;
+
+        while (written < pos + 2 * BENCH_CHUNK && written < BENCH_BYTES) {
+            benchWrite(sent + written, BENCH_CHUNK);
+            written += BENCH_CHUNK;
+        }
+        e = BENCH_CHUNK;
+        if (readUart(got, BENCH_CHUNK, 1000) == 0) {
+            e = countErrors(sent + pos, got, BENCH_CHUNK);
+        }
+        if (e == 0) {
+            tries = 0;
+            continue;
+        }
+        //lost bytes put the loop out of step: let the chunk in flight
+        //arrive, drop all received and send the failed chunk again (a link
+        //that keeps failing it moves on after BENCH_TRIES)
+        errors += e;
+        loader_port_delay_ms(BENCH_CHUNK * 10 * 1000 / rate + 20);
+        resetRx(rxFrames);
+        if (++tries < BENCH_TRIES) {
+            written = pos;
+            pos -= BENCH_CHUNK;
+        } else {
+            tries = 0;
+            written = pos + BENCH_CHUNK;
+        }
+    }
+    *us = timeNowUs() - start;
+    return errors;
+}
+
+//time single byte round trips, the times are sorted, returns the lost ones
+static int benchPing(int64_t* times)
+{
+    int lost = 0;
+    int i;
+
+    for (i = 0; i < BENCH_PINGS; i++) {
+        uint8_t c = i;
+        uint8_t r;
+        int64_t start = timeNowUs();
+
+        benchWrite(&c, 1);
+        if (readUart(&r, 1, 100) != 0 || r != c) {
+            lost++;
+            resetRx(rxFrames);
+        }
+        times[i] = timeNowUs() - start;
+    }
+    qsort(times, BENCH_PINGS, sizeof(times[0]), compareTimes);
+    return lost;
+}
+
+int loader_port_bench_link(int pins)
+{
+    libusb_device_handle* h = cfg->h;
+    uint32_t baud = uartBaud;
+    int64_t times[BENCH_PINGS];
+    unsigned int i;
+    int ret;
+
+    if (!useBaudReport) {
+        printf("link benchmark: not supported by the bridge firmware\n");
+        return -1;
+    }
+    if (pins) {
+        //TX wired to RX: the ESP is held in reset, off the line
+        ret = sendControlTransfer(h, COMMAND_SET_GPIO, 0, 0, 0);
+    } else {
+        ret = sendControlTransfer(h, COMMAND_SET_LOOPBACK, 1, 0, 0);
+    }
+    if (ret != 0) {
+        printf("link benchmark: not supported by the bridge firmware\n");
+        return -1;
+    }
+    stopFraming();
+
+    printf("link benchmark (%s loopback, %i bytes, %i round trips per rate)\n",
+        pins ? "pin" : "software", BENCH_BYTES, BENCH_PINGS);
+    printf("    baud   bridge    bytes/s   line  rtt p50  rtt p90  rtt p99 [ms]  errors\n");
+    for (i = 0; i < sizeof(benchRates) / sizeof(benchRates[0]); i++) {
+        uint32_t rate;
+        int error;
+        int64_t us;
+        int errors;
+
+        if (setBridgeBaud(h, benchRates[i], 0, &rate, &error) < 0) {
+            continue;
+        }
+        uartBaud = rate;
+        setRxFrames(0);
+        errors = benchStream(rate, &us);
+        errors += benchPing(times);
+        printf("%8u %8u %10.0f %5.1f%% %8.2f %8.2f %8.2f      %6i\n", benchRates[i], rate,
+            BENCH_BYTES * 1000000.0 / us, BENCH_BYTES * 1000000.0 / us / (rate / 10.0) * 100,
+            times[BENCH_PINGS / 2] / 1000.0, times[BENCH_PINGS * 9 / 10] / 1000.0,
+            times[BENCH_PINGS * 99 / 100] / 1000.0, errors);
+    }
+
+    if (pins) {
+        //7 => Boot:1, Reset: 1, Enable:1 - the ESP runs again
+        sendControlTransfer(h, COMMAND_SET_GPIO, 7, 0, 0);
+    } else {
+        sendControlTransfer(h, COMMAND_SET_LOOPBACK, 0, 0, 0);
+    }
+    loader_port_change_baudrate(baud);
+    return 0;
+}
+
+//bridge firmware update: the image is XORed with a key derived from the chip
+//unique ID, the key material sent is all zeros
+typedef struct {
+    libusb_device_handle* h;
+    uint8_t chipId;
+    uint8_t key[8];
+} isp_t;
+
+//detect request: chip and family the tool was made for, the ID text
+static const uint8_t ispDetect[] = {
+    0x52, 0x11, 'M', 'C', 'U', ' ', 'I', 'S', 'P', ' ', '&', ' ', 'W', 'C', 'H', '.', 'C', 'N'
+};
+
+//first device with the IDs that answers the open (and has the bridge strings
+//when 'names' is set, and is 'unit' if given), NULL if none
+static libusb_device_handle* findDevice(libusb_context* c, uint16_t vid, uint16_t pid, int names, const char* unit)
+{
+    libusb_device** list = NULL;
+    libusb_device_handle* found = NULL;
+    struct libusb_device_descriptor des;
+    int n;
+    int i;
+
+    n = libusb_get_device_list(c, &list);
+    for (i = 0; i < n && found == NULL; i++) {
+        char vendorName[32] = "";
+        char productName[32] = "";
+        libusb_device_handle* h;
+
+        if (libusb_get_device_descriptor(list[i], &des) || des.idVendor != vid || des.idProduct != pid) {
+            continue;
+        }
+        if (libusb_open(list[i], &h)) {
+            continue;
+        }
+        if (names) {
+            libusb_get_string_descriptor_ascii(h, des.iManufacturer, (unsigned char*) vendorName, sizeof(vendorName));
+            libusb_get_string_descriptor_ascii(h, des.iProduct, (unsigned char*) productName, sizeof(productName));
+            if (strcmp(VENDOR_NAME, vendorName) || strcmp(PRODUCT_NAME, productName) ||
+                (unit != NULL && !isUnit(h, &des, unit))) {
+                libusb_close(h);
+                continue;
+            }
+        }
+        found = h;
+    }
+    if (n >= 0) {
+        libusb_free_device_list(list, 1);
+    }
+    return found;
+}
+
+//poll for the device for up to 'timeout' ms
+static libusb_device_handle* waitForDevice(libusb_context* c, uint16_t vid, uint16_t pid, int names, const char* unit, int timeout)
+{
+    int64_t end = timeNowUs() + (int64_t)timeout * 1000;
+    libusb_device_handle* h;
+
+    while ((h = findDevice(c, vid, pid, names, unit)) == NULL && timeNowUs() < end) {
+        usleep(50 * 1000);
+    }
+    return h;
+}
+
+//one bootloader command, returns the response length or a libusb error
+static int ispCommand(isp_t* isp, uint8_t cmd, const uint8_t* data, int len, uint8_t* res)
+{
+    uint8_t pkt[MAX_BULK_PACKET_LEN];
+    int done = 0;
+    int ret;
+
+    pkt[0] = cmd;
+    pkt[1] = len & 0xFF;
+    pkt[2] = len >> 8;
+    memcpy(pkt + 3, data, len);
+    ret = libusb_bulk_transfer(isp->h, ISP_EP_OUT, pkt, len + 3, &done, 1000);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = libusb_bulk_transfer(isp->h, ISP_EP_IN, res, MAX_BULK_PACKET_LEN, &done, 2000);
+    if (verbose) {
+        info("isp command 0x%02x: result=%i, %i bytes\n", cmd, ret, done);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    if (done < 5 || res[0] != cmd) {
+        return LIBUSB_ERROR_IO;
+    }
+    return done;
+}
+
+//writes or verifies the (XORed) image, returns the offset of the first
+//rejected packet or 'size' if all went through
+static int ispTransfer(isp_t* isp, uint8_t cmd, const uint8_t* image, int size)
+{
+    uint8_t data[ISP_CHUNK + 5];
+    uint8_t res[MAX_BULK_PACKET_LEN];
+    int pos;
+
+    int shown = -1;
+
+    for (pos = 0; pos < size; pos += ISP_CHUNK) {
+        int n = size - pos < ISP_CHUNK ? size - pos : ISP_CHUNK;
+        data[0] = pos & 0xFF;
+        data[1] = pos >> 8;
+        data[2] = 0;
+        data[3] = 0;
+        data[4] = rand() & 0xFF; //ignored
+        memcpy(data + 5, image + pos, n);
+        if (ispCommand(isp, cmd, data, n + 5, res) < 0 || res[4] != 0) {
+            return pos;
+        }
+        if (cmd == ISP_WRITE && (pos + n) * 100 / size != shown) {
+            shown = (pos + n) * 100 / size;
+            printf("\rwriting: %i%%", shown);
+            fflush(stdout);
+        }
+    }
+    return size;
+}
+
+//identify the chip, check the bootloader version and set up the key
+static int ispStart(isp_t* isp, int* maxSize)
+{
+    uint8_t res[MAX_BULK_PACKET_LEN];
+    uint8_t key[ISP_KEY_LEN];
+    uint8_t cfgReq[2] = { 0x1F, 0x00 };
+    uint8_t sum;
+    int ret;
+    int i;
+
+    ret = ispCommand(isp, ISP_DETECT, ispDetect, sizeof(ispDetect), res);
+    if (ret < 6) {
+        printf("update: the bootloader did not answer\n");
+        return -1;
+    }
+    isp->chipId = res[4];
+    switch (isp->chipId) {
+        case 0x51: *maxSize = 10 * 1024; break;
+        case 0x52:
+        case 0x54: *maxSize = 14 * 1024; break;
+        default:
+            printf("update: unknown chip 0x%02x\n", isp->chipId);
+            return -1;
+    }
+
+    ret = ispCommand(isp, ISP_CONFIG, cfgReq, sizeof(cfgReq), res);
+    if (ret < ISP_CONFIG_LEN) {
+        printf("update: can not read the bootloader configuration\n");
+        return -1;
+    }
+    printf("update: CH55%x, bootloader %i.%i%i\n", isp->chipId & 0x0F, res[20], res[21], res[22]);
+    if (res[20] < 2 || (res[20] == 2 && res[21] < 3)) {
+        printf("update: bootloader too old for this mode, use chprog\n");
+        return -1;
+    }
+
+    //the key: the sum of the first 4 unique ID bytes, plus the chip ID for
+    //the last key byte
+    sum = res[22] + res[23] + res[24] + res[25];
+    for (i = 0; i < 8; i++) {
+        isp->key[i] = sum;
+    }
+    isp->key[7] += isp->chipId;
+    memset(key, 0, sizeof(key));
+    if (ispCommand(isp, ISP_KEY, key, sizeof(key), res) < 0) {
+        printf("update: key setup failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+//start the application, the bootloader leaves without an answer
+static void ispRun(isp_t* isp)
+{
+    uint8_t pkt[4] = { ISP_RESET, 1, 0, 1 };
+    int done;
+
+    libusb_bulk_transfer(isp->h, ISP_EP_OUT, pkt, sizeof(pkt), &done, 500);
+}
+
+//the file padded to 8 bytes, NULL on error
+static uint8_t* readImage(const char* path, int* size)
+{
+    uint8_t* image;
+    FILE* f = fopen(path, "rb");
+    long len;
+
+    if (f == NULL) {
+        printf("update: can not open %s\n", path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    rewind(f);
+    image = calloc(1, (len + 7) / 8 * 8 + 8);
+    if (image == NULL || len <= 0 || fread(image, 1, len, f) != (size_t) len) {
+        printf("update: can not read %s\n", path);
+        free(image);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    *size = (len + 7) / 8 * 8;
+    return image;
+}
+
+int loader_port_update_bridge(loader_usb_config_t* config, const char* path)
+{
+    isp_t isp;
+    uint8_t res[MAX_BULK_PACKET_LEN];
+    uint8_t blocks;
+    uint8_t* image;
+    int64_t start = timeNowUs();
+    int maxSize;
+    int size;
+    int erased = 0;
+    int ret = -1;
+    int i;
+
+    image = readImage(path, &size);
+    if (image == NULL) {
+        return -1;
+    }
+    if (size > ISP_MAX_SIZE) {
+        printf("update: %s is %i bytes, more than any CH55x takes\n", path, size);
+        free(image);
+        return -1;
+    }
+    if (libusb_init(&config->c)) {
+        fatal("can not initialise libusb\n");
+    }
+
+    //a bridge left in the bootloader by an earlier attempt is taken as it is
+    isp.h = findDevice(config->c, ISP_VENDOR_ID, ISP_PRODUCT_ID, 0, NULL);
+    if (isp.h == NULL) {
+        libusb_device_handle* h = waitForDevice(config->c, VENDOR_ID, PRODUCT_ID, 1, config->unit, ISP_ENUM_TIMEOUT);
+        if (h == NULL) {
+            printf("update: no bridge found\n");
+            goto done;
+        }
+        libusb_claim_interface(h, 0);
+        //the bridge leaves without completing the request
+        libusb_control_transfer(h, TYPE_OUT_ITF, COMMAND_JUMP_TO_BOOTLOADER, 0, 0, NULL, 0, 500);
+        libusb_release_interface(h, 0);
+        libusb_close(h);
+        isp.h = waitForDevice(config->c, ISP_VENDOR_ID, ISP_PRODUCT_ID, 0, NULL, ISP_ENUM_TIMEOUT);
+        if (isp.h == NULL) {
+            printf("update: the bridge did not come up in the bootloader\n");
+            goto done;
+        }
+    }
+    if (libusb_kernel_driver_active(isp.h, 0) == 1) {
+        libusb_detach_kernel_driver(isp.h, 0);
+    }
+    if (libusb_claim_interface(isp.h, 0) < 0) {
+        printf("update: can not claim the bootloader interface\n");
+        libusb_close(isp.h);
+        goto done;
+    }
+
+    if (ispStart(&isp, &maxSize) < 0) {
+        goto release;
+    }
+    if (size > maxSize) {
+        printf("update: %s is %i bytes, the chip takes %i\n", path, size, maxSize);
+        goto release;
+    }
+    for (i = 0; i < size; i++) {
+        image[i] ^= isp.key[i & 7];
+    }
+
+    blocks = (size + ISP_BLOCK - 1) / ISP_BLOCK;
+    if (blocks < ISP_MIN_BLOCKS) {
+        blocks = ISP_MIN_BLOCKS;
+    }
+    erased = 1;
+    if (ispCommand(&isp, ISP_ERASE, &blocks, 1, res) < 0 || res[4] != 0) {
+        printf("update: erase failed\n");
+        goto release;
+    }
+    i = ispTransfer(&isp, ISP_WRITE, image, size);
+    printf("\n");
+    if (i != size) {
+        printf("update: write failed at 0x%04x\n", i);
+        goto release;
+    }
+    i = ispTransfer(&isp, ISP_VERIFY, image, size);
+    if (i != size) {
+        printf("update: verify failed at 0x%04x\n", i);
+        goto release;
+    }
+    printf("update: %i bytes written and verified\n", size);
+    ret = 0;
+
+release:
+    //start the new firmware, or the old one if nothing was erased yet
+    if (ret == 0 || !erased) {
+        ispRun(&isp);
+    }
+    libusb_release_interface(isp.h, 0);
+    libusb_close(isp.h);
+    if (ret == 0 || !erased) {
+        libusb_device_handle* h = waitForDevice(config->c, VENDOR_ID, PRODUCT_ID, 1, config->unit, ISP_ENUM_TIMEOUT);
+        if (h == NULL) {
+            printf("update: the bridge did not come back\n");
+            ret = -1;
+        } else {
+            libusb_close(h);
+            if (ret == 0) {
+                printf("update: bridge is back, %.1f s\n", (timeNowUs() - start) / 1000000.0);
+            }
+        }
+    }
+done:
+    free(image);
+    libusb_exit(config->c);
+    return ret;
+}
+
+static void printBridgeConfig(const bridge_config_t* bc)
+{
+    printf(" label '%s', baud %u%s, reset %i/%i/%i us\n", bc->label, bc->baudrate,
+        bc->baudrate ? "" : " (default)", bc->resetLowUs, bc->resetReleaseUs, bc->bootStartUs);
+}
+
+int loader_port_list_bridges(loader_usb_config_t* config)
+{
+    libusb_device** list = NULL;
+    int count = 0;
+    int n;
+    int i;
+
+    if (libusb_init(&config->c)) {
+        fatal("can not initialise libusb\n");
+    }
+    n = libusb_get_device_list(config->c, &list);
+    for (i = 0; i < n; i++) {
+        struct libusb_device_descriptor des;
+        libusb_device_handle* h;
+        char vendorName[32] = "";
+        char productName[32] = "";
+        char serial[32];
+        bridge_config_t bc;
+        int ret;
+
+        if (libusb_get_device_descriptor(list[i], &des) || des.idVendor != VENDOR_ID ||
+            des.idProduct != PRODUCT_ID || libusb_open(list[i], &h)) {
+            continue;
+        }
+        libusb_get_string_descriptor_ascii(h, des.iManufacturer, (unsigned char*) vendorName, sizeof(vendorName));
+        libusb_get_string_descriptor_ascii(h, des.iProduct, (unsigned char*) productName, sizeof(productName));
+        if (!strcmp(VENDOR_NAME, vendorName) && !strcmp(PRODUCT_NAME, productName)) {
+            readSerial(h, &des, serial, sizeof(serial));
+            printf("bridge %i:%i serial %s\n", libusb_get_bus_number(list[i]),
+                libusb_get_device_address(list[i]), serial[0] ? serial : "-");
+            ret = readBridgeConfig(h, &bc);
+            if (ret < 0) {
+                printf(" no config: older firmware\n");
+            } else {
+                printBridgeConfig(&bc);
+            }
+            count++;
+        }
+        libusb_close(h);
+    }
+    if (n >= 0) {
+        libusb_free_device_list(list, 1);
+    }
+    libusb_exit(config->c);
+    if (!count) {
+        printf("no bridge found\n");
+        return -1;
+    }
+    return 0;
+}
+
+int loader_port_bridge_config(const char* text)
+{
+    bridge_config_t bc;
+    char* copy = strdup(text);
+    char* item;
+    int ret = 0;
+
+    if (readBridgeConfig(cfg->h, &bc) < 0) {
+        printf("config: not supported by the bridge firmware\n");
+        free(copy);
+        return -1;
+    }
+    for (item = strtok(copy, ";"); item != NULL && ret == 0; item = strtok(NULL, ";")) {
+        while (*item == ' ') {
+            item++;
+        }
+        if (!strncmp(item, "baud=", 5)) {
+            bc.baudrate = strtoul(item + 5, NULL, 0);
+        } else
+        if (!strncmp(item, "reset=", 6)) {
+            int t[3];
+            if (sscanf(item + 6, "%i,%i,%i", &t[0], &t[1], &t[2]) != 3 ||
+                t[0] < 0 || t[0] > 0xFFFF || t[1] < 0 || t[1] > 0xFFFF || t[2] < 0 || t[2] > 0xFFFF) {
+                ret = -1;
+            } else {
+                bc.resetLowUs = t[0];
+                bc.resetReleaseUs = t[1];
+                bc.bootStartUs = t[2];
+            }
+        } else
+        if (!strncmp(item, "label=", 6) && strlen(item + 6) <= CONFIG_LABEL_LEN) {
+            strcpy(bc.label, item + 6);
+        } else
+        if (*item) {
+            ret = -1;
+        }
+        if (ret) {
+            printf("config: bad setting '%s'\n", item);
+        }
+    }
+    free(copy);
+    if (ret) {
+        return -1;
+    }
+    if (writeBridgeConfig(cfg->h, &bc)) {
+        printf("config: the bridge did not store it\n");
+        return -1;
+    }
+    printf("config stored:\n");
+    printBridgeConfig(&bc);
+    return 0;
+}
+
 void loader_port_delay_ms(uint32_t ms)
 {
     usleep(ms * 1000);
@@ -683,13 +3046,46 @@ void loader_port_debug_print(const char *str)
     printf("DEBUG: %s\n", str);
 }
 
+uint32_t loader_port_nearest_baudrate(uint32_t baudrate)
+{
+	uint32_t rate;
+	int error;
+
+	if (!useBaudReport) {
+		//older firmware: fixed rates only
+		return (baudrate == 74880 || baudrate == 115200) ? baudrate : 0;
+	}
+	if (setBridgeBaud(cfg->h, baudrate, 1, &rate, &error) < 0) {
+		return 0;
+	}
+	return rate;
+}
+
+uint32_t loader_port_get_baudrate(void)
+{
+	return uartBaud;
+}
+
 esp_loader_error_t loader_port_change_baudrate(uint32_t baudrate)
 {
 	int ret;
 	int data;
 	libusb_device_handle* h = cfg->h;
 	
-	
+	if (useBaudReport) {
+		uint32_t rate;
+		int error;
+		if (setBridgeBaud(h, baudrate, 0, &rate, &error) < 0) {
+			return ESP_LOADER_ERROR_FAIL;
+		}
+		uartBaud = rate;
+		printf("setting baud rate: %u (bridge: %u, error %.1f%%)\n", baudrate, rate, error / 10.0);
+		if (error > BAUD_MAX_ERROR || error < -BAUD_MAX_ERROR) {
+			printf("warning: baud rate error is too high\n");
+		}
+		return ESP_LOADER_SUCCESS;
+	}
+
 	if (baudrate == 74880) {
 		data = 0;
 	} else {
@@ -700,6 +3096,7 @@ esp_loader_error_t loader_port_change_baudrate(uint32_t baudrate)
 	if (ret != 0) {
         info("baud rate set failed. result=%i\n", ret); 
     } else {
+		uartBaud = data ? 115200 : 74880;
 		loader_port_delay_ms(40);
 	}
     return 0; 
@@ -27,6 +27,64 @@ typedef struct {
     libusb_context* c;
     libusb_device_handle *h;
     uint32_t baudrate;
+    int controlOnly; // UART data via EP0 control transfers even if bulk endpoints exist
+    int stats; // print the transfer and bridge statistics at the end
+    const char* unit; // serial number or config label of the bridge to open, NULL: the first one
+    uint32_t preferredBaud; // rate to flash at stored on the bridge, 0: none (set by the init)
+    int writeQueue; // write transfers queued at once (bulk or with write credits), 0: the default
 } loader_usb_config_t;
 
 esp_loader_error_t loader_port_usb_init(loader_usb_config_t *config);
+
+// Resets the target into a normal boot and prints the time of every line of
+// its boot log, measured by the bridge from the reset release, and the time of
+// the first line containing 'marker' (NULL: none). Runs until the marker is
+// found or 'timeout' ms have passed. Returns 0, 1 if the marker was not found
+// or -1 if the bridge can not do it.
+int loader_port_boot_profile(const char* marker, uint32_t baudrate, uint32_t timeout);
+
+// Prints the first bytes the bridge received after the last ESP reset, with
+// the rates they were received at. Returns -1 if the bridge can not do it.
+int loader_port_boot_log(void);
+
+// Arms the bridge with up to two patterns separated by ';' (up to 16 bytes
+// each), resets the target into a normal boot and waits until the bridge
+// matches one in what the target sends at 'baudrate'. Prints the pattern, its
+// time from the arming and the offset of its last byte. The bytes are not
+// read, the hit comes as an interrupt endpoint notification. Returns 0, 1 if
+// no pattern came in 'timeout' ms or -1 if the bridge can not do it.
+int loader_port_wait_trigger(const char* patterns, uint32_t baudrate, uint32_t timeout);
+
+// Resets the target into a normal boot and prints what it sends on UART0 and,
+// captured by the bridge at 'baudrate1', on UART1, a line at a time tagged
+// with the channel. Runs for 'timeout' ms, 0: until interrupted. Returns -1
+// if the bridge can not do it.
+int loader_port_monitor(uint32_t baudrate1, uint32_t timeout);
+
+// Runs a peripheral script on the bridge and prints the results: ops separated
+// by ';', e.g. "i2c-reg 0x48 0 2; adc 0; set 7 1; delay 1000", see the
+// usage. Returns 0, 1 if an op failed or -1 if the script is not valid or the
+// bridge can not do it.
+int loader_port_script(const char* text);
+
+// Measures the bridge alone at the supported rates: the throughput, the round
+// trip times and the errors of data looped back by the bridge firmware or,
+// with 'pins' set, through a TX to RX jumper. Returns -1 if the bridge can not
+// do it.
+int loader_port_bench_link(int pins);
+
+// Updates the bridge firmware with the binary at 'path': the bridge jumps to
+// the CH55x ROM bootloader (or is already there), the image is written and
+// verified, then the new firmware is started and awaited. Opens the device on
+// its own, call it instead of loader_port_usb_init(). Returns 0 or -1.
+int loader_port_update_bridge(loader_usb_config_t* config, const char* path);
+
+// Prints every bridge with its serial number and the config stored on it.
+// Opens the devices on its own, call it instead of loader_port_usb_init().
+// Returns 0 or -1 if there is none.
+int loader_port_list_bridges(loader_usb_config_t* config);
+
+// Changes the config stored on the bridge: settings separated by ';' -
+// "baud=rate" (0: none), "reset=low,release,start" (us) and "label=text" (up
+// to 20 characters), e.g. "baud=921600;label=desk". Returns 0 or -1.
+int loader_port_bridge_config(const char* text);
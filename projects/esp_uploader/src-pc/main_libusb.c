@@ -18,8 +18,10 @@
 
 #include "serial_io.h"
 
-#define DEFAULT_BAUD_RATE 74880
-#define HIGHER_BAUD_RATE  74880
+#define DEFAULT_BAUD_RATE 115200
+#define HIGHER_BAUD_RATE  921600
+#define BOOT_LOG_BAUD_RATE 74880
+#define BOOT_PROFILE_TIME  10000
 
 #define APPLICATION_ADDRESS 0x10000
 #define BOOTLOADER_ADDRESS 0x1000
@@ -70,9 +72,58 @@ int main(int argc, char** argv)
     char* bl_path = NULL;
     char* pt_path = NULL;
     char* ar_path = NULL;
+    int control_only = 0;
+    int stats = 0;
+    int write_queue = 0;
+    char* marker = NULL;
+    char* trigger = NULL;
+    int boot_log = 0;
+    int bench_link = 0;
+    uint32_t monitor_baud_rate = 0;
+    uint32_t monitor_time = 0;
+    char* script = NULL;
+    char* bridge_path = NULL;
+    char* unit = NULL;
+    char* bridge_config = NULL;
+    int list_bridges = 0;
+    int higher_baud_set = 0;
+    uint32_t boot_log_baud_rate = BOOT_LOG_BAUD_RATE;
+    uint32_t higher_baud_rate = HIGHER_BAUD_RATE;
 
-    if (argc < 3) {
-        printf("usage: %s [-a app.ino.bin] [-b bootloader.bin] [-p partitions.bin] [-f firmware.bin] \n", argv[0]);
+    if (argc < 2) {
+        printf("usage: %s [-U unit] [-a app.ino.bin] [-b bootloader.bin] [-p partitions.bin] [-f firmware.bin] [-c] [-B baud] [-Q n] [-s]\n", argv[0]);
+        printf("       %s -P marker [-L baud] [-R]\n", argv[0]);
+        printf("       %s -R\n", argv[0]);
+        printf("       %s -M baud [-T ms]\n", argv[0]);
+        printf("       %s -W patterns [-L baud] [-T ms]\n", argv[0]);
+        printf("       %s -X script\n", argv[0]);
+        printf("       %s --bench-link [pins]\n", argv[0]);
+        printf("       %s --update-bridge bridge.bin\n", argv[0]);
+        printf("       %s --list-bridges\n", argv[0]);
+        printf("       %s --bridge-config settings\n", argv[0]);
+        printf("  -U : the bridge to use: its serial number or config label, default: the first one\n");
+        printf("  -c : transfer the UART data via the control endpoint only\n");
+        printf("  -Q : write transfers queued at once, default 4, 1: one at a time\n");
+        printf("  -s : print the transfer and bridge statistics\n");
+        printf("  -P : reset the ESP, time its boot log lines and the first one containing 'marker'\n");
+        printf("  -L : baud rate of the boot log (-P, -W), default %i\n", BOOT_LOG_BAUD_RATE);
+        printf("  -R : print the bytes the bridge recorded after the last ESP reset\n");
+        printf("  -M : reset the ESP and print its UART0 and UART1 output, UART1 at 'baud'\n");
+        printf("  -W : reset the ESP and wait until the bridge receives one of the patterns,\n");
+        printf("       up to 2 of up to 16 bytes separated by ';', print its time and offset\n");
+        printf("  -T : stop the monitor after 'ms', default: run until interrupted (-W: %i)\n", BOOT_PROFILE_TIME);
+        printf("  -X : run the peripheral ops of the script on the bridge, separated by ';':\n");
+        printf("       set pin level | get pin    - P1 pins 1, 5, 6, 7\n");
+        printf("       adc channel                - 0 (P1.1) or 2 (P1.5)\n");
+        printf("       i2c-write addr byte...     - I2C on P1.5 (SDA) and P1.7 (SCL)\n");
+        printf("       i2c-read addr n | i2c-reg addr reg n | delay us\n");
+        printf("  --bench-link : measure the bridge with its UART looped back in the firmware,\n");
+        printf("                 or with 'pins' through a TX to RX jumper\n");
+        printf("  --update-bridge : write the firmware to the CH55x through its bootloader and restart it\n");
+        printf("  --list-bridges : print the serial number and the stored config of every bridge\n");
+        printf("  --bridge-config : store settings on the bridge, separated by ';':\n");
+        printf("       baud=rate (0: none) | reset=low,release,start (us) | label=text\n");
+        printf("  -B : highest baud rate to flash at (ESP32), 0 keeps %i, default: the bridge config or %i\n", DEFAULT_BAUD_RATE, HIGHER_BAUD_RATE);
         return 1;
     }
     
@@ -89,9 +140,62 @@ int main(int argc, char** argv)
     	} else
     	if (!strcmp("-f", arg)) {
     		fw_path = argv[++i]; 
+    	} else
+    	if (!strcmp("-c", arg)) {
+    		control_only = 1;
+    	} else
+    	if (!strcmp("-B", arg)) {
+    		higher_baud_rate = strtoul(argv[++i], NULL, 0);
+    		higher_baud_set = 1;
+    	} else
+    	if (!strcmp("-Q", arg)) {
+    		write_queue = strtoul(argv[++i], NULL, 0);
+    	} else
+    	if (!strcmp("-s", arg)) {
+    		stats = 1;
+    	} else
+    	if (!strcmp("-P", arg)) {
+    		marker = argv[++i];
+    	} else
+    	if (!strcmp("-W", arg)) {
+    		trigger = argv[++i];
+    	} else
+    	if (!strcmp("-L", arg)) {
+    		boot_log_baud_rate = strtoul(argv[++i], NULL, 0);
+    	} else
+    	if (!strcmp("-R", arg)) {
+    		boot_log = 1;
+    	} else
+    	if (!strcmp("-M", arg)) {
+    		monitor_baud_rate = strtoul(argv[++i], NULL, 0);
+    	} else
+    	if (!strcmp("-T", arg)) {
+    		monitor_time = strtoul(argv[++i], NULL, 0);
+    	} else
+    	if (!strcmp("-X", arg)) {
+    		script = argv[++i];
+    	} else
+    	if (!strcmp("--bench-link", arg)) {
+    		bench_link = 1;
+    		if (i + 1 < argc && !strcmp("pins", argv[i + 1])) {
+    			bench_link = 2;
+    			i++;
+    		}
+    	} else
+    	if (!strcmp("--update-bridge", arg)) {
+    		bridge_path = argv[++i];
+    	} else
+    	if (!strcmp("-U", arg)) {
+    		unit = argv[++i];
+    	} else
+    	if (!strcmp("--list-bridges", arg)) {
+    		list_bridges = 1;
+    	} else
+    	if (!strcmp("--bridge-config", arg)) {
+    		bridge_config = argv[++i];
     	}
     }
-    if (ar_path == NULL && fw_path == NULL && bl_path == NULL && pt_path == NULL) {
+    if (!list_bridges && bridge_config == NULL && bridge_path == NULL && marker == NULL && trigger == NULL && !boot_log && !bench_link && !monitor_baud_rate && script == NULL && ar_path == NULL && fw_path == NULL && bl_path == NULL && pt_path == NULL) {
     	printf("No file specified\n");
     	return 1;
     }
@@ -99,10 +203,53 @@ int main(int argc, char** argv)
 	config.c = NULL;
 	config.h = NULL;
     config.baudrate = DEFAULT_BAUD_RATE;
+    config.controlOnly = control_only;
+    config.stats = stats;
+    config.writeQueue = write_queue;
+    config.unit = unit;
+
+    if (list_bridges) {
+        return loader_port_list_bridges(&config) ? 1 : 0;
+    }
+    if (bridge_path != NULL) {
+        return loader_port_update_bridge(&config, bridge_path) ? 1 : 0;
+    }
 
     loader_port_usb_init(&config);
 
-    if (connect_to_target(HIGHER_BAUD_RATE) == ESP_LOADER_SUCCESS)
+    if (bridge_config != NULL) {
+        return loader_port_bridge_config(bridge_config) ? 1 : 0;
+    }
+    //the rate tuned for this unit, unless asked for another
+    if (!higher_baud_set && config.preferredBaud) {
+        higher_baud_rate = config.preferredBaud;
+    }
+
+    if (script != NULL) {
+        int ret = loader_port_script(script);
+        return ret ? 1 : 0;
+    }
+    if (monitor_baud_rate) {
+        return loader_port_monitor(monitor_baud_rate, monitor_time) ? 1 : 0;
+    }
+    if (trigger != NULL) {
+        return loader_port_wait_trigger(trigger, boot_log_baud_rate, monitor_time ? monitor_time : BOOT_PROFILE_TIME) ? 1 : 0;
+    }
+    if (bench_link) {
+        return loader_port_bench_link(bench_link == 2) ? 1 : 0;
+    }
+    if (marker != NULL || boot_log) {
+        int ret = 0;
+        if (marker != NULL) {
+            ret = loader_port_boot_profile(marker, boot_log_baud_rate, BOOT_PROFILE_TIME);
+        }
+        if (boot_log && loader_port_boot_log() < 0) {
+            ret = -1;
+        }
+        return ret ? 1 : 0;
+    }
+
+    if (connect_to_target(higher_baud_rate) == ESP_LOADER_SUCCESS)
 	{
 		if (ar_path != NULL) {
 			upload_file(ar_path, 0);
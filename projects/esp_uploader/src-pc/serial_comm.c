@@ -103,6 +103,23 @@ static esp_loader_error_t SLIP_receive_packet(uint8_t *buff, uint32_t size)
 }
 
 
+// whole frames from the serial peripheral if it can, byte by byte otherwise
+static esp_loader_error_t receive_packet(uint8_t *buff, uint32_t size)
+{
+    uint32_t len = size;
+    esp_loader_error_t err;
+
+    err = loader_port_read_frame(buff, &len, loader_port_remaining_time());
+    if (err == ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
+        return SLIP_receive_packet(buff, size);
+    }
+    if (err == ESP_LOADER_SUCCESS && len < size) {
+        return ESP_LOADER_ERROR_INVALID_RESPONSE;
+    }
+    return err;
+}
+
+
 static esp_loader_error_t SLIP_send(const uint8_t *data, uint32_t size)
 {
     uint32_t to_write = 0;
@@ -214,7 +231,7 @@ static esp_loader_error_t check_response(command_t cmd, uint32_t *reg_value, voi
     loader_write_flush();
 
     do {
-        err = SLIP_receive_packet(resp, resp_size);
+        err = receive_packet(resp, resp_size);
         if (err != ESP_LOADER_SUCCESS) {
             return err;
         }
@@ -266,6 +283,19 @@ esp_loader_error_t loader_flash_begin_cmd(uint32_t offset,
 
 esp_loader_error_t loader_flash_data_cmd(const uint8_t *data, uint32_t size)
 {
+    response_t response;
+    esp_loader_error_t err;
+
+    // the serial peripheral may build the packet itself
+    err = loader_port_flash_data(data, size, s_sequence_number, compute_checksum(data, size));
+    if (err != ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
+        if (err != ESP_LOADER_SUCCESS) {
+            return err;
+        }
+        s_sequence_number++;
+        return check_response(FLASH_DATA, NULL, &response, sizeof(response));
+    }
+
     data_command_t data_cmd = {
         .common = {
             .direction = WRITE_DIRECTION,
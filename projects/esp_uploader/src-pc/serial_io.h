@@ -27,6 +27,17 @@ extern "C" {
   */
 esp_loader_error_t loader_port_change_baudrate(uint32_t baudrate);
 
+/**
+  * @brief Returns the rate closest to 'baudrate' the serial peripheral can
+  *        run at, 0 if it can not get near it. Nothing is changed.
+  */
+uint32_t loader_port_nearest_baudrate(uint32_t baudrate);
+
+/**
+  * @brief Returns the current baud rate of serial peripheral.
+  */
+uint32_t loader_port_get_baudrate(void);
+
 /**
   * @brief Writes data to serial interface.
   *
@@ -102,6 +113,42 @@ void loader_port_debug_print(const char *str);
 
 esp_loader_error_t loader_port_write_flush(void);
 
+/**
+  * @brief Passes a FLASH_DATA block to the serial peripheral which builds the
+  *        command packet itself (header, SLIP escaping).
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success, the response is read as usual
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC The packet has to be sent by the caller
+  */
+esp_loader_error_t loader_port_flash_data(const uint8_t *data, uint32_t size, uint32_t sequence, uint8_t checksum);
+
+/**
+  * @brief Reads one whole SLIP frame, decoded, when the serial peripheral
+  *        collects them itself. Up to '*size' bytes are stored, '*size' is
+  *        set to the frame length.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Damaged frame
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC The bytes have to be read and decoded by the caller
+  */
+esp_loader_error_t loader_port_read_frame(uint8_t *data, uint32_t *size, uint32_t timeout);
+
+/**
+  * @brief Resets the target into the boot mode and runs the SYNC handshake
+  *        on the serial peripheral: up to 'trials' SYNC requests, each one
+  *        waiting 'timeout' milliseconds for the reply. The replies are left
+  *        for the caller to read.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT The target did not reply
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Use loader_port_enter_bootloader and send SYNC
+  */
+esp_loader_error_t loader_port_sync(uint32_t timeout, uint32_t trials);
+
 #ifdef __cplusplus
 }
 #endif
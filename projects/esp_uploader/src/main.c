@@ -1,4 +1,5 @@
-// ESP Firmware uploader via CH552/CH551/CH554
+// ESP Firmware uploader via CH552/CH554
+// (not CH551: the buffers take the whole 1KB of XRAM, the CH551 has 512 bytes)
 // !!!!  Must use 3.3V VCC !!!!
 // CH55X max speed 16MHz when running on 3.3V
 
@@ -32,9 +33,33 @@
 #define USB_CUST_CONTROL_DATA_HANDLER       handleVendorDataTransfer()
 #define USB_CUST_SUSPEND_HANDLER            /* no code here */
 
+// extra endpoints on interface 0: EP2 bulk OUT + bulk IN (UART data path),
+// EP1 interrupt IN (UART data ready notification)
+#define EP1_SIZE                            8
+#define EP2_SIZE                            64
+#define USB_CUST_EP_DESC_COUNT              3
+#define USB_CUST_EP_DESC                    \
+    0x07, 0x05, 0x02, 0x02, EP2_SIZE, 0x00, 0x00, /* EP2 OUT, bulk */ \
+    0x07, 0x05, 0x82, 0x02, EP2_SIZE, 0x00, 0x00, /* EP2 IN, bulk */ \
+    0x07, 0x05, 0x81, 0x03, EP1_SIZE, 0x00, 0x01  /* EP1 IN, interrupt, 1ms */
+#define USB_CUST_EP_INIT_HANDLER            initVendorEndpoints()
+#define USB_CUST_EP_TRANSFER_HANDLER        handleVendorEndpointTransfer()
+#define USB_CUST_ISR_ENTER_HANDLER          usbIsrEnter()
+#define USB_CUST_ISR_EXIT_HANDLER           usbIsrExit()
+
+// serial number (string descriptor 3): the chip ID in hex, unique per unit.
+// The handler builds the descriptor in Ep0Buffer and returns its length.
+#define SERIAL_DIGITS                       10
+#define USB_CUST_SERIAL_HANDLER             serialDescriptor()
+
 // function declaration for custom USB transfer handlers
 static uint16_t handleVendorControlTransfer();
 static void handleVendorDataTransfer();
+static void initVendorEndpoints();
+static void handleVendorEndpointTransfer();
+static void usbIsrEnter();
+static void usbIsrExit();
+static uint8_t serialDescriptor();
 
 // USB interrupt handlers - does the most of the USB grunt work
 #include "usb_intr.h"
@@ -59,6 +84,12 @@ SBIT(ESP_BOOT, PORT3, PIN_ESP_BOOT);
 #define PIN_ESP_RESET 4
 SBIT(ESP_RESET, PORT3, PIN_ESP_RESET);
 
+//I2C SDA - P1.5, SCL - P1.7
+#define PIN_I2C_SDA 5
+SBIT(I2C_SDA, PORT1, PIN_I2C_SDA);
+#define PIN_I2C_SCL 7
+SBIT(I2C_SCL, PORT1, PIN_I2C_SCL);
+
 
 
 #define COMMAND_GET_PROGRESS 0
@@ -66,24 +97,423 @@ SBIT(ESP_RESET, PORT3, PIN_ESP_RESET);
 #define COMMAND_WRITE_UART 0x02
 #define COMMAND_SET_GPIO   0x03
 #define COMMAND_SET_BAUDR  0x04
+#define COMMAND_SET_BULK   0x05
+#define COMMAND_GET_UART_STATUS 0x06
+#define COMMAND_GET_BAUDR  0x07
+#define COMMAND_FLASH_FRAME 0x08
+#define COMMAND_SET_RX_FRAMES 0x09
+#define COMMAND_SET_GPIO_SEQ 0x0A
+#define COMMAND_GET_GPIO_SEQ 0x0B
+#define COMMAND_SYNC       0x0C
+#define COMMAND_GET_SYNC   0x0D
+#define COMMAND_GET_QUEUE  0x0E
+#define COMMAND_GET_STATS  0x0F
+#define COMMAND_BOOT_PROFILE     0x10
+#define COMMAND_GET_BOOT_PROFILE 0x11
+#define COMMAND_GET_BOOT_LOG     0x12
+#define COMMAND_SET_LOOPBACK     0x13
+#define COMMAND_SET_UART1        0x14
+#define COMMAND_RUN_SCRIPT       0x15
+#define COMMAND_GET_SCRIPT       0x16
+#define COMMAND_GET_CONFIG       0x17
+#define COMMAND_SET_CONFIG       0x18
+#define COMMAND_SET_TRIGGER      0x19
+#define COMMAND_GET_TRIGGER      0x1A
 
 #define COMMAND_JUMP_TO_BOOTLOADER 0xB0
 
-#define PUT_CHAR(C) while (!TI); TI=0; SBUF = C; 
+// EP1 notification: [0] bytes waiting in the UART read buffer, [1] flags
+#define NOTIFY_LEN         2
+#define NOTIFY_SLIP_END    0x01
+#define NOTIFY_TRIGGER     0x02 // a trigger pattern was received
+
+// COMMAND_SET_BAUDR: the rate is passed in wIndex (high) and wValue (low),
+// with this bit set the rate is only evaluated, see COMMAND_GET_BAUDR
+#define BAUD_PROBE 0x80000000
+// UART0 runs from Timer1 with SMOD set: FREQ_SYS / 16 / divisor
+#define BAUD_CLOCK (FREQ_SYS / 16)
+#define BAUD_DIV_MAX 256
+// the rate mInitSTDIO() really sets
+#define UART0_RATE (BAUD_CLOCK / ((BAUD_CLOCK + UART0_BAUD / 2) / UART0_BAUD))
+
+// FLASH_DATA framing: the host streams [checksum][length lo][length hi] and
+// 'length' image bytes per block, the UART interrupt sends the SLIP packet
+// with the loader header and pads the block up to its size
+#define FLASH_DATA_CMD     0x03
+#define FLASH_DATA_HDR_LEN 24 // command header (8) + data header (16)
+#define SLIP_END           0xC0
+#define SLIP_ESC           0xDB
+#define SLIP_ESC_END       0xDC
+#define SLIP_ESC_ESC       0xDD
+
+// framer states
+#define FRAME_OFF      0
+#define FRAME_CHECKSUM 1 // the block prefix is read from the FIFO
+#define FRAME_LEN_LO   2
+#define FRAME_LEN_HI   3
+#define FRAME_HEADER   4 // delimiter and header
+#define FRAME_DATA     5 // image bytes, then padding, then delimiter
+
+// the requests acted upon in the main loop (SET_GPIO, SET_GPIO_SEQ, SET_BAUDR,
+// SYNC) are queued with wIndex:wValue as the parameter, the size must be a
+// power of two. A full queue stalls the request.
+#define CMD_QUEUE_SIZE 8
+#define CMD_QUEUE_MASK (CMD_QUEUE_SIZE - 1)
+#define CMD_COUNT ((uint8_t)(cmdHead - cmdTail))
+// completion status of a queue entry, see COMMAND_GET_QUEUE
+#define CMD_QUEUED 0
+#define CMD_DONE   1
+#define CMD_FAILED 2
+
+// COMMAND_GET_STATS with this wValue clears the counters after reading them
+#define STATS_CLEAR 1
+
+// Timer0 count (FREQ_SYS / 12 ticks), the high byte is read again to catch a
+// carry from the low byte. A macro: every interrupt gets its own locals.
+#define TIMER0_READ(T) do { \
+        uint8_t th_; \
+        do { \
+            th_ = TH0; \
+            (T) = TL0 | (th_ << 8); \
+        } while (th_ != TH0); \
+    } while (0)
+
+// usbIsrTicks read in a low priority interrupt, again if the USB interrupt
+// changed it between the two bytes
+#define USB_TICKS_READ(T) do { \
+        (T) = usbIsrTicks; \
+    } while ((T) != usbIsrTicks)
+
+// 32 bit Timer0 time: the overflows counted by the Timer0 interrupt above the
+// 16 bit count, an overflow not serviced yet is added. Called with the
+// interrupts disabled or from an interrupt of the Timer0 priority.
+#define TIMER_NOW(T) do { \
+        uint16_t lo_; \
+        TIMER0_READ(lo_); \
+        (T) = ((uint32_t)timer0Overflows << 16) | lo_; \
+        if (TF0 && lo_ < 0x8000) { \
+            (T) += 0x10000; \
+        } \
+    } while (0)
+
+// register bank of the low priority interrupts (UART0, UART1, Timer0) and of
+// the functions they call, so that nothing is pushed on entry. They cannot
+// preempt each other. Bank 0 is main()'s and the USB interrupt's.
+#define LOW_ISR_BANK 2
+
+// LED blink: Timer0 runs free in 16 bit mode from FREQ_SYS / 12 and overflows
+// every ~49ms at 16MHz, the LED toggles after BLINK_TICKS quiet overflows
+#define BLINK_TICKS 4
+
+// boot profile: the reset steps (as in COMMAND_SET_GPIO_SEQ) come in the data
+// stage, the last one releases the ESP. The time of every line end received
+// since then is kept in a ring (Timer0 ticks, the size must be a power of two).
+#define BOOT_TIMES_SIZE 8
+#define BOOT_TIMES_MASK (BOOT_TIMES_SIZE - 1)
+#define BOOT_TIMES_COUNT ((uint8_t)(bootHead - bootTail))
+#define BOOT_TIMES_READ 7 // the most one COMMAND_GET_BOOT_PROFILE returns
+// COMMAND_GET_BOOT_PROFILE with this wValue ends the profiling
+#define BOOT_PROFILE_STOP 1
+
+// boot log recorder: the first bytes received after every ESP reset release,
+// kept until the next release. The header holds the rate at the release and
+// the rate of the first change after it.
+#define BOOT_LOG_SIZE   64
+#define BOOT_LOG_NO_CHANGE 0xFF // no rate change while recording
+// COMMAND_GET_BOOT_LOG: wValue 0 - the header, 1 - the bytes from wIndex
+#define BOOT_LOG_HEADER 0
+#define BOOT_LOG_DATA   1
+
+// GPIO sequence: up to GPIO_SEQ_MAX steps of [pins][delay lo][delay hi], the
+// pins as in COMMAND_SET_GPIO (bit 0 boot, bit 1 reset, bit 2 enable), the
+// delay in microseconds before the next step
+#define GPIO_SEQ_STEP 3
+#define GPIO_SEQ_MAX  (DEFAULT_ENDP0_SIZE / GPIO_SEQ_STEP)
+
+// SYNC handshake: the optional reset steps (as in COMMAND_SET_GPIO_SEQ) come
+// in the data stage, the tries in wValue and the reply timeout (ms) in wIndex
+#define SYNC_IDLE   0
+#define SYNC_BUSY   1
+#define SYNC_DONE   2 // the ROM loader replied
+#define SYNC_FAILED 3 // no reply in all the tries
+// ROM loader reply: [direction 0x01][command 0x08]...
+#define SYNC_REPLY_DIR 0x01
+#define SYNC_REPLY_CMD 0x08
+
+// peripheral script: the ops come in the data stage and run in the main loop,
+// COMMAND_GET_SCRIPT returns the results of all of them at once. An op is
+// the code followed by its operands, the results are appended in order:
+#define SCRIPT_SET       0x01 // [pin][level] - set a P1 pin
+#define SCRIPT_GET       0x02 // [pin] -> [level]
+#define SCRIPT_ADC       0x03 // [channel 0 or 2] -> [8 bit sample]
+#define SCRIPT_I2C_WRITE 0x04 // [address][n][n bytes] -> [ack]
+#define SCRIPT_I2C_READ  0x05 // [address][n] -> [ack][n bytes]
+#define SCRIPT_I2C_REG   0x06 // [address][register][n] -> [ack][n bytes]
+#define SCRIPT_DELAY     0x07 // [us lo][us hi]
+// the P1 pins a script may touch: P1.1, P1.5, P1.6, P1.7 (the rest belong to
+// the LED and the ESP)
+#define SCRIPT_PINS      0xE2
+#define SCRIPT_MAX       32
+#define SCRIPT_RESULT_MAX (DEFAULT_ENDP0_SIZE - 2)
+// I2C_* ack result, the read bytes of a refused transfer are 0xFF
+#define I2C_ACK 0
+#define I2C_NAK 1
+// half of the ~100kHz I2C clock
+#define I2C_DELAY_US 5
+#define SCRIPT_IDLE   0
+#define SCRIPT_BUSY   1
+#define SCRIPT_DONE   2
+#define SCRIPT_FAILED 3 // bad op, pin, channel or too many results
+// bridge config: CONFIG_LEN bytes kept in the DataFlash for the host (serial
+// settings, reset timing, a label - the layout is the host's business, see
+// libusb_port.c). Only the even DataFlash addresses hold data, the written
+// bytes go through the shared buffer below.
+#define CONFIG_LEN 32
+// the GPIO sequence, the script and the config being written share a buffer
+#define STEPS_BUSY (gpioSeqLeft || scriptState == SCRIPT_BUSY || configWriting)
+
+// pattern trigger: up to TRIGGER_MAX patterns of up to TRIGGER_LEN bytes are
+// matched in the UART interrupt against every byte received (before the SLIP
+// receive mode). COMMAND_SET_TRIGGER passes the lengths in wValue (low byte
+// pattern 0, high byte pattern 1, 0 - unused) and the patterns in the data
+// stage, TRIGGER_LEN bytes each; it is queued, the time and the byte count
+// start when it is done, the time again at an ESP reset release. The first
+// hit disarms all the patterns and is sent as an EP1 notification.
+#define TRIGGER_MAX  2
+#define TRIGGER_LEN  16 // also the size of the history, a power of two
+#define TRIGGER_MASK (TRIGGER_LEN - 1)
+#define TRIGGER_IDLE  0
+#define TRIGGER_ARMED 1
+#define TRIGGER_HIT   2
+
+// SLIP receive mode: only whole frames between 0xC0 delimiters get into the
+// read ring, decoded and stored as [length][RX_FRAME_* flags][payload]
+#define RX_FRAME_ESCAPE    0x01 // invalid escape sequence
+#define RX_FRAME_TRUNCATED 0x02 // the frame did not fit into the read ring
+
+// receiver states
+#define RX_FRAME_IDLE 0 // between frames, the bytes are noise
+#define RX_FRAME_OPEN 1 // storing the payload after the header slot
+#define RX_FRAME_DROP 2 // no room for the header, skipping to the delimiter
+
+// UART read buffer: a ring, the size must be a power of two
+#define RX_RING_SIZE 128
+#define RX_RING_MASK (RX_RING_SIZE - 1)
+#define RX_COUNT ((uint8_t)(rxHead - rxTail))
+
+// UART1 capture: the ESP8266 logs on its UART1 (GPIO2), received on RXD1
+// (P1.6) into a ring of its own. While it runs the raw read data are sent
+// as tagged frames: [channel | length][bytes], a USB packet holds whole
+// frames. The SLIP receive mode leaves UART1 out.
+#define U1_RING_SIZE 32
+#define U1_RING_MASK (U1_RING_SIZE - 1)
+#define U1_COUNT ((uint8_t)(u1Head - u1Tail))
+#define MUX_CHANNEL1 0x80
+#define UART1_MUX (uart1On && !rxFrames)
+// data waiting for the host
+#define RX_PENDING (RX_COUNT || (UART1_MUX && U1_COUNT))
+
+// UART write buffer: 256 bytes so that the uint8_t indices wrap around on
+// their own, one byte is kept free to tell a full FIFO from an empty one
+#define TX_FIFO_SIZE 256
+#define TX_COUNT ((uint8_t)(txHead - txTail))
+#define TX_FREE  (TX_FIFO_SIZE - 1 - TX_COUNT)
+
+// every byte sent goes through here, the loopback takes it from txLast
+#define UART_SEND(C) do { \
+        txLast = (C); \
+        SBUF = txLast; \
+    } while (0)
+
+// UART status flags, see COMMAND_GET_UART_STATUS
+#define UART_RX_OVERFLOW 0x01 // received bytes were dropped since the last status
+#define UART_TX_OVERFLOW 0x02 // written bytes were dropped: more than the free space was sent
+#define UART_TX_BUSY     0x04 // the FIFO or the shift register still holds data
+
+// XRAM map
+// 0x000 - 0x01F : EP0 buffer
+// 0x020 - 0x037 : FLASH_DATA header
+// 0x038 - 0x055 : GPIO sequence
+// 0x038 - 0x057 : peripheral script (shares the GPIO sequence buffer)
+// 0x038 - 0x057 : bridge config being written (shares it too)
+// 0x060 - 0x07F : UART1 read ring
+// 0x080 - 0x0FF : UART read ring
+// 0x100 - 0x1FF : EP2 buffers: OUT 0, OUT 1, IN 0, IN 1 (64 bytes each)
+// 0x200 - 0x2FF : UART write FIFO
+// 0x300 - 0x32F : command queue
+// 0x330 - 0x33D : statistics
+// 0x340 - 0x35F : boot profile line times
+// 0x360 - 0x37D : peripheral script results
+// 0x380 - 0x3C7 : boot log recorder
+// 0x3C8 - 0x3D7 : trigger history
+// 0x3D8 - 0x3F7 : trigger patterns
+// 0x3F8 - 0x3FF : EP1 buffer
+__xdata __at (0x0020) uint8_t frameHdr[FLASH_DATA_HDR_LEN];
+__xdata __at (0x0038) uint8_t gpioSeq[GPIO_SEQ_MAX * GPIO_SEQ_STEP];
+__xdata __at (0x0038) uint8_t script[SCRIPT_MAX];
+__xdata __at (0x0038) uint8_t configBuf[CONFIG_LEN];
+__xdata __at (0x0060) uint8_t u1Ring[U1_RING_SIZE];
+__xdata __at (0x0080) uint8_t rxRing[RX_RING_SIZE];
+__xdata __at (0x0100) uint8_t ep2Buf[4 * EP2_SIZE];
+__xdata __at (0x0200) uint8_t txFifo[TX_FIFO_SIZE];
+__xdata __at (0x0300) uint32_t cmdParam[CMD_QUEUE_SIZE];
+__xdata __at (0x0320) uint8_t cmdType[CMD_QUEUE_SIZE];
+__xdata __at (0x0328) uint8_t cmdStatus[CMD_QUEUE_SIZE];
+__xdata __at (0x0330) uint32_t usbRequests;  // vendor control requests served
+__xdata __at (0x0334) uint16_t rxFrameErrors; // received SLIP frames with a bad escape
+__xdata __at (0x033A) uint8_t txMaxDepth;     // most bytes held in the write FIFO
+__xdata __at (0x033C) uint16_t u1Overflows;   // UART1 bytes dropped because the ring was full
+__xdata __at (0x0340) uint32_t bootTimes[BOOT_TIMES_SIZE];
+__xdata __at (0x0360) uint8_t scriptResults[SCRIPT_RESULT_MAX];
+__xdata __at (0x0380) uint32_t bootLogRate[2]; // at the release, after the change
+__xdata __at (0x0388) uint8_t bootLog[BOOT_LOG_SIZE];
+__xdata __at (0x03C8) uint8_t triggerHist[TRIGGER_LEN]; // the last bytes received
+__xdata __at (0x03D8) uint8_t triggerPat[TRIGGER_MAX * TRIGGER_LEN];
+__xdata __at (0x03F8) uint8_t ep1Buf[EP1_SIZE];
+
+// bulk OUT: the oldest OUT packet fits into the UART write FIFO and no baud
+// rate change waits for the bytes written before it
+#define BULK_OUT_READY (ep2OutLen[ep2OutHead] && ep2OutLen[ep2OutHead] <= TX_FREE && !baudPending)
 
-__xdata __at (0x0020) uint8_t uartBufW[DEFAULT_ENDP0_SIZE]; 
-__xdata __at (0x0040) uint8_t uartBufR[DEFAULT_ENDP0_SIZE]; 
+#define EP2_OUT_BUF(I) (ep2Buf + (I) * EP2_SIZE)
+#define EP2_IN_BUF(I)  (ep2Buf + (2 + (I)) * EP2_SIZE)
 
 //volatile __idata uint16_t blinkTime = 250;
-volatile __idata uint8_t command;
-volatile __idata uint8_t bufLenW;
-volatile __idata uint8_t bufLenR;
+// command queue: the head is written by the USB interrupt, the tail by the
+// main loop once the entry is done
+volatile __idata uint8_t cmdHead;
+volatile __idata uint8_t cmdTail;
 
-volatile __idata uint8_t inProgress;
-uint8_t data;
+// UART read ring: free running indices, the head is written only by the
+// UART interrupt, the tail only by the readers
+volatile __idata uint8_t rxHead;
+volatile __idata uint8_t rxTail;
+// number of received bytes dropped because the ring was full
+volatile __idata uint16_t rxOverflows;
+// rxOverflows at the last status request
+__idata uint16_t rxOverflowsSeen;
+// UART1 capture: the ring indices as above, whether it runs and the channel
+// the next packet starts with
+volatile __idata uint8_t u1Head;
+volatile __idata uint8_t u1Tail;
+volatile __idata uint8_t uart1On;
+__idata uint8_t muxFirst;
+
+// UART write FIFO: the head is written by the producers (USB interrupt or
+// main loop with the interrupts disabled), the tail by the UART interrupt
+volatile __idata uint8_t txHead;
+volatile __idata uint8_t txTail;
+// nothing is being sent, the next write has to kick off the UART interrupt
+volatile __idata uint8_t txIdle;
+// UART_TX_OVERFLOW, cleared by the status request
+volatile __idata uint8_t uartFlags;
+
+// bulk OUT: data length of each OUT buffer (0 - buffer is free)
+volatile __idata uint8_t ep2OutLen[2];
+// bulk OUT: index of the OUT buffer to be sent to UART next
+volatile __idata uint8_t ep2OutHead;
+// bulk IN: a packet is armed and waits for the host
+volatile __idata uint8_t ep2InBusy;
+// bulk IN: the host reads UART data via EP2 instead of COMMAND_READ_UART
+volatile __idata uint8_t bulkMode;
+// interrupt IN: a notification is armed and waits for the host
+volatile __idata uint8_t ep1Busy;
+// GPIO sequence steps not executed yet
+volatile __idata uint8_t gpioSeqLeft;
+// peripheral script: its state, length, the ops done and the result bytes
+volatile __idata uint8_t scriptState;
+__idata uint8_t scriptLen;
+__idata uint8_t scriptOps;
+__idata uint8_t scriptResultLen;
+// COMMAND_SET_CONFIG waits for the main loop to write the DataFlash
+volatile __idata uint8_t configWriting;
+// pattern trigger: TRIGGER_* state, the pattern lengths, the pattern hit, a
+// hit notification waiting for EP1, the time of the arming or of the ESP
+// reset release after it (then the time of the hit since) and the bytes
+// received since the arming
+volatile __idata uint8_t triggerState;
+__idata uint8_t triggerLen[TRIGGER_MAX];
+__idata uint8_t triggerHit;
+volatile __idata uint8_t triggerNotify;
+__idata uint32_t triggerTime;
+__idata uint32_t triggerCount;
+// SLIP receive mode and the frame being received
+volatile __idata uint8_t rxFrames;
+__idata uint8_t rxFrameState;
+__idata uint8_t rxFrameEscape;
+__idata uint8_t rxFrameStart; // ring index of the header slot
+__idata uint8_t rxFrameLen;
+__idata uint8_t rxFrameFlags;
+// SYNC handshake run by the main loop
+volatile __idata uint8_t syncState;
+volatile __idata uint8_t syncSeen; // set by the UART interrupt on a SYNC reply
+__idata uint8_t syncTries;
+__idata uint16_t syncElapsed; // ms from the first SYNC request to the reply
+// the last byte sent and the software loopback: the receiver is off and the
+// sent bytes are received instead
+__idata uint8_t txLast;
+volatile __idata uint8_t loopback;
+// second byte of an escaped SLIP character waiting for the transmitter
+volatile __idata uint8_t txEscape;
+// FLASH_DATA framer, runs in the UART interrupt
+volatile __idata uint8_t frameState;
+__idata uint8_t frameIndex;
+__idata uint8_t framePad;
+__idata uint8_t frameChecksum;
+__idata uint16_t frameBlockSize;
+__idata uint16_t frameDataLen; // image bytes of the block left in the stream
+__idata uint16_t frameLeft;    // bytes of the block left to send
+__idata uint32_t frameSeq;
+// UART bytes sent and received, counted in the UART interrupt
+volatile __idata uint32_t uartTxBytes;
+volatile __idata uint32_t uartRxBytes;
+// the UART interrupt clears its own counters: a 32 bit update there must not
+// be torn by the USB interrupt
+volatile __idata uint8_t statsClear;
+// longest UART interrupt (the USB interrupts taken meanwhile left out) and
+// USB interrupt (Timer0 ticks), compared on every call. usbIsrTicks adds up
+// the USB interrupt time for the UART interrupt to subtract.
+volatile __idata uint16_t uartIsrMax;
+__idata uint16_t usbIsrMax;
+__idata uint16_t usbIsrStart;
+volatile __idata uint16_t usbIsrTicks;
+// Timer0 overflows, the upper half of the 32 bit time
+volatile __idata uint16_t timer0Overflows;
+// boot profile: the line times ring (the head is written by the UART
+// interrupt, the tail by the USB interrupt), the release time and whether
+// line times were dropped
+volatile __idata uint8_t bootProfiling;
+volatile __idata uint8_t bootHead;
+volatile __idata uint8_t bootTail;
+volatile __idata uint8_t bootLost;
+__idata uint32_t bootStart;
+// boot log recorder: bytes recorded, where the rate changed, releases seen
+volatile __idata uint8_t bootLogLen;
+__idata uint8_t bootLogChange;
+__idata uint8_t bootLogResets;
+// current UART0 rate
+__idata uint32_t uartRate;
+// queued baud rate changes (probes included)
+volatile __idata uint8_t baudPending;
+// rate achieved for the last request (0: not done yet) and its error in 0.1%
+volatile __idata uint32_t baudResult;
+volatile __idata int16_t baudError;
 uint8_t p1State, p1Pu, p3State, p3Pu;
 
 
+// SYNC request of the ROM loader, SLIP encoded: command 0x08, 36 bytes of
+// data (0x07 0x07 0x12 0x20 followed by 32 x 0x55), no checksum
+__code uint8_t syncFrame[] = {
+    SLIP_END,
+    0x00, 0x08, 0x24, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x07, 0x07, 0x12, 0x20,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    SLIP_END
+};
+
 /*******************************************************************************
 * Jump to bootloader
 *******************************************************************************/
@@ -93,8 +523,9 @@ static void jumpToBootloader()
     EA = 0;
 
     IP_EX &= ~bIP_USB; //remove USB interrupt priority
-    GPIO_IE &= ~bIE_RXD0_LO; //disable UART0 RX interrupt
-    IE_GPIO = 0; //disable GPIO interrupts
+    ES = 0; //disable UART0 interrupt
+    IE_UART1 = 0;
+    ET0 = 0;
 
     USB_INT_EN = 0;
     USB_CTRL = 0x6;
@@ -103,6 +534,247 @@ static void jumpToBootloader()
     bootloader();
 }
 
+// copy 'len' bytes between XRAM buffers with the two data pointers of the
+// CH55x: DPTR0 reads, DPTR1 writes and XBUS_AUX makes both increment by
+// themselves. Called from the USB interrupt or with the interrupts disabled,
+// nothing else switches the pointers or turns on the auto increment.
+#if defined(__SDCC_mcs51)
+static void xramCopy(__xdata uint8_t* dst, __xdata uint8_t* src, uint8_t len) __naked
+{
+    dst; src; len;
+    __asm
+        mov     a, _xramCopy_PARM_3
+        jz      00102$
+        mov     r7, a
+        mov     r2, dpl
+        mov     r3, dph
+        orl     _XBUS_AUX, #(bDPTR_AUTO_INC | DPS)
+        mov     dpl, r2
+        mov     dph, r3
+        anl     _XBUS_AUX, #~DPS
+        mov     dpl, _xramCopy_PARM_2
+        mov     dph, (_xramCopy_PARM_2 + 1)
+    00101$:
+        movx    a, @dptr
+        inc     _XBUS_AUX
+        movx    @dptr, a
+        dec     _XBUS_AUX
+        djnz    r7, 00101$
+        anl     _XBUS_AUX, #~bDPTR_AUTO_INC
+    00102$:
+        ret
+    __endasm;
+}
+#else
+static void xramCopy(__xdata uint8_t* dst, __xdata uint8_t* src, uint8_t len)
+{
+    while (len--) {
+        *dst++ = *src++;
+    }
+}
+#endif
+
+// move up to 'max' bytes from the UART read ring to 'dst', returns the count
+// called from the USB interrupt or with the interrupts disabled
+static uint8_t readRxRing(__xdata uint8_t* dst, uint8_t max)
+{
+    uint8_t l = RX_COUNT;
+    uint8_t t = rxTail & RX_RING_MASK;
+    uint8_t n;
+
+    if (l > max) {
+        l = max;
+    }
+    // up to the end of the ring, then the rest from its start
+    n = RX_RING_SIZE - t < l ? RX_RING_SIZE - t : l;
+    xramCopy(dst, rxRing + t, n);
+    xramCopy(dst + n, rxRing, l - n);
+    rxTail += l;
+    return l;
+}
+
+// the same for the UART1 read ring
+static uint8_t readU1Ring(__xdata uint8_t* dst, uint8_t max)
+{
+    uint8_t l = U1_COUNT;
+    uint8_t t = u1Tail & U1_RING_MASK;
+    uint8_t n;
+
+    if (l > max) {
+        l = max;
+    }
+    n = U1_RING_SIZE - t < l ? U1_RING_SIZE - t : l;
+    xramCopy(dst, u1Ring + t, n);
+    xramCopy(dst + n, u1Ring, l - n);
+    u1Tail += l;
+    return l;
+}
+
+// one tagged frame of the channel's data, returns its length (0: no data)
+static uint8_t readMuxFrame(__xdata uint8_t* dst, uint8_t max, uint8_t channel)
+{
+    uint8_t l;
+
+    if (max < 2) {
+        return 0;
+    }
+    l = channel ? readU1Ring(dst + 1, max - 1) : readRxRing(dst + 1, max - 1);
+    if (!l) {
+        return 0;
+    }
+    dst[0] = channel | l;
+    return l + 1;
+}
+
+// the data for the host: raw bytes or, while UART1 is captured, tagged frames
+// of both channels, the one going first alternates so that neither starves.
+// Called from the USB interrupt or with the interrupts disabled.
+static uint8_t readUartData(__xdata uint8_t* dst, uint8_t max)
+{
+    uint8_t l;
+
+    if (!UART1_MUX) {
+        return readRxRing(dst, max);
+    }
+    muxFirst ^= MUX_CHANNEL1;
+    l = readMuxFrame(dst, max, muxFirst);
+    return l + readMuxFrame(dst + l, max - l, muxFirst ^ MUX_CHANNEL1);
+}
+
+// queue 'len' bytes for sending to UART, a write that does not fit is dropped
+// called from the USB interrupt or with the interrupts disabled
+static void pushTx(__xdata uint8_t* buf, uint8_t len)
+{
+    uint8_t h = txHead;
+    uint8_t n;
+
+    if (len > TX_FREE) {
+        uartFlags |= UART_TX_OVERFLOW;
+        return;
+    }
+    // up to the end of the FIFO, then the rest from its start
+    n = TX_FIFO_SIZE - h < len ? TX_FIFO_SIZE - h : len;
+    xramCopy(txFifo + h, buf, n);
+    xramCopy(txFifo, buf + n, len - n);
+    txHead = h + len;
+    if (TX_COUNT > txMaxDepth) {
+        txMaxDepth = TX_COUNT;
+    }
+    if (txIdle) {
+        txIdle = 0;
+        TI = 1; // the UART interrupt sends the first byte
+    }
+}
+
+// queue the current request with wIndex:wValue as the parameter, the caller
+// has checked there is room. Called from the USB interrupt.
+static void queueCommand(uint32_t param)
+{
+    uint8_t slot = cmdHead & CMD_QUEUE_MASK;
+
+    cmdType[slot] = UsbIntrSetupReq;
+    cmdParam[slot] = param;
+    cmdStatus[slot] = CMD_QUEUED;
+    cmdHead++;
+}
+
+// the current request as the queue parameter
+static uint32_t setupParam()
+{
+    return ((uint32_t)(UsbSetupBuf->wIndexH << 8 | UsbSetupBuf->wIndexL) << 16) |
+        (UsbSetupBuf->wValueH << 8 | UsbSetupBuf->wValueL);
+}
+
+/*******************************************************************************
+* Serial number string descriptor built in Ep0Buffer from the chip ID: the
+* valid byte at ROM_CHIP_ID_HX and the 32 bit ID below it, SERIAL_DIGITS hex
+* digits with the most significant first. Called from the USB interrupt.
+*
+* Returns : the length of the descriptor
+*******************************************************************************/
+static uint8_t serialDescriptor()
+{
+    uint16_t hi = *(__code uint16_t*)ROM_CHIP_ID_HI;
+    uint16_t lo = *(__code uint16_t*)ROM_CHIP_ID_LO;
+    uint8_t id[5];
+    uint8_t i;
+
+    id[0] = *(__code uint8_t*)ROM_CHIP_ID_HX;
+    id[1] = hi >> 8;
+    id[2] = hi & 0xFF;
+    id[3] = lo >> 8;
+    id[4] = lo & 0xFF;
+    Ep0Buffer[0] = 2 + 2 * SERIAL_DIGITS;
+    Ep0Buffer[1] = USB_DESCR_TYP_STRING;
+    for (i = 0; i < SERIAL_DIGITS; i++) {
+        uint8_t d = (i & 1) ? id[i >> 1] & 0x0F : id[i >> 1] >> 4;
+        Ep0Buffer[2 + 2 * i] = d < 10 ? '0' + d : 'A' - 10 + d;
+        Ep0Buffer[3 + 2 * i] = 0; // UTF-16LE
+    }
+    return 2 + 2 * SERIAL_DIGITS;
+}
+
+// one DataFlash command (ROM_CMD_READ or ROM_CMD_WRITE) on the config byte at
+// 'offset', the byte is in ROM_DATA_L. Returns 0 if the chip refused it, a
+// write also needs the address to be valid (write enabled).
+static uint8_t dataFlashCommand(uint8_t offset, uint8_t cmd)
+{
+    uint8_t status;
+
+    ROM_ADDR_H = DATA_FLASH_ADDR >> 8;
+    ROM_ADDR_L = offset << 1;
+    ROM_CTRL = cmd;
+    status = ROM_STATUS;
+    return !(status & bROM_CMD_ERR) && (cmd == ROM_CMD_READ || (status & bROM_ADDR_OK));
+}
+
+// the bridge config from the DataFlash, returns 0 if it can not be read.
+// Called from the USB interrupt while no config is being written.
+static uint8_t readConfig(__xdata uint8_t* dst)
+{
+    uint8_t i;
+
+    for (i = 0; i < CONFIG_LEN; i++) {
+        if (!dataFlashCommand(i, ROM_CMD_READ)) {
+            return 0;
+        }
+        dst[i] = ROM_DATA_L;
+    }
+    return 1;
+}
+
+// DataFlash write enable, the safe mode must not be broken by an interrupt
+static void dataFlashWrite(uint8_t on)
+{
+    EA = 0;
+    SAFE_MOD = 0x55;
+    SAFE_MOD = 0xAA;
+    GLOBAL_CFG = on ? GLOBAL_CFG | bDATA_WE : GLOBAL_CFG & ~bDATA_WE;
+    SAFE_MOD = 0;
+    EA = 1;
+}
+
+// writes configBuf to the DataFlash. Only the bytes that differ are written:
+// the CPU stalls while a byte is programmed. Returns 1 if all read back right.
+static uint8_t writeConfig(void)
+{
+    uint8_t ok = 1;
+    uint8_t i;
+
+    dataFlashWrite(1);
+    for (i = 0; ok && i < CONFIG_LEN; i++) {
+        uint8_t c = configBuf[i];
+        ok = dataFlashCommand(i, ROM_CMD_READ);
+        if (ok && ROM_DATA_L != c) {
+            ROM_DATA_L = c;
+            ok = dataFlashCommand(i, ROM_CMD_WRITE) &&
+                dataFlashCommand(i, ROM_CMD_READ) && ROM_DATA_L == c;
+        }
+    }
+    dataFlashWrite(0);
+    return ok;
+}
+
 /*******************************************************************************
 * Handler of the vendor Control transfer requests sent from the Host to 
 * Endpoint 0
@@ -112,35 +784,321 @@ static void jumpToBootloader()
 
 static uint16_t handleVendorControlTransfer()
 {
+    usbRequests++;
+
+    switch (UsbIntrSetupReq) {
+        case COMMAND_SET_GPIO :
+        case COMMAND_SET_GPIO_SEQ :
+        case COMMAND_SET_BAUDR :
+        case COMMAND_SYNC :
+        case COMMAND_BOOT_PROFILE :
+        case COMMAND_SET_UART1 :
+        case COMMAND_RUN_SCRIPT :
+        case COMMAND_SET_CONFIG :
+        case COMMAND_SET_TRIGGER : {
+            if (CMD_COUNT == CMD_QUEUE_SIZE) {
+                return 0xFF; // the host has to wait for COMMAND_GET_QUEUE
+            }
+            // one queue entry per request: the data stage must be one packet
+            if (UsbSetupBuf->wLengthH || UsbSetupBuf->wLengthL > DEFAULT_ENDP0_SIZE) {
+                return 0xFF;
+            }
+        } break;
+    }
+
     switch (UsbIntrSetupReq) {
         case COMMAND_GET_PROGRESS : {
-            Ep0Buffer[0] = inProgress;
+            Ep0Buffer[0] = (TX_COUNT || !txIdle) ? 1 : 0;
             return 1;
         } break;
         case COMMAND_READ_UART : {
-            uint8_t l;
-            if (0 == bufLenR) {
-                return 0;
-            }
-            for (l = 0; l< bufLenR;l++) {
-                Ep0Buffer[l] = uartBufR[l];
-            }
-            bufLenR = 0;
-            return  l; //'l' is set in the 'for' loop 
+            return readUartData(Ep0Buffer, DEFAULT_ENDP0_SIZE);
         } break;
         case COMMAND_WRITE_UART : {
+            //the bytes must not go out before the queued baud rate changes
+            if (baudPending) {
+                return 0xFF;
+            }
             //nothing to do, just wait for the data and confirm this transfer by returning 0
         } break;
         case COMMAND_SET_GPIO : {
-            data = UsbSetupBuf->wValueL;
-            if (data == 0) {
+            if (UsbSetupBuf->wValueL == 0) {
                 ESP_RESET = 0; //priority ESP reset
             }
-            command = COMMAND_SET_GPIO;
+            queueCommand(setupParam());
+        } break;
+        // the steps come in the data stage, see handleVendorDataTransfer()
+        case COMMAND_SET_GPIO_SEQ : {
+            if (STEPS_BUSY) {
+                return 0xFF; // the previous sequence still runs
+            }
+        } break;
+        // [0] steps of the running sequence left (0 - done)
+        case COMMAND_GET_GPIO_SEQ : {
+            Ep0Buffer[0] = gpioSeqLeft;
+            return 1;
+        } break;
+        // reset steps (if any) come in the data stage, see handleVendorDataTransfer()
+        case COMMAND_SYNC : {
+            if (syncState == SYNC_BUSY || STEPS_BUSY) {
+                return 0xFF;
+            }
+            if (!UsbSetupBuf->wLengthL) {
+                syncState = SYNC_BUSY;
+                queueCommand(setupParam());
+            }
+        } break;
+        // [0] SYNC_* state, [1] SYNC requests sent, [2..3] ms from the first
+        // request to the reply (LSB first), valid once the state is not busy
+        case COMMAND_GET_SYNC : {
+            Ep0Buffer[0] = syncState;
+            Ep0Buffer[1] = syncTries;
+            Ep0Buffer[2] = syncElapsed & 0xFF;
+            Ep0Buffer[3] = syncElapsed >> 8;
+            return 4;
         } break;
         case COMMAND_SET_BAUDR : {
-            data = UsbSetupBuf->wValueL;
-            command = COMMAND_SET_BAUDR;
+            uint32_t rate = setupParam();
+            // older hosts: 0 - 74880, 1 - 115200
+            if (rate < 2) {
+                rate = rate ? 115200 : 74880;
+            }
+            baudResult = 0;
+            baudPending++;
+            queueCommand(rate);
+        } break;
+        // the reset steps come in the data stage, see handleVendorDataTransfer()
+        case COMMAND_BOOT_PROFILE : {
+            if (STEPS_BUSY || !UsbSetupBuf->wLengthL) {
+                return 0xFF;
+            }
+        } break;
+        // the ops come in the data stage, see handleVendorDataTransfer()
+        case COMMAND_RUN_SCRIPT : {
+            if (STEPS_BUSY || !UsbSetupBuf->wLengthL) {
+                return 0xFF;
+            }
+        } break;
+        // [0] SCRIPT_* state, [1] ops done, [2..] their results once the
+        // state is not busy
+        case COMMAND_GET_SCRIPT : {
+            uint8_t n = scriptState == SCRIPT_BUSY ? 0 : scriptResultLen;
+            Ep0Buffer[0] = scriptState;
+            Ep0Buffer[1] = scriptOps;
+            xramCopy(Ep0Buffer + 2, scriptResults, n);
+            return 2 + n;
+        } break;
+        // [0..] the CONFIG_LEN bytes of the bridge config, as last written
+        case COMMAND_GET_CONFIG : {
+            if (configWriting || !readConfig(Ep0Buffer)) {
+                return 0xFF;
+            }
+            return CONFIG_LEN;
+        } break;
+        // the CONFIG_LEN bytes come in the data stage, see handleVendorDataTransfer()
+        case COMMAND_SET_CONFIG : {
+            if (STEPS_BUSY || UsbSetupBuf->wLengthL != CONFIG_LEN) {
+                return 0xFF;
+            }
+        } break;
+        // the patterns (if any) come in the data stage, see handleVendorDataTransfer()
+        case COMMAND_SET_TRIGGER : {
+            uint8_t l0 = UsbSetupBuf->wValueL;
+            uint8_t l1 = UsbSetupBuf->wValueH;
+            if (l0 > TRIGGER_LEN || l1 > TRIGGER_LEN ||
+                UsbSetupBuf->wLengthL != (l0 || l1 ? TRIGGER_MAX * TRIGGER_LEN : 0)) {
+                return 0xFF;
+            }
+            // the old patterns are off before the new ones come in
+            triggerState = TRIGGER_IDLE;
+            if (!UsbSetupBuf->wLengthL) {
+                queueCommand(0);
+            }
+        } break;
+        // [0] TRIGGER_* state, [1] the pattern hit, [2..5] Timer0 ticks from
+        // the arming (or the ESP reset release) to the hit, [6..9] bytes
+        // received since the arming, the last one of the pattern included
+        // (all LSB first, valid after a hit)
+        case COMMAND_GET_TRIGGER : {
+            Ep0Buffer[0] = triggerState;
+            Ep0Buffer[1] = triggerHit;
+            Ep0Buffer[2] = triggerTime & 0xFF;
+            Ep0Buffer[3] = (triggerTime >> 8) & 0xFF;
+            Ep0Buffer[4] = (triggerTime >> 16) & 0xFF;
+            Ep0Buffer[5] = triggerTime >> 24;
+            Ep0Buffer[6] = triggerCount & 0xFF;
+            Ep0Buffer[7] = (triggerCount >> 8) & 0xFF;
+            Ep0Buffer[8] = (triggerCount >> 16) & 0xFF;
+            Ep0Buffer[9] = triggerCount >> 24;
+            return 10;
+        } break;
+        // [0] count of the line times that follow, [1] 1 if line times were
+        // dropped, [2..] line times in Timer0 ticks since the release (4 bytes
+        // each, LSB first); the returned times are removed
+        case COMMAND_GET_BOOT_PROFILE : {
+            uint8_t n = BOOT_TIMES_COUNT;
+            uint8_t i;
+            __xdata uint8_t* p = Ep0Buffer + 2;
+            if (n > BOOT_TIMES_READ) {
+                n = BOOT_TIMES_READ;
+            }
+            for (i = 0; i < n; i++) {
+                uint32_t t = bootTimes[bootTail & BOOT_TIMES_MASK];
+                bootTail++;
+                p[0] = t & 0xFF;
+                p[1] = (t >> 8) & 0xFF;
+                p[2] = (t >> 16) & 0xFF;
+                p[3] = t >> 24;
+                p += 4;
+            }
+            Ep0Buffer[0] = n;
+            Ep0Buffer[1] = bootLost;
+            if (UsbSetupBuf->wValueL == BOOT_PROFILE_STOP) {
+                bootProfiling = 0;
+            }
+            return 2 + n * 4;
+        } break;
+        // BOOT_LOG_HEADER: [0] bytes recorded since the last ESP reset release,
+        // [1] offset of the rate change (BOOT_LOG_NO_CHANGE: none), [2] releases
+        // since power on, [3..6] rate at the release, [7..10] rate after the
+        // change (LSB first); BOOT_LOG_DATA: the bytes from offset wIndex
+        case COMMAND_GET_BOOT_LOG : {
+            uint8_t o = UsbSetupBuf->wIndexL;
+            uint8_t n = bootLogLen;
+            if (UsbSetupBuf->wValueL == BOOT_LOG_DATA) {
+                if (o >= n) {
+                    return 0;
+                }
+                n -= o;
+                if (n > DEFAULT_ENDP0_SIZE) {
+                    n = DEFAULT_ENDP0_SIZE;
+                }
+                xramCopy(Ep0Buffer, bootLog + o, n);
+                return n;
+            }
+            Ep0Buffer[0] = n;
+            Ep0Buffer[1] = bootLogChange;
+            Ep0Buffer[2] = bootLogResets;
+            xramCopy(Ep0Buffer + 3, (__xdata uint8_t*)bootLogRate, 8);
+            return 11;
+        } break;
+        // [0] queue head, [1] queue tail (entries are numbered by the head at
+        // the time they were queued, free running), [2..9] CMD_* status of
+        // each slot
+        case COMMAND_GET_QUEUE : {
+            Ep0Buffer[0] = cmdHead;
+            Ep0Buffer[1] = cmdTail;
+            xramCopy(Ep0Buffer + 2, cmdStatus, CMD_QUEUE_SIZE);
+            return 2 + CMD_QUEUE_SIZE;
+        } break;
+        // start (descriptor in the data stage) or stop (no data) the
+        // FLASH_DATA framing, it starts with the UART write path drained
+        case COMMAND_FLASH_FRAME : {
+            if (!UsbSetupBuf->wLengthL) {
+                frameState = FRAME_OFF;
+            } else
+            if (TX_COUNT || ep2OutLen[0] || ep2OutLen[1]) {
+                return 0xFF;
+            }
+        } break;
+        // 1 - SLIP receive mode, 0 - raw bytes; the read ring is emptied
+        case COMMAND_SET_RX_FRAMES : {
+            rxFrames = UsbSetupBuf->wValueL;
+            rxFrameState = RX_FRAME_IDLE;
+            rxTail = rxHead;
+        } break;
+        // [0..3] rate achieved for the last SET_BAUDR (LSB first, 0 while
+        // pending), [4..5] its error against the requested rate in 0.1%
+        case COMMAND_GET_BAUDR : {
+            Ep0Buffer[0] = baudResult & 0xFF;
+            Ep0Buffer[1] = (baudResult >> 8) & 0xFF;
+            Ep0Buffer[2] = (baudResult >> 16) & 0xFF;
+            Ep0Buffer[3] = baudResult >> 24;
+            Ep0Buffer[4] = baudError & 0xFF;
+            Ep0Buffer[5] = baudError >> 8;
+            return 6;
+        } break;
+        // [0..3] UART bytes sent, [4..7] UART bytes received, [8..9] received
+        // bytes dropped, [10..11] SLIP frames with a bad escape, [12..15] vendor
+        // requests served, [16..17] longest UART interrupt, [18..19] longest
+        // USB interrupt (both in FREQ_SYS / 12 ticks), [20] most bytes in
+        // the write FIFO (all LSB first); wValue STATS_CLEAR clears them
+        case COMMAND_GET_STATS : {
+            uint8_t i;
+            uint32_t v;
+            for (i = 0; i < 8; i++) {
+                Ep0Buffer[i] = 0; // the UART counters read as cleared until they are
+            }
+            if (!statsClear) {
+                v = uartTxBytes;
+                Ep0Buffer[0] = v & 0xFF;
+                Ep0Buffer[1] = (v >> 8) & 0xFF;
+                Ep0Buffer[2] = (v >> 16) & 0xFF;
+                Ep0Buffer[3] = v >> 24;
+                v = uartRxBytes;
+                Ep0Buffer[4] = v & 0xFF;
+                Ep0Buffer[5] = (v >> 8) & 0xFF;
+                Ep0Buffer[6] = (v >> 16) & 0xFF;
+                Ep0Buffer[7] = v >> 24;
+            }
+            Ep0Buffer[8] = rxOverflows & 0xFF;
+            Ep0Buffer[9] = rxOverflows >> 8;
+            Ep0Buffer[10] = statsClear ? 0 : rxFrameErrors & 0xFF;
+            Ep0Buffer[11] = statsClear ? 0 : rxFrameErrors >> 8;
+            Ep0Buffer[12] = usbRequests & 0xFF;
+            Ep0Buffer[13] = (usbRequests >> 8) & 0xFF;
+            Ep0Buffer[14] = (usbRequests >> 16) & 0xFF;
+            Ep0Buffer[15] = usbRequests >> 24;
+            Ep0Buffer[16] = statsClear ? 0 : uartIsrMax & 0xFF;
+            Ep0Buffer[17] = statsClear ? 0 : uartIsrMax >> 8;
+            Ep0Buffer[18] = usbIsrMax & 0xFF;
+            Ep0Buffer[19] = usbIsrMax >> 8;
+            Ep0Buffer[20] = txMaxDepth;
+            if (UsbSetupBuf->wValueL == STATS_CLEAR) {
+                usbRequests = 0;
+                usbIsrMax = 0;
+                txMaxDepth = 0;
+                statsClear = 1;
+            }
+            return 21;
+        } break;
+        // 1 - the UART receives what it sends (the receiver pin is ignored),
+        // 0 - normal operation
+        case COMMAND_SET_LOOPBACK : {
+            loopback = UsbSetupBuf->wValueL;
+            REN = !loopback;
+        } break;
+        // UART1 capture at the rate in wIndex (high) and wValue (low), 0 - off
+        case COMMAND_SET_UART1 : {
+            queueCommand(setupParam());
+        } break;
+        case COMMAND_SET_BULK : {
+            bulkMode = UsbSetupBuf->wValueL;
+        } break;
+        // [0] bytes in the read ring, [1..2] dropped bytes (LSB first),
+        // [3..4] free space in the write FIFO (LSB first), [5] UART_* flags,
+        // [6] bytes in the UART1 ring, [7..8] UART1 bytes dropped (LSB first)
+        case COMMAND_GET_UART_STATUS : {
+            uint16_t txFree = TX_FREE;
+            uint8_t flags = uartFlags;
+            if (rxOverflows != rxOverflowsSeen) {
+                flags |= UART_RX_OVERFLOW;
+                rxOverflowsSeen = rxOverflows;
+            }
+            if (TX_COUNT || !txIdle) {
+                flags |= UART_TX_BUSY;
+            }
+            Ep0Buffer[0] = RX_COUNT;
+            Ep0Buffer[1] = rxOverflows & 0xFF;
+            Ep0Buffer[2] = rxOverflows >> 8;
+            Ep0Buffer[3] = txFree & 0xFF;
+            Ep0Buffer[4] = txFree >> 8;
+            Ep0Buffer[5] = flags;
+            Ep0Buffer[6] = U1_COUNT;
+            Ep0Buffer[7] = u1Overflows & 0xFF;
+            Ep0Buffer[8] = u1Overflows >> 8;
+            uartFlags = 0;
+            return 9;
         } break;
         //jump to bootloader - remotely triggered from the Host!
         case COMMAND_JUMP_TO_BOOTLOADER : {
@@ -157,14 +1115,179 @@ static void handleVendorDataTransfer()
     switch (UsbIntrSetupReq) {
         // Ah! The data for uart write arrived.
         case COMMAND_WRITE_UART : {
-            LED = 1;
-            inProgress = 1;
-            // copy the contents of the EP0 buffer into the uart write buffer
-            memcpy(uartBufW, Ep0Buffer, USB_RX_LEN);
-            bufLenW = USB_RX_LEN;
-            command = COMMAND_WRITE_UART;
-            LED = 0;
+            // the host keeps within the free space reported by the status
+            pushTx(Ep0Buffer, USB_RX_LEN);
+        } break;
+        case COMMAND_SET_GPIO_SEQ : {
+            uint8_t l = USB_RX_LEN / GPIO_SEQ_STEP;
+            xramCopy(gpioSeq, Ep0Buffer, l * GPIO_SEQ_STEP);
+            gpioSeqLeft = l;
+            queueCommand(0);
+        } break;
+        case COMMAND_RUN_SCRIPT : {
+            scriptState = SCRIPT_BUSY;
+            scriptLen = USB_RX_LEN;
+            xramCopy(script, Ep0Buffer, scriptLen);
+            queueCommand(0);
+        } break;
+        case COMMAND_SET_CONFIG : {
+            configWriting = 1;
+            xramCopy(configBuf, Ep0Buffer, CONFIG_LEN);
+            queueCommand(0);
+        } break;
+        case COMMAND_SET_TRIGGER : {
+            xramCopy(triggerPat, Ep0Buffer, TRIGGER_MAX * TRIGGER_LEN);
+            queueCommand(setupParam());
+        } break;
+        case COMMAND_SYNC :
+        case COMMAND_BOOT_PROFILE : {
+            uint8_t l = USB_RX_LEN / GPIO_SEQ_STEP;
+            if (UsbIntrSetupReq == COMMAND_SYNC) {
+                syncState = SYNC_BUSY;
+            }
+            xramCopy(gpioSeq, Ep0Buffer, l * GPIO_SEQ_STEP);
+            gpioSeqLeft = l;
+            queueCommand(setupParam());
+        } break;
+        // [0..3] sequence number of the first block, [4..5] block size,
+        // [6] padding byte (all LSB first)
+        case COMMAND_FLASH_FRAME : {
+            frameSeq = Ep0Buffer[0] | (Ep0Buffer[1] << 8) |
+                ((uint32_t)Ep0Buffer[2] << 16) | ((uint32_t)Ep0Buffer[3] << 24);
+            frameBlockSize = Ep0Buffer[4] | (Ep0Buffer[5] << 8);
+            framePad = Ep0Buffer[6];
+            frameState = FRAME_CHECKSUM;
+        } break;
+    }
+}
+
+/*******************************************************************************
+* Setup of the bulk endpoints, called whenever the USB endpoints are
+* (re)initialised.
+*
+* Both EP2 directions are double buffered: the buffer is selected by the
+* data toggle bit, so the host can send the next OUT packet while the previous
+* one is still being written to UART. EP1 only sends short notifications.
+*******************************************************************************/
+static void initVendorEndpoints()
+{
+    UEP1_DMA = (uint16_t) ep1Buf;
+    UEP4_1_MOD = UEP4_1_MOD & ~(bUEP1_RX_EN | bUEP1_BUF_MOD) | bUEP1_TX_EN;
+    UEP1_CTRL = bUEP_AUTO_TOG | UEP_T_RES_NAK;
+    UEP1_T_LEN = 0;
+    ep1Busy = 0;
+
+    UEP2_DMA = (uint16_t) ep2Buf;
+    UEP2_3_MOD |= bUEP2_RX_EN | bUEP2_TX_EN | bUEP2_BUF_MOD;
+    UEP2_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+    UEP2_T_LEN = 0;
+    ep2OutLen[0] = 0;
+    ep2OutLen[1] = 0;
+    ep2OutHead = 0;
+    ep2InBusy = 0;
+    bulkMode = 0;
+}
+
+// move the bulk OUT packets to the UART write FIFO while they fit and hand
+// the buffers back to the host, called from the USB interrupt or with the
+// interrupts disabled
+static void moveBulkOut()
+{
+    while (BULK_OUT_READY) {
+        pushTx(EP2_OUT_BUF(ep2OutHead), ep2OutLen[ep2OutHead]);
+        ep2OutLen[ep2OutHead] = 0;
+        ep2OutHead ^= 1;
+        UEP2_CTRL = UEP2_CTRL & ~MASK_UEP_R_RES | UEP_R_RES_ACK;
+    }
+}
+
+// copy the data received from UART into the bulk IN buffer and arm it,
+// called from the USB interrupt or with the interrupts disabled
+static void armBulkIn()
+{
+    UEP2_T_LEN = readUartData(EP2_IN_BUF((UEP2_CTRL & bUEP_T_TOG) ? 1 : 0), EP2_SIZE);
+    UEP2_CTRL = UEP2_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_ACK;
+    ep2InBusy = 1;
+}
+
+// tell the host that UART data are waiting in the read ring,
+// called from the UART interrupt
+static void notifyRxReady(uint8_t flags) __using (LOW_ISR_BANK)
+{
+    // busy first: the USB interrupt may complete the transfer right after ACK
+    ep1Busy = 1;
+    ep1Buf[0] = RX_COUNT;
+    ep1Buf[1] = flags;
+    UEP1_T_LEN = NOTIFY_LEN;
+    UEP1_CTRL = UEP1_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_ACK;
+}
+
+/*******************************************************************************
+* Handler of the transfers on the bulk and interrupt endpoints. Called from
+* the USB interrupt.
+*******************************************************************************/
+static void handleVendorEndpointTransfer()
+{
+    switch (USB_INT_ST & (MASK_UIS_TOKEN | MASK_UIS_ENDP)) {
+        // UART data arrived from the host
+        case UIS_TOKEN_OUT | 2 : {
+            uint8_t b;
+            if (!U_TOG_OK) {
+                break; // out of sync packet: drop it
+            }
+            b = (UEP2_CTRL & bUEP_R_TOG) ? 1 : 0;
+            UEP2_CTRL ^= bUEP_R_TOG;
+            if (USB_RX_LEN == 0) {
+                break;
+            }
+            ep2OutLen[b] = USB_RX_LEN;
+            // both buffers are full: hold off the host until one is written out
+            if (ep2OutLen[b ^ 1]) {
+                UEP2_CTRL = UEP2_CTRL & ~MASK_UEP_R_RES | UEP_R_RES_NAK;
+            }
+            moveBulkOut();
         } break;
+        // the host got the notification, a trigger hit may wait for it
+        case UIS_TOKEN_IN | 1 : {
+            if (triggerNotify) {
+                triggerNotify = 0;
+                ep1Buf[0] = RX_COUNT;
+                ep1Buf[1] = NOTIFY_TRIGGER;
+                UEP1_T_LEN = NOTIFY_LEN;
+                break;
+            }
+            UEP1_CTRL = UEP1_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_NAK;
+            ep1Busy = 0;
+        } break;
+        // UART data were collected by the host: pass on the next ones straight away
+        case UIS_TOKEN_IN | 2 : {
+            UEP2_CTRL ^= bUEP_T_TOG;
+            if (RX_PENDING) {
+                armBulkIn();
+            } else {
+                UEP2_CTRL = UEP2_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_NAK;
+                ep2InBusy = 0;
+            }
+        } break;
+    }
+}
+
+// the USB interrupt starts and ends: its duration goes into usbIsrMax and
+// usbIsrTicks
+static void usbIsrEnter()
+{
+    TIMER0_READ(usbIsrStart);
+}
+
+static void usbIsrExit()
+{
+    uint16_t t;
+
+    TIMER0_READ(t);
+    t -= usbIsrStart;
+    usbIsrTicks += t;
+    if (t > usbIsrMax) {
+        usbIsrMax = t;
     }
 }
 
@@ -177,87 +1300,903 @@ static void setupGPIO()
     //ESP_ENABLE, ESP_RESET, ESP_BOOT: output
     P3_MOD_OC &=  ~((1 << PIN_ESP_ENABLE) | (1 << PIN_ESP_RESET) | (1 << PIN_ESP_BOOT) );
     P3_DIR_PU |= (1 << PIN_ESP_ENABLE) | (1 << PIN_ESP_RESET) | (1 << PIN_ESP_BOOT);
+
+    //I2C bus idle: both lines released (quasi-bidirectional after reset)
+    I2C_SDA = 1;
+    I2C_SCL = 1;
 }
 
 
-// this delay can be interrupted, so we can exit earlier if needed
-static uint8_t delayNonBlocking(uint16_t d)
+// pass the bulk OUT packets the USB interrupt could not fit into the FIFO
+static void writeBulkOut()
 {
-    while (d) {
-        mDelaymS(1);
-        // delay interrupted when a new value is set into the command 
-        if (command) {
-            return 0;
+    EA = 0;
+    moveBulkOut();
+    EA = 1;
+}
+
+// arm the bulk IN endpoint with the data received from UART
+static void readBulkIn()
+{
+    EA = 0;
+    armBulkIn();
+    EA = 1;
+}
+
+// returns 1 if there was anything to do
+static uint8_t serviceBulk()
+{
+    uint8_t busy = 0;
+
+    if (BULK_OUT_READY) {
+        writeBulkOut();
+        busy = 1;
+    }
+    if (RX_PENDING && bulkMode && !ep2InBusy) {
+        readBulkIn();
+        busy = 1;
+    }
+    return busy;
+}
+
+// wait 'us' microseconds, the UART data keep flowing meanwhile
+static void delayServiced(uint16_t us)
+{
+    while (us > 100) {
+        mDelayuS(100);
+        us -= 100;
+        serviceBulk();
+    }
+    mDelayuS(us);
+}
+
+// the UART0 rate changes: the boot log notes the first change after a release
+static void noteBootLogRate(uint32_t rate)
+{
+    if (rate != uartRate && bootLogChange == BOOT_LOG_NO_CHANGE &&
+        bootLogLen < BOOT_LOG_SIZE) {
+        bootLogRate[1] = rate;
+        bootLogChange = bootLogLen;
+    }
+    uartRate = rate;
+}
+
+// the divisor of BAUD_CLOCK closest to 'baud', both UARTs use it. The 32 bit
+// divisions are kept out of the interrupts: the sdcc library routines are not
+// reentrant.
+static uint16_t baudDivisor(uint32_t baud)
+{
+    uint32_t div = (BAUD_CLOCK + baud / 2) / baud;
+
+    if (div < 1) {
+        div = 1;
+    } else
+    if (div > BAUD_DIV_MAX) {
+        div = BAUD_DIV_MAX;
+    }
+    return div;
+}
+
+// pick the Timer1 divisor closest to the requested rate and, unless it is a
+// probe, switch UART0 to it
+static void setBaudRate(uint32_t request)
+{
+    uint32_t baud = request & ~BAUD_PROBE;
+    uint32_t rate;
+    uint32_t ratio;
+    int16_t err;
+
+    rate = BAUD_CLOCK / baudDivisor(baud);
+    ratio = rate * 1000 / baud;
+    err = ratio > 32767 ? 32767 : (int16_t) ratio - 1000;
+
+    if (!(request & BAUD_PROBE)) {
+        rxTail = rxHead; //scrap data from read buffer
+        TR1 = 0; //Stop timer 1
+        TI = 0;
+        mInitSTDIOBaud(rate); //sets TI: resumes the write FIFO
+        REN = !loopback;
+        noteBootLogRate(rate);
+    }
+
+    EA = 0;
+    baudError = err;
+    baudResult = rate;
+    baudPending--;
+    EA = 1;
+}
+
+// start the UART1 capture at 'rate' or stop it (0), only its receiver is
+// used: the TX pin stays a GPIO
+static void setUart1(uint32_t rate)
+{
+    IE_UART1 = 0;
+    U1REN = 0;
+    uart1On = 0;
+    if (!rate) {
+        return;
+    }
+    U1SM0 = 0;
+    U1SMOD = 1; // FREQ_SYS / 16 / (256 - SBAUD1)
+    SBAUD1 = 256 - baudDivisor(rate);
+    U1RI = 0;
+    u1Tail = u1Head;
+    uart1On = 1;
+    U1REN = 1;
+    IE_UART1 = 1;
+}
+
+// loader command header of the next FLASH_DATA packet (little endian)
+static void buildFrameHeader() __using (LOW_ISR_BANK)
+{
+    uint16_t size = frameBlockSize + FLASH_DATA_HDR_LEN - 8;
+    uint8_t i;
+
+    for (i = 0; i < FLASH_DATA_HDR_LEN; i++) {
+        frameHdr[i] = 0;
+    }
+    frameHdr[1] = FLASH_DATA_CMD;
+    frameHdr[2] = size & 0xFF;
+    frameHdr[3] = size >> 8;
+    frameHdr[4] = frameChecksum;
+    frameHdr[8] = frameBlockSize & 0xFF;
+    frameHdr[9] = frameBlockSize >> 8;
+    frameHdr[12] = frameSeq & 0xFF;
+    frameHdr[13] = (frameSeq >> 8) & 0xFF;
+    frameHdr[14] = (frameSeq >> 16) & 0xFF;
+    frameHdr[15] = frameSeq >> 24;
+}
+
+// the write FIFO was found empty: mark the UART idle unless the USB interrupt
+// queued bytes since the test, it only kicks the UART off when txIdle is set.
+// Called from the UART interrupt, returns 1 if the UART went idle.
+static uint8_t txGoIdle(void) __using (LOW_ISR_BANK)
+{
+    EA = 0;
+    if (txHead == txTail) {
+        txIdle = 1;
+    }
+    EA = 1;
+    return txIdle;
+}
+
+// send the next byte of the FLASH_DATA packet, called from the UART interrupt
+static void sendFrameByte() __using (LOW_ISR_BANK)
+{
+    uint8_t c;
+
+    // the block prefix produces no output: take it all at once
+    while (frameState < FRAME_HEADER) {
+        if (txHead == txTail && txGoIdle()) {
+            return;
+        }
+        c = txFifo[txTail];
+        txTail++;
+        if (frameState == FRAME_CHECKSUM) {
+            frameChecksum = c;
+        } else
+        if (frameState == FRAME_LEN_LO) {
+            frameDataLen = c;
+        } else {
+            frameDataLen |= c << 8;
+            buildFrameHeader();
+            frameIndex = 0;
+        }
+        frameState++;
+    }
+
+    if (frameState == FRAME_HEADER) {
+        if (frameIndex == 0) {
+            UART_SEND(SLIP_END);
+            frameIndex++;
+            return;
+        }
+        c = frameHdr[frameIndex - 1];
+        if (frameIndex++ == FLASH_DATA_HDR_LEN) {
+            frameLeft = frameBlockSize;
+            frameState = FRAME_DATA;
+        }
+    } else {
+        if (frameLeft == 0) {
+            UART_SEND(SLIP_END);
+            frameSeq++;
+            frameState = FRAME_CHECKSUM;
+            return;
+        }
+        if (frameDataLen) {
+            if (txHead == txTail && txGoIdle()) {
+                return;
+            }
+            c = txFifo[txTail];
+            txTail++;
+            frameDataLen--;
+        } else {
+            c = framePad;
+        }
+        frameLeft--;
+    }
+
+    if (c == SLIP_END) {
+        UART_SEND(SLIP_ESC);
+        txEscape = SLIP_ESC_END;
+    } else
+    if (c == SLIP_ESC) {
+        UART_SEND(SLIP_ESC);
+        txEscape = SLIP_ESC_ESC;
+    } else {
+        UART_SEND(c);
+    }
+}
+
+// SLIP receive mode: decode the byte into the frame being received and
+// publish the frame at its closing delimiter, called from the UART interrupt
+static void receiveFrameByte(uint8_t c) __using (LOW_ISR_BANK)
+{
+    if (c == SLIP_END) {
+        if (rxFrameState == RX_FRAME_OPEN && rxFrameLen) {
+            rxRing[rxFrameStart & RX_RING_MASK] = rxFrameLen;
+            rxRing[(uint8_t)(rxFrameStart + 1) & RX_RING_MASK] = rxFrameFlags;
+            rxHead = rxFrameStart + 2 + rxFrameLen;
+            rxFrameState = RX_FRAME_IDLE;
+            if (rxFrameLen >= 2 &&
+                rxRing[(uint8_t)(rxFrameStart + 2) & RX_RING_MASK] == SYNC_REPLY_DIR &&
+                rxRing[(uint8_t)(rxFrameStart + 3) & RX_RING_MASK] == SYNC_REPLY_CMD) {
+                syncSeen = 1;
+            }
+            if (!bulkMode && !ep1Busy) {
+                notifyRxReady(NOTIFY_SLIP_END);
+            }
+        } else
+        if (rxFrameState == RX_FRAME_DROP) {
+            rxFrameState = RX_FRAME_IDLE;
+        } else
+        // opening delimiter, repeated ones just open the frame again
+        if (RX_COUNT <= RX_RING_SIZE - 2) {
+            rxFrameState = RX_FRAME_OPEN;
+            rxFrameStart = rxHead;
+            rxFrameLen = 0;
+            rxFrameFlags = 0;
+            rxFrameEscape = 0;
+        } else {
+            rxFrameState = RX_FRAME_DROP;
+            rxOverflows++;
+        }
+        return;
+    }
+    if (rxFrameState != RX_FRAME_OPEN) {
+        return;
+    }
+
+    if (rxFrameEscape) {
+        rxFrameEscape = 0;
+        if (c == SLIP_ESC_END) {
+            c = SLIP_END;
+        } else
+        if (c == SLIP_ESC_ESC) {
+            c = SLIP_ESC;
+        } else {
+            rxFrameFlags |= RX_FRAME_ESCAPE;
+            rxFrameErrors++;
+        }
+    } else
+    if (c == SLIP_ESC) {
+        rxFrameEscape = 1;
+        return;
+    }
+
+    if ((uint8_t)(rxFrameStart + 2 + rxFrameLen - rxTail) < RX_RING_SIZE) {
+        rxRing[(uint8_t)(rxFrameStart + 2 + rxFrameLen) & RX_RING_MASK] = c;
+        rxFrameLen++;
+    } else
+    if (!(rxFrameFlags & RX_FRAME_TRUNCATED)) {
+        rxFrameFlags |= RX_FRAME_TRUNCATED;
+        rxOverflows++;
+    }
+}
+
+// boot profile: note the time of a line end, called from the UART interrupt
+static void timeBootLine(void) __using (LOW_ISR_BANK)
+{
+    uint32_t t;
+
+    if (BOOT_TIMES_COUNT == BOOT_TIMES_SIZE) {
+        bootLost = 1;
+        return;
+    }
+    TIMER_NOW(t);
+    bootTimes[bootHead & BOOT_TIMES_MASK] = t - bootStart;
+    bootHead++;
+}
+
+// pattern trigger: the byte goes into the history and the patterns ending
+// with it are compared backwards against it
+static void matchTrigger(uint8_t c) __using (LOW_ISR_BANK)
+{
+    uint8_t p;
+
+    triggerHist[(uint8_t)triggerCount & TRIGGER_MASK] = c;
+    triggerCount++;
+    for (p = 0; p < TRIGGER_MAX; p++) {
+        __xdata uint8_t* pat = triggerPat + p * TRIGGER_LEN;
+        uint8_t n = triggerLen[p];
+        uint8_t i;
+
+        if (!n || n > triggerCount || pat[n - 1] != c) {
+            continue;
+        }
+        for (i = 1; i < n; i++) {
+            if (pat[n - 1 - i] != triggerHist[(uint8_t)(triggerCount - 1 - i) & TRIGGER_MASK]) {
+                break;
+            }
+        }
+        if (i == n) {
+            uint32_t t;
+            TIMER_NOW(t);
+            triggerTime = t - triggerTime;
+            triggerHit = p;
+            triggerState = TRIGGER_HIT;
+            // the USB interrupt sends it once the pending notification is taken
+            triggerNotify = 1;
+            if (!ep1Busy) {
+                triggerNotify = 0;
+                notifyRxReady(NOTIFY_TRIGGER);
+            }
+            return;
         }
-        d --;
     }
-    return 1;
 }
 
-void writeUart() {
-    uint8_t i = 0;
+// Timer0 overflow: the upper half of the 32 bit time, it also paces the LED
+void TIMER0_ISR(void) __interrupt (INT_NO_TMR0) __using (LOW_ISR_BANK) {
+    timer0Overflows++;
+}
+
+// serial port 0 interrupt: a character was received and/or sent, its duration
+// in uartIsrMax leaves out the USB interrupts taken meanwhile
+void UART0_ISR(void) __interrupt (INT_NO_UART0) __using (LOW_ISR_BANK) {
     uint8_t c;
-    while (i < bufLenW) {
-        c = uartBufW[i];
-        PUT_CHAR(c);
-        i++;
+    uint8_t rx = 0;
+    uint16_t start;
+    uint16_t usb;
+    uint16_t usbEnd;
+    uint16_t t;
+
+    TIMER0_READ(start);
+    USB_TICKS_READ(usb);
+    if (statsClear) {
+        statsClear = 0;
+        uartTxBytes = 0;
+        uartRxBytes = 0;
+        rxFrameErrors = 0;
+        uartIsrMax = 0;
+    }
+
+    if (TI) {
+        TI = 0;
+        if (txEscape) {
+            UART_SEND(txEscape);
+            txEscape = 0;
+        } else
+        if (frameState) {
+            sendFrameByte();
+        } else
+        if (txHead != txTail || !txGoIdle()) {
+            UART_SEND(txFifo[txTail]);
+            txTail++;
+        }
+        if (!txIdle) {
+            uartTxBytes++;
+            if (loopback) {
+                c = txLast;
+                rx = 1;
+            }
+        }
+    }
+    if (RI) {
+        c = SBUF;
+        RI = 0;
+        rx = 1;
+    }
+    if (rx) {
+        uartRxBytes++;
+        if (bootLogLen < BOOT_LOG_SIZE) {
+            bootLog[bootLogLen] = c;
+            bootLogLen++;
+        }
+        if (triggerState == TRIGGER_ARMED) {
+            matchTrigger(c);
+        }
+        if (rxFrames) {
+            receiveFrameByte(c);
+        } else {
+            if (RX_COUNT == RX_RING_SIZE) {
+                rxOverflows++;
+            } else {
+                rxRing[rxHead & RX_RING_MASK] = c;
+                rxHead++;
+            }
+            if (c == '\n' && bootProfiling) {
+                timeBootLine();
+            }
+
+            //wake up the host waiting on EP1: first byte in the ring or end of a SLIP frame
+            if (!bulkMode && !ep1Busy && (RX_COUNT == 1 || c == 0xC0)) {
+                notifyRxReady(c == 0xC0 ? NOTIFY_SLIP_END : 0);
+            }
+        }
+    }
+
+    TIMER0_READ(t);
+    USB_TICKS_READ(usbEnd);
+    t -= start + (usbEnd - usb);
+    if (t > uartIsrMax) {
+        uartIsrMax = t;
     }
-    bufLenW = 0;
 }
 
-#if 0
-void serialOutStr(char* str) {
-    while (*str) {
-        PUT_CHAR(*str);
-        str++;
+// serial port 1 interrupt: a character of the UART1 capture was received
+void UART1_ISR(void) __interrupt (INT_NO_UART1) __using (LOW_ISR_BANK) {
+    uint8_t c = SBUF1;
+
+    U1RI = 0;
+    if (U1_COUNT == U1_RING_SIZE) {
+        u1Overflows++;
+    } else {
+        u1Ring[u1Head & U1_RING_MASK] = c;
+        u1Head++;
+    }
+    //wake up the host waiting on EP1
+    if (UART1_MUX && !bulkMode && !ep1Busy && U1_COUNT == 1) {
+        notifyRxReady(0);
     }
 }
-#endif
 
-// interrupt is triggered when the first bit of the serial data
-// is transferrred. That is: RX goes Hi->Lo
-void UART0_ISR(void) __interrupt (INT_NO_GPIO) {
-    uint16_t safety = 0xFFFF;
-
-    //wait until the whole character is read or until
-    //the safety counter expires
-    while (safety--) {
-        if (RI) goto char_ready;
-        if (RI) goto char_ready;
-        if (RI) goto char_ready;
-    }
-    return;
-
-char_ready:
-    //store the character to the read buffer
-    uartBufR[bufLenR] = SBUF;
-    //Clear the interrup flag
-    RI = 0;
-    //position to the next index in the read buffer 
-    bufLenR++;
-
-    //handle buffer overfow
-    if (bufLenR > 31) {
-        bufLenR = 0;
-    };
-} 
-
-static void setGpio(void) {
+// the ESP comes out of reset: restart the boot log recorder, an armed
+// trigger times the boot from here. Called with the interrupts on or off.
+static void startBootLog(void) {
+    uint8_t ea = EA;
+
+    bootLogRate[0] = uartRate;
+    bootLogChange = BOOT_LOG_NO_CHANGE;
+    bootLogResets++;
+    bootLogLen = 0;
+    EA = 0;
+    if (triggerState == TRIGGER_ARMED) {
+        TIMER_NOW(triggerTime);
+    }
+    EA = ea;
+}
+
+static void setGpio(uint8_t pins) {
+    uint8_t held = !ESP_RESET || !ESP_ENABLE;
+
     //ESP power-on sequence: VDD, RESET, ENable (See datasheet 5.1 Electrical characteristics)
 
     //GPIO0
-    ESP_BOOT = data & 1;
-    data >>= 1;
+    ESP_BOOT = pins & 1;
+    pins >>= 1;
     mDelaymS(2);
 
-    ESP_RESET =  data & 1;
-    data >>= 1;
+    ESP_RESET =  pins & 1;
+    pins >>= 1;
     mDelaymS(2);
 
-    ESP_ENABLE = data & 1;
+    ESP_ENABLE = pins & 1;
+    if (held && ESP_RESET && ESP_ENABLE) {
+        startBootLog();
+    }
+}
+
+// set the ESP pins as in COMMAND_SET_GPIO, all at once
+static void setPins(uint8_t pins) {
+    uint8_t held = !ESP_RESET || !ESP_ENABLE;
+
+    ESP_BOOT = pins & 1;
+    ESP_RESET = (pins >> 1) & 1;
+    ESP_ENABLE = (pins >> 2) & 1;
+    if (held && ESP_RESET && ESP_ENABLE) {
+        startBootLog();
+    }
+}
+
+// set the ESP pins step by step until 'keep' steps are left, the delays are
+// timed here and not on the host. Returns the next step.
+static __xdata uint8_t* runGpioSequence(uint8_t keep) {
+    __xdata uint8_t* step = gpioSeq;
+
+    while (gpioSeqLeft > keep) {
+        setPins(step[0]);
+        delayServiced(step[1] | (step[2] << 8));
+        step += GPIO_SEQ_STEP;
+        gpioSeqLeft--;
+    }
+    return step;
+}
+
+// queue the SYNC request, the UART write path is drained at this point
+static void pushSyncFrame(void)
+{
+    uint8_t i;
+
+    EA = 0;
+    for (i = 0; i < sizeof(syncFrame); i++) {
+        txFifo[txHead] = syncFrame[i];
+        txHead++;
+    }
+    if (txIdle) {
+        txIdle = 0;
+        TI = 1;
+    }
+    EA = 1;
+}
+
+// reset the ESP into its ROM loader and send SYNC requests until one of them
+// is answered: 'param' holds the tries (bits 0-7) and the reply timeout in ms
+// (bits 16-31). The replies stay in the read ring for the host, the noise
+// received before each request is dropped. Returns 1 on a reply.
+static uint8_t runSync(uint32_t param)
+{
+    uint8_t maxTries = param & 0xFF;
+    uint16_t timeout = param >> 16;
+    uint16_t t;
+    uint8_t i;
+
+    EA = 0;
+    frameState = FRAME_OFF;
+    rxFrames = 1;
+    rxFrameState = RX_FRAME_IDLE;
+    EA = 1;
+    runGpioSequence(0);
+
+    syncTries = 0;
+    syncElapsed = 0;
+    syncSeen = 0;
+    while (!syncSeen && syncTries < maxTries) {
+        EA = 0;
+        rxTail = rxHead;
+        EA = 1;
+        pushSyncFrame();
+        syncTries++;
+        for (t = timeout; t && !syncSeen; t--) {
+            for (i = 0; i < 10 && !syncSeen; i++) {
+                mDelayuS(100);
+                serviceBulk();
+            }
+            syncElapsed++;
+        }
+    }
+    syncState = syncSeen ? SYNC_DONE : SYNC_FAILED;
+    return syncSeen;
+}
+
+// reset the ESP with the queued steps and start timing the lines of its boot
+// log against the moment the last step releases it (its delay is not used).
+// Returns 0 without any step.
+static uint8_t runBootProfile(void)
+{
+    __xdata uint8_t* step;
+
+    if (!gpioSeqLeft) {
+        return 0;
+    }
+
+    EA = 0;
+    frameState = FRAME_OFF;
+    rxFrames = 0;
+    bootProfiling = 0;
+    bootHead = 0;
+    bootTail = 0;
+    bootLost = 0;
+    EA = 1;
+    step = runGpioSequence(1);
+
+    EA = 0;
+    rxTail = rxHead; // the log starts with the release
+    setPins(step[0]);
+    TIMER_NOW(bootStart);
+    bootProfiling = 1;
+    gpioSeqLeft = 0;
+    EA = 1;
+    return 1;
+}
+
+// I2C master, bit-banged on the quasi-bidirectional pins: a line is released
+// by writing 1, the bus needs pull-ups. No clock stretching.
+static void i2cDelay(void)
+{
+    mDelayuS(I2C_DELAY_US);
+}
+
+// (repeated) start condition, SCL is left low
+static void i2cStart(void)
+{
+    I2C_SDA = 1;
+    I2C_SCL = 1;
+    i2cDelay();
+    I2C_SDA = 0;
+    i2cDelay();
+    I2C_SCL = 0;
+    i2cDelay();
+}
+
+static void i2cStop(void)
+{
+    I2C_SDA = 0;
+    i2cDelay();
+    I2C_SCL = 1;
+    i2cDelay();
+    I2C_SDA = 1;
+    i2cDelay();
+}
+
+// returns I2C_ACK or I2C_NAK
+static uint8_t i2cWrite(uint8_t c)
+{
+    uint8_t i;
+    uint8_t nak;
+
+    for (i = 0; i < 8; i++) {
+        I2C_SDA = (c & 0x80) ? 1 : 0;
+        c <<= 1;
+        i2cDelay();
+        I2C_SCL = 1;
+        i2cDelay();
+        I2C_SCL = 0;
+    }
+    I2C_SDA = 1;
+    i2cDelay();
+    I2C_SCL = 1;
+    i2cDelay();
+    nak = I2C_SDA;
+    I2C_SCL = 0;
+    i2cDelay();
+    return nak ? I2C_NAK : I2C_ACK;
+}
+
+// 'more' acknowledges the byte: the slave sends the next one
+static uint8_t i2cRead(uint8_t more)
+{
+    uint8_t i;
+    uint8_t c = 0;
+
+    for (i = 0; i < 8; i++) {
+        I2C_SDA = 1;
+        i2cDelay();
+        I2C_SCL = 1;
+        i2cDelay();
+        c = (c << 1) | I2C_SDA;
+        I2C_SCL = 0;
+    }
+    I2C_SDA = more ? 0 : 1;
+    i2cDelay();
+    I2C_SCL = 1;
+    i2cDelay();
+    I2C_SCL = 0;
+    i2cDelay();
+    return c;
+}
+
+// address the slave, read 'n' bytes into 'dst' and stop, 0xFF for each byte
+// if it did not answer. Returns I2C_ACK or I2C_NAK.
+static uint8_t i2cReadBytes(uint8_t addr, __xdata uint8_t* dst, uint8_t n)
+{
+    uint8_t ack;
+
+    i2cStart();
+    ack = i2cWrite((addr << 1) | 1);
+    while (n) {
+        n--;
+        *dst = ack == I2C_ACK ? i2cRead(n) : 0xFF;
+        dst++;
+    }
+    i2cStop();
+    return ack;
+}
+
+// 8 bit sample of AIN0 (P1.1) or AIN2 (P1.5), the pin is a plain input
+// meanwhile
+static uint8_t readAdc(uint8_t channel)
+{
+    uint8_t m = channel ? 1 << 5 : 1 << 1;
+    uint8_t v;
+
+    P1_MOD_OC &= ~m;
+    P1_DIR_PU &= ~m;
+    ADC_CFG = bADC_EN | bADC_CLK;
+    ADC_CHAN1 = channel >> 1;
+    ADC_CHAN0 = channel & 1;
+    mDelayuS(100); // the ADC powers up and the input settles
+    ADC_IF = 0;
+    ADC_START = 1;
+    while (ADC_START);
+    v = ADC_DATA;
+    ADC_CFG = 0;
+    P1_MOD_OC |= m;
+    P1_DIR_PU |= m;
+    return v;
+}
+
+// run the queued peripheral script, the results go to scriptResults.
+// Stops at the first op that can not be done. Returns 1 if all were done.
+static uint8_t runScript(void)
+{
+    __xdata uint8_t* op = script;
+    __xdata uint8_t* end = script + scriptLen;
+    __xdata uint8_t* res = scriptResults;
+    uint8_t ok = 1;
+
+    scriptOps = 0;
+    while (ok && op < end) {
+        uint8_t code = op[0];
+        uint8_t len = 2;  // op with its operands
+        uint8_t rlen = 0; // its results
+
+        switch (code) {
+            case SCRIPT_SET :
+            case SCRIPT_I2C_READ :
+            case SCRIPT_DELAY :
+                len = 3;
+                break;
+            case SCRIPT_I2C_REG :
+                len = 4;
+                break;
+            case SCRIPT_I2C_WRITE :
+                len = op + 2 < end && op[2] < SCRIPT_MAX ? 3 + op[2] : 0xFF;
+                break;
+        }
+        if (code == SCRIPT_GET || code == SCRIPT_ADC || code == SCRIPT_I2C_WRITE) {
+            rlen = 1;
+        } else
+        // the byte count is the last operand
+        if (code == SCRIPT_I2C_READ || code == SCRIPT_I2C_REG) {
+            rlen = op[len - 1] < SCRIPT_RESULT_MAX ? 1 + op[len - 1] : 0xFF;
+        }
+        if (len > end - op || rlen > scriptResults + SCRIPT_RESULT_MAX - res) {
+            break;
+        }
+
+        switch (code) {
+            case SCRIPT_SET : {
+                uint8_t m = 1 << (op[1] & 7);
+                ok = op[1] < 8 && (m & SCRIPT_PINS);
+                if (ok) {
+                    P1 = op[2] ? P1 | m : P1 & ~m;
+                }
+            } break;
+            case SCRIPT_GET : {
+                uint8_t m = 1 << (op[1] & 7);
+                ok = op[1] < 8 && (m & SCRIPT_PINS);
+                res[0] = (P1 & m) ? 1 : 0;
+            } break;
+            case SCRIPT_ADC : {
+                ok = op[1] == 0 || op[1] == 2;
+                if (ok) {
+                    res[0] = readAdc(op[1]);
+                }
+            } break;
+            case SCRIPT_I2C_WRITE : {
+                uint8_t i;
+                i2cStart();
+                res[0] = i2cWrite(op[1] << 1);
+                for (i = 0; i < op[2] && res[0] == I2C_ACK; i++) {
+                    res[0] = i2cWrite(op[3 + i]);
+                }
+                i2cStop();
+            } break;
+            case SCRIPT_I2C_READ : {
+                res[0] = i2cReadBytes(op[1], res + 1, op[2]);
+            } break;
+            // register address write, then a read after a repeated start
+            case SCRIPT_I2C_REG : {
+                uint8_t n = op[3];
+                uint8_t i;
+                i2cStart();
+                res[0] = i2cWrite(op[1] << 1);
+                if (res[0] == I2C_ACK) {
+                    res[0] = i2cWrite(op[2]);
+                }
+                if (res[0] == I2C_ACK) {
+                    res[0] = i2cReadBytes(op[1], res + 1, n);
+                } else {
+                    for (i = 1; i <= n; i++) {
+                        res[i] = 0xFF;
+                    }
+                    i2cStop();
+                }
+            } break;
+            case SCRIPT_DELAY : {
+                delayServiced(op[1] | (op[2] << 8));
+            } break;
+            default:
+                ok = 0;
+        }
+        if (ok) {
+            op += len;
+            res += rlen;
+            scriptOps++;
+        }
+    }
+
+    ok = op == end;
+    scriptResultLen = res - scriptResults;
+    scriptState = ok ? SCRIPT_DONE : SCRIPT_FAILED;
+    return ok;
+}
+
+// arm the patterns received with COMMAND_SET_TRIGGER, 'lens' as its wValue
+static void armTrigger(uint32_t lens)
+{
+    triggerLen[0] = lens & 0xFF;
+    triggerLen[1] = (lens >> 8) & 0xFF;
+    if (!triggerLen[0] && !triggerLen[1]) {
+        return; // just disarmed
+    }
+    EA = 0;
+    TIMER_NOW(triggerTime);
+    triggerCount = 0;
+    triggerHit = 0;
+    triggerNotify = 0;
+    triggerState = TRIGGER_ARMED;
+    EA = 1;
+}
+
+// execute the oldest queued command, returns 0 if it has to wait
+static uint8_t runCommand(void)
+{
+    uint8_t slot = cmdTail & CMD_QUEUE_MASK;
+    uint32_t param = cmdParam[slot];
+    uint8_t status = CMD_DONE;
+
+    switch (cmdType[slot]) {
+        case COMMAND_SET_GPIO : {
+            setGpio(param & 0xFF);
+        } break;
+        case COMMAND_SET_GPIO_SEQ : {
+            runGpioSequence(0);
+        } break;
+        case COMMAND_BOOT_PROFILE : {
+            if (!runBootProfile()) {
+                status = CMD_FAILED;
+            }
+        } break;
+        case COMMAND_SET_BAUDR : {
+            // the bytes written before the change go out at the old rate
+            if (TX_COUNT || !txIdle) {
+                return 0;
+            }
+            setBaudRate(param);
+        } break;
+        case COMMAND_SET_UART1 : {
+            setUart1(param);
+        } break;
+        case COMMAND_RUN_SCRIPT : {
+            if (!runScript()) {
+                status = CMD_FAILED;
+            }
+        } break;
+        case COMMAND_SYNC : {
+            if (!runSync(param)) {
+                status = CMD_FAILED;
+            }
+        } break;
+        case COMMAND_SET_CONFIG : {
+            if (!writeConfig()) {
+                status = CMD_FAILED;
+            }
+            configWriting = 0;
+        } break;
+        case COMMAND_SET_TRIGGER : {
+            armTrigger(param);
+        } break;
+    }
+    cmdStatus[slot] = status;
+    cmdTail++;
+    return 1;
 }
 
 void main() {
+    uint8_t blinkTicks = 0;
+    uint8_t blinkLast = 0;
 
     CfgFsys();   // CH55x main frequency setup
     mDelaymS(5); // wait for the internal crystal to stabilize.
@@ -272,25 +2211,33 @@ void main() {
     // enable UART
     mInitSTDIO();
 
-    command = 0;
+    cmdHead = 0;
+    cmdTail = 0;
+    uartRate = UART0_RATE;
+    bootLogChange = BOOT_LOG_NO_CHANGE;
 
-    //print initial message
-    uartBufW[0] = 'H';
-    uartBufW[1] = 'i';
-    uartBufW[2] = '!';
-    uartBufW[3] = '\r';
-    uartBufW[4] = '\n';
-    bufLenW = 5;
-    writeUart();
-    bufLenR = 0;
+    //print initial message: sent once the interrupts are enabled
+    //(mInitSTDIO leaves TI set)
+    txFifo[0] = 'H';
+    txFifo[1] = 'i';
+    txFifo[2] = '!';
+    txFifo[3] = '\r';
+    txFifo[4] = '\n';
+    txTail = 0;
+    txHead = 5;
+    rxTail = rxHead;
 
     ESP_ENABLE = 0;
     ESP_RESET = 0;
     ESP_BOOT = 0;    
 
+    // Timer0 runs free: the time base of the boot profile and the statistics
+    TMOD = TMOD & ~(bT0_GATE | bT0_CT | MASK_T0_MOD) | bT0_M0;
+    TR0 = 1;
+    ET0 = 1;
+
     IP_EX |= bIP_USB; //boost USB interrupt priority
-    GPIO_IE |= bIE_RXD0_LO; //enable UART0 RX interrupt
-    IE_GPIO = 1; //enable GPIO interrupts
+    ES = 1; //enable UART0 interrupt
     EA = 1; //global interrupts enable
 
     //quick blink to siginfy (re)start
@@ -309,29 +2256,23 @@ void main() {
     LED = 0;
 
 
+    // no delays here: the requests are acted upon as soon as they arrive and
+    // the LED blinks only while the bridge is idle
     while (1) {
-        if (command == COMMAND_WRITE_UART) {
-            command = 0;
-            //this will block until the buffer is sent
-            writeUart();
-            inProgress = 0;
-            LED = 0;
-        } else
-        if (command == COMMAND_SET_GPIO) {
-            command = 0;
-            setGpio();
-        } else
-        if (command == COMMAND_SET_BAUDR) {
-            command = 0;
-            bufLenR = 0; //scrap data from read buffer
-            TR1 = 0; //Stop timer 1
-            TI = 0;
-            REN = 1; //Serial 0 receive diable
-            mInitSTDIOBaud(data == 0 ? 74880 : 115200);
+        if (cmdHead != cmdTail && runCommand()) {
+            blinkTicks = 0;
         }
 
-        if (delayNonBlocking(200)) {
-            LED = !LED;
+        if (serviceBulk()) {
+            blinkTicks = 0;
+        }
+
+        if ((uint8_t)timer0Overflows != blinkLast) {
+            blinkLast = (uint8_t)timer0Overflows;
+            if (++blinkTicks >= BLINK_TICKS) {
+                blinkTicks = 0;
+                LED = !LED;
+            }
         }
     }
 }